@@ -14,7 +14,12 @@
 static UINT SwitchCommThread(LPVOID pParam);
 static HANDLE hSwitch;
 static HANDLE hWakeup;
-static CEmulatorDlg *dlg;
+
+static void SwitchWrite(void *user, const char *buffer);
+static void SwitchRelays(void *user, uint64_t changed, uint64_t relays,
+						 int changed_inhibits, int inhibits);
+static void SwitchAntennas(void *user, int changed,
+						   const int *tx, const int *rx);
 
 // CAboutDlg dialog used for App About
 
@@ -56,6 +61,7 @@ CEmulatorDlg::CEmulatorDlg(CWnd* pParent /*=NULL*/)
 	: CDialog(CEmulatorDlg::IDD, pParent)
 {
 	m_hIcon = AfxGetApp()->LoadIcon(IDR_MAINFRAME);
+	sw = NULL;
 }
 
 void CEmulatorDlg::DoDataExchange(CDataExchange* pDX)
@@ -238,17 +244,11 @@ HCURSOR CEmulatorDlg::OnQueryDragIcon()
 
 void CEmulatorDlg::OnBnClickedStart()
 {
-	int i;
+	moas_callbacks callbacks;
 
 	start.ShowWindow(SW_HIDE);
 	port.EnableWindow(FALSE);
 
-	dlg = this;
-
-	for (i=0; i<MOAS_STATIONS; i++) {
-		tx[i].EnableWindow(TRUE);
-	}
-
 	DCB dcb;
 	CString com;
 
@@ -288,40 +288,54 @@ void CEmulatorDlg::OnBnClickedStart()
 		exit(0);
 	}
 
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = SwitchWrite;
+	callbacks.relays_changed = SwitchRelays;
+	callbacks.antennas_changed = SwitchAntennas;
+
+	sw = moas_create(&callbacks, this);
+	if (sw == NULL) {
+		DisplayError("Could not create MOAS switch: ", ERROR_NOT_ENOUGH_MEMORY);
+		CloseHandle(hSwitch);
+		exit(0);
+	}
+
+	// Only changes are reported from here on, so show the state the
+	// switch starts in: no relays and every station inhibited
+	Update(~(uint64_t)0, 0, (1<<MOAS_STATIONS)-1, (1<<MOAS_STATIONS)-1);
+
 	// Kick off the read thread
 	AfxBeginThread(SwitchCommThread, m_hWnd);
-
-	moas_initialize();
 }
 
 void CEmulatorDlg::OnBnClickedTx1()
 {
-	moas_txrx(1, tx[0].GetCheck());
+	moas_txrx_ctx(sw, 1, tx[0].GetCheck());
 }
 
 void CEmulatorDlg::OnBnClickedTx2()
 {
-	moas_txrx(2, tx[1].GetCheck());
+	moas_txrx_ctx(sw, 2, tx[1].GetCheck());
 }
 
 void CEmulatorDlg::OnBnClickedTx3()
 {
-	moas_txrx(3, tx[2].GetCheck());
+	moas_txrx_ctx(sw, 3, tx[2].GetCheck());
 }
 
 void CEmulatorDlg::OnBnClickedTx4()
 {
-	moas_txrx(4, tx[3].GetCheck());
+	moas_txrx_ctx(sw, 4, tx[3].GetCheck());
 }
 
 void CEmulatorDlg::OnBnClickedTx5()
 {
-	moas_txrx(5, tx[4].GetCheck());
+	moas_txrx_ctx(sw, 5, tx[4].GetCheck());
 }
 
 void CEmulatorDlg::OnBnClickedTx6()
 {
-	moas_txrx(6, tx[5].GetCheck());
+	moas_txrx_ctx(sw, 6, tx[5].GetCheck());
 }
 
 LRESULT CEmulatorDlg::OnSwitchRead(WPARAM wParam, LPARAM lParam)
@@ -331,7 +345,10 @@ LRESULT CEmulatorDlg::OnSwitchRead(WPARAM wParam, LPARAM lParam)
 		return TRUE;
 	}
 
-	moas_character((char)lParam);
+	// The read thread hands over a block of characters which is ours
+	// to free
+	moas_feed_ctx(sw, (const char *)lParam, (size_t)wParam);
+	delete [] (char *)lParam;
 
 	return TRUE;
 }
@@ -367,27 +384,36 @@ void CEmulatorDlg::Write(const char *string)
 }
 
 void 
-CEmulatorDlg::Update(const int *relays, const int *inhibits)
+CEmulatorDlg::Update(uint64_t changed, uint64_t relays,
+					 int changed_inhibits, int inhibits)
 {
 	int i;
 
+	// Only touch the LEDs which changed
 	for (i=0; i<MOAS_RELAYS; i++) {
-		relay_leds[i].ShowWindow(relays[i]);
+		if (changed & ((uint64_t)1 << i)) {
+			relay_leds[i].ShowWindow((relays & ((uint64_t)1 << i)) != 0);
+		}
 	}
 
 	for (i=0; i<MOAS_STATIONS; i++) {
-		inhibit_leds[i].ShowWindow(inhibits[i]);
-		tx[i].EnableWindow(!inhibits[i]);
+		if (changed_inhibits & (1<<i)) {
+			inhibit_leds[i].ShowWindow((inhibits & (1<<i)) != 0);
+			tx[i].EnableWindow((inhibits & (1<<i)) == 0);
+		}
 	}
 }
 
 void
-CEmulatorDlg::Antennas(const int *tx, const int *rx)
+CEmulatorDlg::Antennas(int changed, const int *tx, const int *rx)
 {
 	CString t;
 	int i;
 
 	for (i=0; i<MOAS_STATIONS; i++) {
+		if (!(changed & (1<<i))) {
+			continue;
+		}
 		t.Format("%d", tx[i]);
 		tx_antennas[i].SetWindowText(t);
 		t.Format("%d", rx[i]);
@@ -425,17 +451,30 @@ CEmulatorDlg::DisplayError(CString s, DWORD e)
 	AfxMessageBox(strError);
 }
 
+static void
+PostSwitchData(HWND hWnd, char *data, DWORD bytes)
+//----------------------------------------------------------------------
+// Pass a block of characters read from the switch to the dialog, which
+// frees it
+//----------------------------------------------------------------------
+{
+	if ((bytes == 0) ||
+		!::PostMessage(hWnd, READ_SWITCH, bytes, (LPARAM)data)) {
+		delete [] data;
+	}
+}
+
 static UINT
 SwitchCommThread(LPVOID pParam)
 //----------------------------------------------------------------------
-// Read a character from the switch - Separate thread, not in class
+// Read characters from the switch - Separate thread, not in class
 //----------------------------------------------------------------------
 {
 	DWORD	Result;
 	DWORD	bytes;
 	DWORD   commEvent = 0;
 	DWORD   errors;
-	char    data;
+	char    *data;
 	HWND    hWnd = (HWND)pParam;
 	OVERLAPPED Overlapped;
 	DWORD   NumberOfBytesRead;
@@ -498,8 +537,11 @@ SwitchCommThread(LPVOID pParam)
 		// The comm event showed something in the buffer
 		if (ClearCommError(hSwitch, &errors, &comStat)) {
 
-			while (comStat.cbInQue--) {
-				(void)ReadFile (hSwitch, &data, 1,
+			// Read everything waiting in one go so the switch gets
+			// whole commands at a time
+			if (comStat.cbInQue) {
+				data = new char[comStat.cbInQue];
+				(void)ReadFile (hSwitch, data, comStat.cbInQue,
 							&NumberOfBytesRead, (LPOVERLAPPED)&Overlapped);
 
 				// IO pending is expected
@@ -510,15 +552,14 @@ SwitchCommThread(LPVOID pParam)
 					// it disconnected
 					WaitForSingleObject(hWakeup, INFINITE);
 
-					// A character arrived or an error occurred
+					// Characters arrived or an error occurred
 					if (GetOverlappedResult(hSwitch,
 							(LPOVERLAPPED) &Overlapped, &bytes, TRUE)) {
-						// A character was read or a zero-length read occurred
-						if (bytes) {
-							::PostMessage(hWnd, READ_SWITCH, 0, data);
-						}
+						// Characters were read or a zero-length read occurred
+						PostSwitchData(hWnd, data, bytes);
 					}
 					else {
+						delete [] data;
 						if (!error_reported) {
 							// An error occurred
 							::PostMessage(hWnd, READ_SWITCH, GetLastError(), 0xffff);
@@ -529,12 +570,11 @@ SwitchCommThread(LPVOID pParam)
 				else {
 					// There may have already been characters, no wait needed
 					if (Result == 0) {
-						if (NumberOfBytesRead) {
-							::PostMessage(hWnd, READ_SWITCH, 0, data);
-						}
+						PostSwitchData(hWnd, data, NumberOfBytesRead);
 					}
 					else {
 						// An immediate error
+						delete [] data;
 						if (!error_reported) {
 							::PostMessage(hWnd, READ_SWITCH, GetLastError(), 0xffff);
 							error_reported = true;
@@ -557,19 +597,21 @@ SwitchCommThread(LPVOID pParam)
 }
 
 // These are the trampoline routines to get from the C code MOAS II
-// emulator to the C++ code in this file.
+// emulator to the C++ code in this file.  The user value is the dialog.
 
-void moas_callback_write(const char *buffer)
+static void SwitchWrite(void *user, const char *buffer)
 {
-	dlg->Write(buffer);
+	((CEmulatorDlg *)user)->Write(buffer);
 }
 
-void moas_callback_update(const int *relays, const int *inhibits)
+static void SwitchRelays(void *user, uint64_t changed, uint64_t relays,
+						 int changed_inhibits, int inhibits)
 {
-	dlg->Update(relays, inhibits);
+	((CEmulatorDlg *)user)->Update(changed, relays, changed_inhibits, inhibits);
 }
 
-void moas_callback_antennas(const int *tx, const int *rx)
+static void SwitchAntennas(void *user, int changed,
+						   const int *tx, const int *rx)
 {
-	dlg->Antennas(tx, rx);
+	((CEmulatorDlg *)user)->Antennas(changed, tx, rx);
 }
\ No newline at end of file
@@ -46,6 +46,9 @@ private:
 	CButton tx[MOAS_STATIONS];
 	CFont Font;
 
+	// The emulated switch
+	moas_ctx *sw;
+
 public:
 	afx_msg void OnBnClickedStart();
 	CComboBox port;
@@ -58,6 +61,7 @@ public:
 	afx_msg void OnBnClickedTx6();
 
 	void Write(const char *string);
-	void Update(const int *relays, const int *inbibits);
-	void Antennas(const int *tx, const int *rx);
+	void Update(uint64_t changed, uint64_t relays,
+				int changed_inhibits, int inhibits);
+	void Antennas(int changed, const int *tx, const int *rx);
 };
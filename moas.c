@@ -2,7 +2,21 @@
 //
 // MOAS II emulator
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(MOAS_STATS)
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#endif
+
 #include "moas.h"
+#include "moas_simd.h"
+#include "moas_timer.h"
 
 #undef FALSE
 #undef TRUE
@@ -26,8 +40,56 @@ static const char sixbit[] = {
 	'm', 'n', 'o', 'p', 'q', 'r', 's', 't',
 	'u', 'v', 'w', 'x', 'y', 'z', '{', '}' };
 
-static void do_pins();
-static void do_resolver();
+// This converts a sixbit character to its value.  Anything which is
+// not a sixbit character is SIXBIT_INVALID, which is outside every
+// value so a run of digits can be checked by ORing them together.
+#define SIXBIT_INVALID 0x40
+#define BAD SIXBIT_INVALID
+
+static const unsigned char sixbit_value[256] = {
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	  0,   1,   2,   3,   4,   5,   6,   7,   8,   9, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD,  10,  11,  12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,
+	 25,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35, BAD, BAD, BAD, BAD, BAD,
+	BAD,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  49,  50,
+	 51,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  62, BAD,  63, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD
+};
+
+#undef BAD
+
+// A set of relays is kept as a bit mask with relay n in bit n
+typedef uint64_t relay_mask;
+
+#define RELAY(n)  (((relay_mask)1) << (n))
+
+// A set of antennas is kept the same way with antenna n in bit n
+typedef uint64_t antenna_mask;
+
+#define ANTENNA(n)  (((antenna_mask)1) << (n))
+
+static void do_pins(moas_ctx *ctx);
+static void do_resolver(moas_ctx *ctx);
+static void commit_batch(moas_ctx *ctx);
+static void clear_batch(moas_ctx *ctx);
+
+#if defined(MOAS_STATS)
+// The statistics and what they were last measured against
+typedef struct stats_block {
+	moas_stats stats;
+	relay_mask relays;
+	int inhibits;
+} stats_block;
+#endif
 
 // These are mainly taken from the actual switch.  There is no
 // concept of a local variable in the switch...
@@ -36,490 +98,2147 @@ static void do_resolver();
 // The switch also has individual names for elements of some arrays
 // because several loops are unrolled for speed.
 
+// Relay sets are the exception.  Each station's set of relays is a
+// single 64 bit mask so combining the stations is a few word operations
+// instead of a loop over every relay.
+
 // Memory in the switch is also arranged to allow code optimizations
 // and that isn't done here.
 
 #define COMMAND_BUFFER_LEN 128
 
-// These are the global relays which are always set
-static int global_relays [MOAS_RELAYS];
-
-// These are the actual station antennas and which are used
-// when setting up the physical relays
-static int actual_tx_antennas[MOAS_STATIONS];
-static int actual_rx_antennas[MOAS_STATIONS];
-
-static int actual_tx_relays [MOAS_RELAYS][MOAS_STATIONS];
-static int actual_rx_relays [MOAS_RELAYS][MOAS_STATIONS];
-
-// These are the current antennas and relays.  The conflict
-// resolver has accepted them.
-static int current_tx_antennas[MOAS_STATIONS];
-static int current_rx_antennas[MOAS_STATIONS];
+// This is the most output held before it is given to the emulator
+// program
+#define OUTPUT_BUFFER_LEN 256
+
+#define ALL_STATIONS ((1<<MOAS_STATIONS)-1)
+
+// Delays are up to three sixbit digits of milliseconds
+#define DELAY_DIGITS 3
+
+// The # commands give every number as six sixbit digits
+#define VENDOR_DIGITS 6
+#define MAX_DELAY ((1<<(6*DELAY_DIGITS))-1)
+
+// This is everything about one switch.  The actual switch keeps all
+// of this in fixed memory but the emulator can have many switches.
+// Everything after the timers except the owner's view must also be
+// listed in snapshot_fields.
+struct moas_ctx {
+	// These are the routines used to report to the owner
+	moas_callbacks callbacks;
+	void *user;
+
+#if defined(MOAS_STATS)
+	// The statistics belong to the context, not the switch state
+	stats_block *stats;
+#endif
+
+	// This is the owner's timing wheel, or NULL if timed events happen
+	// at once, and the timers for each station's delays.  Whether a
+	// timer is running and when it expires are kept further down.
+	moas_wheel *wheel;
+	moas_timer receive_timers[MOAS_STATIONS];
+	moas_timer settle_timers[MOAS_STATIONS];
+	moas_timer interrupt_timers[MOAS_STATIONS];
+
+	// These are the global relays which are always set
+	relay_mask global_relays;
+
+	// These are the actual station antennas and which are used
+	// when setting up the physical relays
+	int actual_tx_antennas[MOAS_STATIONS];
+	int actual_rx_antennas[MOAS_STATIONS];
+
+	relay_mask actual_tx_relays[MOAS_STATIONS];
+	relay_mask actual_rx_relays[MOAS_STATIONS];
+
+	// These are the current antennas and relays.  The conflict
+	// resolver has accepted them.
+	int current_tx_antennas[MOAS_STATIONS];
+	int current_rx_antennas[MOAS_STATIONS];
+
+	relay_mask current_tx_relays[MOAS_STATIONS];
+	relay_mask current_rx_relays[MOAS_STATIONS];
+
+	// These are the pending antennas and relays.  They were
+	// set by serial port commands.
+	int pending_tx_antennas[MOAS_STATIONS];
+	int pending_rx_antennas[MOAS_STATIONS];
+
+	relay_mask pending_tx_relays[MOAS_STATIONS];
+	relay_mask pending_rx_relays[MOAS_STATIONS];
+
+	// These are the alternate antennas.  There is no current
+	// or pending because the emulator is synchronous.  This
+	// is quite different than the actual code.
+	int alternate_antennas[MOAS_STATIONS];
+	relay_mask alternate_relays[MOAS_STATIONS];
+	relay_mask actual_alternate_relays[MOAS_STATIONS];
+
+	// These are the actual relays and inhibits
+	relay_mask actual_relays;
+	int actual_inhibits[MOAS_STATIONS];
+	int output_inhibits;
+
+	// These are the relays each station adds to the actual relays
+	// and the stations whose share must be worked out again.
+	relay_mask station_relays[MOAS_STATIONS];
+	int dirty_stations;
+
+	// These are the inhibited stations, the stations using their
+	// transmit relays and the stations using their alternate relays
+	// as of the last output update.  They are only worked out again
+	// when dirty_inputs is set because something they depend on
+	// (the transmit state, command or cross inhibits, inhibit types
+	// or alternates) changed.
+	int pin_inhibits;
+	int pin_transmitting;
+	int pin_alternates;
+	int dirty_inputs;
+
+	// This is the actual relays expanded to one int per relay
+	// for the emulator program.  Only changed relays are updated.
+	relay_mask output_relays;
+	int output_relay_array[MOAS_RELAYS];
+
+	// These are the antenna pending flags.  In the actual
+	// switch they are bits in a register.
+	int tx_pending;
+	int rx_pending;
+	int extra_pending;
+	int alt_pending;
+
+	int trbits;
+	int tr_last;
+
+	// Wait/inhibit mode (1=wait, 0=inhibit)
+	int wait_mode;
+	int command_wait_mode;
+	int same_antenna_wait_mode;
+
+	int conflict_sent_rx[MOAS_STATIONS];
+	int conflict_sent_tx[MOAS_STATIONS];
+
+	int inhibit_polarity[MOAS_STATIONS];
+
+	int inhibit_type[MOAS_STATIONS];
+
+	// These are the cross-station inhibits (where
+	// one station transmitting inhibits others)
+	int cross_inhibits[MOAS_STATIONS];
+
+	// These are the inhibit time, receive delay and interrupt mode
+	// delay of each station in milliseconds
+	int inhibit_time[MOAS_STATIONS];
+	int receive_delay[MOAS_STATIONS];
+	int interrupt_delay[MOAS_STATIONS];
+
+	// These are the stations which stopped transmitting but stay on
+	// their transmit relays until their receive delay ends, and the
+	// stations inhibited until their inhibit time ends because their
+	// relays moved.
+	int receive_holds;
+	int settle_inhibits;
+
+	// These are the stations whose transmit antenna change waits for
+	// their interrupt mode delay, the ones whose delay has ended and
+	// the transmitting stations inhibited while the changes wait.
+	int interrupt_waits;
+	int interrupt_ready;
+	int interrupt_inhibits;
+
+	// This is when each running timer expires on the wheel's clock
+	uint64_t receive_due[MOAS_STATIONS];
+	uint64_t settle_due[MOAS_STATIONS];
+	uint64_t interrupt_due[MOAS_STATIONS];
+
+	// This is when each station last asked for a transmit or receive
+	// antenna and when the wheel was given to the switch, on the
+	// wheel's clock.  The # command reports the ages.
+	uint64_t tx_requested[MOAS_STATIONS];
+	uint64_t rx_requested[MOAS_STATIONS];
+	uint64_t started;
+
+	// These are the last inhibits sent to the
+	// emulator program
+	int old_inhibits;
+
+	// These are the last relays and antennas sent to the emulator
+	// program.  Changes are worked out against them for the
+	// relays_changed and antennas_changed callbacks.  They describe
+	// the program's view, so they are not reset with the switch.
+	relay_mask old_relays;
+	int old_tx_antennas[MOAS_STATIONS];
+	int old_rx_antennas[MOAS_STATIONS];
+
+	// These are the cross-station alternates (where
+	// one station transmitting forces another to use
+	// the alternate antenna
+	int alternates[MOAS_STATIONS];
+
+	// The actual switch has a circular buffer but
+	// it isn't needed here.
+	char command_buffer[COMMAND_BUFFER_LEN];
+	int command_buffer_in;
+
+	// Replies and events are held here so everything produced by
+	// one call goes to the emulator program in one write.  It is
+	// written when a call finishes or when the threshold is reached.
+	char output_buffer[OUTPUT_BUFFER_LEN+1];
+	int output_buffer_len;
+	int output_threshold;
+
+	// The owner's output queue as it last reported it, for the #
+	// command.  This is not part of the switch state.
+	int queue_depth;
+	int queue_max_depth;
+	unsigned long long queue_dropped;
+
+	// Stations inhibited by commands
+	int command_inhibits;
+
+	// A batch of antenna commands is open
+	int batch;
+
+	// These are the antenna commands given in the open batch.  They
+	// are kept out of the pending antennas and relays so a resolver
+	// run during the batch only sees the changes from before it.  The
+	// masks are the stations given each kind of command.
+	int batch_tx;
+	int batch_rx;
+	int batch_alt;
+	int batch_extra;
+	int batch_set;
+	int batch_reset;
+	int batch_global;
+
+	int batch_tx_antennas[MOAS_STATIONS];
+	int batch_rx_antennas[MOAS_STATIONS];
+	int batch_alternate_antennas[MOAS_STATIONS];
+	uint64_t batch_tx_requested[MOAS_STATIONS];
+	uint64_t batch_rx_requested[MOAS_STATIONS];
+
+	relay_mask batch_tx_relays[MOAS_STATIONS];
+	relay_mask batch_rx_relays[MOAS_STATIONS];
+	relay_mask batch_alternate_relays[MOAS_STATIONS];
+	relay_mask batch_extra_relays[MOAS_STATIONS];
+	relay_mask batch_set_relays[MOAS_STATIONS];
+	relay_mask batch_reset_relays[MOAS_STATIONS];
+	relay_mask batch_global_relays;
+
+	// Unit identifier
+	int unit_id;
+
+	int antenna_system_table[MOAS_ANTENNAS];
+
+	// These are the pending antenna sytems for each station.
+	// If an antenna change is pending these represent the
+	// pending antenna, otherwise they are zero.
+	int pending_tx_systems[MOAS_STATIONS];
+	int pending_rx_systems[MOAS_STATIONS];
+
+	// These are the current antenna sytems for each
+	// station.  Only the transmit entries are used.
+	int current_tx_systems[MOAS_STATIONS];
+
+	// This is the conflicts table.  In the actual
+	// switch it is a triangle.  Here each antenna has a
+	// row holding the set of antennas it conflicts with.
+	antenna_mask conflicts_table[MOAS_ANTENNAS];
+
+	// This is the fast table.  In the actual
+	// switch it is a triangle.  The rows are antenna
+	// sets like the conflicts table.
+	antenna_mask fast_table[MOAS_ANTENNAS];
+
+	// These are the current and pending extra relays to be
+	// set on transmit.
+	relay_mask current_extra_relays[MOAS_STATIONS];
+	relay_mask pending_extra_relays[MOAS_STATIONS];
+
+	// These are the relays to be set when a station transmits
+	relay_mask set_relays[MOAS_STATIONS];
+
+	// These are the relays to be reset when a station transmits
+	relay_mask reset_relays[MOAS_STATIONS];
+
+	// These are the resulting relays from the set/reset when a station transmits
+	relay_mask sr_relays;
+
+	// TRUE if switch is in operate state
+	int operate;
+
+	// TRUE if the conflict resolver is on
+	int resolver_on;
+
+	// The events which should be sent to the controlling program
+	int antenna_events;
+	int tr_events;
+	int inhibit_events;
+	int extra_relay_events;
+};
+
+static int
+sixtodigit(char d)
+//----------------------------------------------------------------------
+// Convert a sixbit character to an integer value.  Returns
+// SIXBIT_INVALID if it is not a sixbit character.
+//----------------------------------------------------------------------
+{
+	return sixbit_value[(unsigned char)d];
+}
+
+static int
+lowest_relay(relay_mask relays)
+//----------------------------------------------------------------------
+// Return the number of the lowest relay in a non-empty relay set
+//----------------------------------------------------------------------
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(relays);
+#else
+	static const char debruijn[64] = {
+		 0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+		62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+		63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+		46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6 };
+
+	return debruijn[((relays & (0 - relays)) * 0x03f79d71b4cb0a89ULL) >> 58];
+#endif
+}
+
+#if defined(MOAS_STATS)
+static uint64_t
+stats_clock(void)
+//----------------------------------------------------------------------
+// Return a monotonic time in nanoseconds
+//----------------------------------------------------------------------
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart * (1e9 / freq.QuadPart));
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static int
+stats_bucket(uint64_t n)
+//----------------------------------------------------------------------
+// Return the power of two bucket for a count
+//----------------------------------------------------------------------
+{
+	int bucket = 0;
+
+	while (n && (bucket < MOAS_STATS_BUCKETS-1)) {
+		n >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static int
+stats_opcode(char c)
+//----------------------------------------------------------------------
+// Return where a command is counted
+//----------------------------------------------------------------------
+{
+	unsigned char u = (unsigned char)c;
+
+	if ((u < ' ') || (u - ' ' >= MOAS_STATS_OPCODES)) {
+		return MOAS_STATS_OPCODES-1;
+	}
+	return u - ' ';
+}
+
+static int
+stats_bits(uint64_t bits)
+//----------------------------------------------------------------------
+// Return the number of bits set
+//----------------------------------------------------------------------
+{
+	int n = 0;
+
+	while (bits) {
+		bits &= bits - 1;
+		n++;
+	}
+	return n;
+}
+
+static void
+stats_latency(moas_latency *latency, uint64_t start)
+//----------------------------------------------------------------------
+// Count something which started at a time from stats_clock
+//----------------------------------------------------------------------
+{
+	uint64_t ns = stats_clock() - start;
+
+	latency->count++;
+	latency->total_ns += ns;
+	if (ns > latency->max_ns) {
+		latency->max_ns = ns;
+	}
+	latency->buckets[stats_bucket(ns >> 7)]++;
+}
+#endif
+
+static void
+flush_output(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Give the held status and event strings to the owner
+//----------------------------------------------------------------------
+{
+	if (ctx->output_buffer_len == 0) {
+		return;
+	}
+
+	ctx->output_buffer[ctx->output_buffer_len] = '\0';
+	ctx->output_buffer_len = 0;
+	ctx->callbacks.write(ctx->user, ctx->output_buffer);
+}
+
+static void
+callback_write(moas_ctx *ctx, const char *buffer)
+//----------------------------------------------------------------------
+// Give a status or event string to the owner.  It is held until the
+// current call finishes or the threshold is reached.
+//----------------------------------------------------------------------
+{
+	int len;
+
+#if defined(MOAS_STATS)
+	if (ctx->stats && (buffer[0] == '?')) {
+		if (buffer[1] == 'A') {
+			ctx->stats->stats.bad_commands++;
+		}
+		else if (buffer[1] == 'U') {
+			ctx->stats->stats.unknown_commands++;
+		}
+		else {
+			ctx->stats->stats.other_errors++;
+		}
+	}
+#endif
+
+	if (!ctx->callbacks.write) {
+		return;
+	}
+
+	len = (int)strlen(buffer);
+	if (ctx->output_buffer_len + len > OUTPUT_BUFFER_LEN) {
+		flush_output(ctx);
+		if (len > OUTPUT_BUFFER_LEN) {
+			ctx->callbacks.write(ctx->user, buffer);
+			return;
+		}
+	}
+
+	memcpy(ctx->output_buffer + ctx->output_buffer_len, buffer, len);
+	ctx->output_buffer_len += len;
+
+	if (ctx->output_buffer_len >= ctx->output_threshold) {
+		flush_output(ctx);
+	}
+}
+
+static void
+callback_update(moas_ctx *ctx, relay_mask relays, int inhibits,
+	const int *relay_array, const int *inhibit_array)
+//----------------------------------------------------------------------
+// Give the relays and inhibits to the owner, either all of them or
+// only what changed since last time
+//----------------------------------------------------------------------
+{
+	relay_mask changed;
+	int changed_inhibits;
+
+#if defined(MOAS_STATS)
+	if (ctx->stats) {
+		stats_block *b = ctx->stats;
+
+		changed = relays ^ b->relays;
+		changed_inhibits = inhibits ^ b->inhibits;
+		if (changed || changed_inhibits) {
+			b->stats.relay_updates++;
+			b->stats.relay_changes += stats_bits(changed);
+			b->stats.inhibit_changes += stats_bits(changed_inhibits);
+			b->relays = relays;
+			b->inhibits = inhibits;
+		}
+	}
+#endif
+
+	if (ctx->callbacks.relays_changed) {
+		changed = relays ^ ctx->old_relays;
+		changed_inhibits = inhibits ^ ctx->old_inhibits;
+		if (changed || changed_inhibits) {
+			ctx->old_relays = relays;
+			ctx->old_inhibits = inhibits;
+			ctx->callbacks.relays_changed(ctx->user, changed, relays,
+										  changed_inhibits, inhibits);
+		}
+		return;
+	}
+
+	if (ctx->callbacks.update) {
+		ctx->callbacks.update(ctx->user, relay_array, inhibit_array);
+	}
+}
+
+static void
+callback_antennas(moas_ctx *ctx, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Give the actual antennas to the owner, either always or only when
+// they changed since last time
+//----------------------------------------------------------------------
+{
+	int changed = 0;
+	int stn;
+
+	if (ctx->callbacks.antennas_changed) {
+		for (stn=0; stn<MOAS_STATIONS; stn++) {
+			if ((tx[stn] != ctx->old_tx_antennas[stn]) ||
+				(rx[stn] != ctx->old_rx_antennas[stn])) {
+				ctx->old_tx_antennas[stn] = tx[stn];
+				ctx->old_rx_antennas[stn] = rx[stn];
+				changed |= 1<<stn;
+			}
+		}
+		if (changed) {
+			ctx->callbacks.antennas_changed(ctx->user, changed, tx, rx);
+		}
+		return;
+	}
+
+	if (ctx->callbacks.antennas) {
+		ctx->callbacks.antennas(ctx->user, tx, rx);
+	}
+}
+
+static void
+reset_owner_view(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// A new owner starts out seeing a switch which is not operating
+//----------------------------------------------------------------------
+{
+	int i;
+
+	ctx->old_relays = 0;
+	ctx->old_inhibits = ALL_STATIONS;
+	for (i=0; i<MOAS_STATIONS; i++) {
+		ctx->old_tx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->old_rx_antennas[i] = MOAS_ANTENNAS-1;
+	}
+}
+
+static void
+receive_expired(moas_timer *timer, void *user)
+//----------------------------------------------------------------------
+// A station's receive delay ended so it can go to its receive relays
+//----------------------------------------------------------------------
+{
+	moas_ctx *ctx = (moas_ctx *)user;
+	int stn = (int)(timer - ctx->receive_timers);
+
+	// It is no longer on its transmit relays, so it does not count as
+	// having just stopped transmitting
+	ctx->receive_holds &= ~(1<<stn);
+	ctx->pin_transmitting &= ~(1<<stn);
+	ctx->dirty_stations |= 1<<stn;
+	do_resolver(ctx);
+	flush_output(ctx);
+}
+
+static void
+settle_expired(moas_timer *timer, void *user)
+//----------------------------------------------------------------------
+// A station's inhibit time ended so its relays have settled
+//----------------------------------------------------------------------
+{
+	moas_ctx *ctx = (moas_ctx *)user;
+	int stn = (int)(timer - ctx->settle_timers);
+
+	ctx->settle_inhibits &= ~(1<<stn);
+	do_pins(ctx);
+	flush_output(ctx);
+}
+
+static void
+interrupt_expired(moas_timer *timer, void *user)
+//----------------------------------------------------------------------
+// A station's interrupt mode delay ended so its transmit antenna
+// change can be made
+//----------------------------------------------------------------------
+{
+	moas_ctx *ctx = (moas_ctx *)user;
+	int stn = (int)(timer - ctx->interrupt_timers);
+
+	ctx->interrupt_waits &= ~(1<<stn);
+	ctx->interrupt_ready |= 1<<stn;
+	do_resolver(ctx);
+	flush_output(ctx);
+}
+
+static void
+init_timers(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Set up the timers of a new context.  None of them are running.
+//----------------------------------------------------------------------
+{
+	int i;
+
+	for (i=0; i<MOAS_STATIONS; i++) {
+		moas_timer_init(&ctx->receive_timers[i], receive_expired, ctx);
+		moas_timer_init(&ctx->settle_timers[i], settle_expired, ctx);
+		moas_timer_init(&ctx->interrupt_timers[i], interrupt_expired, ctx);
+	}
+}
+
+static void
+stop_timers(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Take every timer off the wheel.  The stations they are timing are
+// left as they are.
+//----------------------------------------------------------------------
+{
+	int i;
+
+	for (i=0; i<MOAS_STATIONS; i++) {
+		moas_timer_stop(&ctx->receive_timers[i]);
+		moas_timer_stop(&ctx->settle_timers[i]);
+		moas_timer_stop(&ctx->interrupt_timers[i]);
+	}
+}
+
+static uint64_t
+wheel_time(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Return the time on the switch's wheel, or 0 if it has none
+//----------------------------------------------------------------------
+{
+	return ctx->wheel ? moas_wheel_now(ctx->wheel) : 0;
+}
+
+static void
+start_timer(moas_ctx *ctx, moas_timer *timer, uint64_t *due, int delay)
+//----------------------------------------------------------------------
+// Start a timer for a delay in milliseconds from now
+//----------------------------------------------------------------------
+{
+	*due = moas_wheel_now(ctx->wheel) + (uint64_t)delay * 1000;
+	moas_timer_start(ctx->wheel, timer, *due);
+}
+
+static void
+restart_timers(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Put the timers which should be running on the wheel after the switch
+// state or the wheel was replaced.  Without a wheel they expire now.
+//----------------------------------------------------------------------
+{
+	int i;
+
+	stop_timers(ctx);
+
+	if (ctx->wheel) {
+		for (i=0; i<MOAS_STATIONS; i++) {
+			if (ctx->receive_holds & (1<<i)) {
+				moas_timer_start(ctx->wheel, &ctx->receive_timers[i],
+								 ctx->receive_due[i]);
+			}
+			if (ctx->settle_inhibits & (1<<i)) {
+				moas_timer_start(ctx->wheel, &ctx->settle_timers[i],
+								 ctx->settle_due[i]);
+			}
+			if (ctx->interrupt_waits & (1<<i)) {
+				moas_timer_start(ctx->wheel, &ctx->interrupt_timers[i],
+								 ctx->interrupt_due[i]);
+			}
+		}
+		return;
+	}
+
+	if (ctx->receive_holds || ctx->settle_inhibits || ctx->interrupt_waits ||
+		ctx->interrupt_ready) {
+		ctx->receive_holds = 0;
+		ctx->settle_inhibits = 0;
+		ctx->interrupt_waits = 0;
+		ctx->interrupt_ready = 0;
+		ctx->dirty_inputs = TRUE;
+		do_resolver(ctx);
+	}
+}
+
+moas_ctx *moas_create(const moas_callbacks *callbacks, void *user)
+//----------------------------------------------------------------------
+// Create and initialize a switch context
+//----------------------------------------------------------------------
+{
+	moas_ctx *ctx = (moas_ctx *)calloc(1, sizeof(moas_ctx));
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (callbacks) {
+		ctx->callbacks = *callbacks;
+	}
+	ctx->user = user;
+	init_timers(ctx);
+
+#if defined(MOAS_STATS)
+	ctx->stats = (stats_block *)calloc(1, sizeof(stats_block));
+	if (ctx->stats == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->stats->inhibits = ALL_STATIONS;
+#endif
+
+	ctx->output_buffer_len = 0;
+	ctx->output_threshold = OUTPUT_BUFFER_LEN;
+
+	reset_owner_view(ctx);
+
+	moas_initialize_ctx(ctx);
+	return ctx;
+}
+
+void moas_destroy(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Free a switch context
+//----------------------------------------------------------------------
+{
+	if (ctx == NULL) {
+		return;
+	}
+
+	stop_timers(ctx);
+#if defined(MOAS_STATS)
+	free(ctx->stats);
+#endif
+	free(ctx);
+}
+
+void moas_timers_ctx(moas_ctx *ctx, moas_wheel *wheel)
+//----------------------------------------------------------------------
+// Give the switch a timing wheel or take it away
+//----------------------------------------------------------------------
+{
+	ctx->wheel = wheel;
+	ctx->started = wheel_time(ctx);
+	restart_timers(ctx);
+	flush_output(ctx);
+}
+
+void moas_output_threshold_ctx(moas_ctx *ctx, int threshold)
+//----------------------------------------------------------------------
+// Set how much output is held before it is written
+//----------------------------------------------------------------------
+{
+	if (threshold < 0) {
+		threshold = 0;
+	}
+	if (threshold > OUTPUT_BUFFER_LEN) {
+		threshold = OUTPUT_BUFFER_LEN;
+	}
+	ctx->output_threshold = threshold;
+
+	if (ctx->output_buffer_len >= ctx->output_threshold) {
+		flush_output(ctx);
+	}
+}
+
+void moas_output_queue_ctx(moas_ctx *ctx, int depth, int max_depth,
+	unsigned long long dropped)
+//----------------------------------------------------------------------
+// Record what the owner's output queue holds
+//----------------------------------------------------------------------
+{
+	ctx->queue_depth = depth;
+	ctx->queue_max_depth = max_depth;
+	ctx->queue_dropped = dropped;
+}
+
+void moas_begin_batch_ctx(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Begin a batch of antenna commands
+//----------------------------------------------------------------------
+{
+	ctx->batch = TRUE;
+}
+
+void moas_commit_batch_ctx(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// End a batch of antenna commands and write what it produced
+//----------------------------------------------------------------------
+{
+	if (ctx->batch) {
+		commit_batch(ctx);
+	}
+	flush_output(ctx);
+}
+
+int moas_stats_ctx(moas_ctx *ctx, moas_stats *stats)
+//----------------------------------------------------------------------
+// Read the statistics
+//----------------------------------------------------------------------
+{
+#if defined(MOAS_STATS)
+	*stats = ctx->stats->stats;
+	return TRUE;
+#else
+	memset(stats, 0, sizeof(moas_stats));
+	return FALSE;
+#endif
+}
+
+void moas_clear_stats_ctx(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Clear the statistics
+//----------------------------------------------------------------------
+{
+#if defined(MOAS_STATS)
+	memset(&ctx->stats->stats, 0, sizeof(moas_stats));
+#endif
+}
 
-static int current_tx_relays [MOAS_RELAYS][MOAS_STATIONS];
-static int current_rx_relays [MOAS_RELAYS][MOAS_STATIONS];
+static void
+append_text(char *buffer, size_t size, size_t *len, const char *text)
+//----------------------------------------------------------------------
+// Add text to a buffer, counting what does not fit
+//----------------------------------------------------------------------
+{
+	for (; *text; text++, (*len)++) {
+		if (*len + 1 < size) {
+			buffer[*len] = *text;
+		}
+	}
+}
 
-// These are the pending antennas and relays.  They were
-// set by serial port commands.
-static int pending_tx_antennas[MOAS_STATIONS];
-static int pending_rx_antennas[MOAS_STATIONS];
+static void
+append_number(char *buffer, size_t size, size_t *len,
+	const char *name, unsigned long long n)
+//----------------------------------------------------------------------
+// Add a space, a name if there is one and a space, and a number
+//----------------------------------------------------------------------
+{
+	char digits[24];
+	int i = sizeof(digits) - 1;
+
+	digits[i] = '\0';
+	do {
+		digits[--i] = (char)('0' + n % 10);
+		n /= 10;
+	} while (n);
+
+	append_text(buffer, size, len, " ");
+	if (name) {
+		append_text(buffer, size, len, name);
+		append_text(buffer, size, len, " ");
+	}
+	append_text(buffer, size, len, digits + i);
+}
 
-static int pending_tx_relays [MOAS_RELAYS][MOAS_STATIONS];
-static int pending_rx_relays [MOAS_RELAYS][MOAS_STATIONS];
+static void
+append_latency(char *buffer, size_t size, size_t *len,
+	const moas_latency *latency)
+//----------------------------------------------------------------------
+// Add the counts for something timed and end the line
+//----------------------------------------------------------------------
+{
+	int i;
 
-// These are the alternate antennas.  There is no current
-// or pending because the emulator is synchronous.  This
-// is quite different than the actual code.
-static int alternate_antennas[MOAS_STATIONS];
-static int alternate_relays[MOAS_RELAYS][MOAS_STATIONS];
-static int actual_alternate_relays[MOAS_RELAYS][MOAS_STATIONS];
+	append_number(buffer, size, len, "count", latency->count);
+	append_number(buffer, size, len, "total_ns", latency->total_ns);
+	append_number(buffer, size, len, "max_ns", latency->max_ns);
+	append_text(buffer, size, len, " buckets");
+	for (i=0; i<MOAS_STATS_BUCKETS; i++) {
+		append_number(buffer, size, len, NULL, latency->buckets[i]);
+	}
+	append_text(buffer, size, len, "\n");
+}
 
-// These are the actual relays and inhibits
-static int actual_relays[MOAS_RELAYS];
-static int actual_inhibits[MOAS_STATIONS];
+size_t moas_format_stats(const moas_stats *stats, char *buffer, size_t size)
+//----------------------------------------------------------------------
+// Write statistics as text
+//----------------------------------------------------------------------
+{
+	char opcode[16] = "command C";
+	size_t len = 0;
+	int i;
 
-// These are the antenna pending flags.  In the actual
-// switch they are bits in a register.
-static int tx_pending;
-static int rx_pending;
-static int extra_pending;
-static int alt_pending;
+	for (i=0; i<MOAS_STATS_OPCODES; i++) {
+		if (stats->commands[i].count) {
+			if (i == MOAS_STATS_OPCODES-1) {
+				strcpy(opcode + 8, "DEL");
+			}
+			else {
+				opcode[8] = (char)(' ' + i);
+			}
+			append_text(buffer, size, &len, opcode);
+			append_latency(buffer, size, &len, &stats->commands[i]);
+		}
+	}
+
+	append_text(buffer, size, &len, "txrx");
+	append_latency(buffer, size, &len, &stats->txrx);
+
+	append_text(buffer, size, &len, "resolver");
+	append_number(buffer, size, &len, "runs", stats->resolver_runs);
+	append_number(buffer, size, &len, "iterations",
+				  stats->resolver_iterations);
+	append_number(buffer, size, &len, "max_iterations",
+				  stats->resolver_max_iterations);
+	append_text(buffer, size, &len, " buckets");
+	for (i=0; i<MOAS_STATS_BUCKETS; i++) {
+		append_number(buffer, size, &len, NULL, stats->iterations[i]);
+	}
+	append_text(buffer, size, &len, "\n");
+
+	append_text(buffer, size, &len, "relays");
+	append_number(buffer, size, &len, "updates", stats->relay_updates);
+	append_number(buffer, size, &len, "changes", stats->relay_changes);
+	append_number(buffer, size, &len, "inhibit_changes",
+				  stats->inhibit_changes);
+	append_text(buffer, size, &len, "\n");
+
+	append_text(buffer, size, &len, "errors");
+	append_number(buffer, size, &len, "bad", stats->bad_commands);
+	append_number(buffer, size, &len, "unknown", stats->unknown_commands);
+	append_number(buffer, size, &len, "other", stats->other_errors);
+	append_text(buffer, size, &len, "\n");
+
+	if (size) {
+		buffer[(len < size) ? len : size - 1] = '\0';
+	}
+	return len;
+}
+
+void moas_flush_ctx(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Write any held output
+//----------------------------------------------------------------------
+{
+	flush_output(ctx);
+}
 
-static int trbits;
-static int tr_last;
+// These are the positions of the parts of a configuration image.  The
+// tables and delays are written low byte first.  The last byte makes
+// the sum of every byte zero.
+#define CONFIG_MAGIC       "MOASCFG2"
+#define CONFIG_MAGIC_LEN   8
+#define CONFIG_DELAY_LEN   3
+#define CONFIG_CONFLICTS   8
+#define CONFIG_FAST        (CONFIG_CONFLICTS + 8*MOAS_ANTENNAS)
+#define CONFIG_SYSTEMS     (CONFIG_FAST + 8*MOAS_ANTENNAS)
+#define CONFIG_GLOBAL      (CONFIG_SYSTEMS + MOAS_ANTENNAS)
+#define CONFIG_POLARITY    (CONFIG_GLOBAL + 8)
+#define CONFIG_TYPE        (CONFIG_POLARITY + 1)
+#define CONFIG_CROSS       (CONFIG_TYPE + 1)
+#define CONFIG_ALTERNATES  (CONFIG_CROSS + MOAS_STATIONS)
+#define CONFIG_WAIT        (CONFIG_ALTERNATES + MOAS_STATIONS)
+#define CONFIG_INHIBIT     (CONFIG_WAIT + 1)
+#define CONFIG_RECEIVE     (CONFIG_INHIBIT + CONFIG_DELAY_LEN*MOAS_STATIONS)
+#define CONFIG_INTERRUPT   (CONFIG_RECEIVE + CONFIG_DELAY_LEN*MOAS_STATIONS)
+#define CONFIG_CHECK       (CONFIG_INTERRUPT + CONFIG_DELAY_LEN*MOAS_STATIONS)
+
+#if CONFIG_CHECK + 1 != MOAS_CONFIG_LEN
+#error Configuration image layout does not match MOAS_CONFIG_LEN
+#endif
 
-// Wait/inhibit mode (1=wait, 0=inhibit)
-static int wait_mode;
-static int command_wait_mode;
-static int same_antenna_wait_mode;
+static void
+put_mask(unsigned char *image, uint64_t mask)
+//----------------------------------------------------------------------
+// Write a relay or antenna set to an image
+//----------------------------------------------------------------------
+{
+	int i;
+
+	for (i=0; i<8; i++) {
+		image[i] = (unsigned char)(mask >> (8*i));
+	}
+}
+
+static void
+put_delays(unsigned char *image, const int *delays)
+//----------------------------------------------------------------------
+// Write each station's delay to an image
+//----------------------------------------------------------------------
+{
+	int stn;
+	int i;
+
+	for (stn=0; stn<MOAS_STATIONS; stn++) {
+		for (i=0; i<CONFIG_DELAY_LEN; i++) {
+			image[CONFIG_DELAY_LEN*stn + i] = (unsigned char)(delays[stn] >> (8*i));
+		}
+	}
+}
+
+static int
+get_delay(const unsigned char *image, int stn)
+//----------------------------------------------------------------------
+// Read a station's delay from an image
+//----------------------------------------------------------------------
+{
+	int delay = 0;
+	int i;
+
+	for (i=0; i<CONFIG_DELAY_LEN; i++) {
+		delay |= image[CONFIG_DELAY_LEN*stn + i] << (8*i);
+	}
+	return delay;
+}
+
+static uint64_t
+get_mask(const unsigned char *image)
+//----------------------------------------------------------------------
+// Read a relay or antenna set from an image
+//----------------------------------------------------------------------
+{
+	uint64_t mask = 0;
+	int i;
+
+	for (i=0; i<8; i++) {
+		mask |= ((uint64_t)image[i]) << (8*i);
+	}
+	return mask;
+}
+
+void moas_save_config_ctx(moas_ctx *ctx, unsigned char *image)
+//----------------------------------------------------------------------
+// Save the configuration in an image
+//----------------------------------------------------------------------
+{
+	unsigned char sum = 0;
+	int polarity = 0;
+	int type = 0;
+	int i;
+
+	memcpy(image, CONFIG_MAGIC, CONFIG_MAGIC_LEN);
+
+	for (i=0; i<MOAS_ANTENNAS; i++) {
+		put_mask(image + CONFIG_CONFLICTS + 8*i, ctx->conflicts_table[i]);
+		put_mask(image + CONFIG_FAST + 8*i, ctx->fast_table[i]);
+		image[CONFIG_SYSTEMS + i] = (unsigned char)ctx->antenna_system_table[i];
+	}
+
+	put_mask(image + CONFIG_GLOBAL, ctx->global_relays);
+
+	for (i=0; i<MOAS_STATIONS; i++) {
+		if (ctx->inhibit_polarity[i]) {
+			polarity |= 1<<i;
+		}
+		if (ctx->inhibit_type[i]) {
+			type |= 1<<i;
+		}
+		image[CONFIG_CROSS + i] = (unsigned char)ctx->cross_inhibits[i];
+		image[CONFIG_ALTERNATES + i] = (unsigned char)ctx->alternates[i];
+	}
+	image[CONFIG_POLARITY] = (unsigned char)polarity;
+	image[CONFIG_TYPE] = (unsigned char)type;
+	image[CONFIG_WAIT] = (unsigned char)ctx->wait_mode;
+
+	put_delays(image + CONFIG_INHIBIT, ctx->inhibit_time);
+	put_delays(image + CONFIG_RECEIVE, ctx->receive_delay);
+	put_delays(image + CONFIG_INTERRUPT, ctx->interrupt_delay);
+
+	for (i=0; i<CONFIG_CHECK; i++) {
+		sum += image[i];
+	}
+	image[CONFIG_CHECK] = (unsigned char)(0 - sum);
+}
+
+int moas_load_config_ctx(moas_ctx *ctx, const unsigned char *image,
+	size_t len)
+//----------------------------------------------------------------------
+// Load the configuration from an image
+//----------------------------------------------------------------------
+{
+	unsigned char sum = 0;
+	int i;
+
+	// Check everything before anything is changed
+	if ((len != MOAS_CONFIG_LEN) ||
+		(memcmp(image, CONFIG_MAGIC, CONFIG_MAGIC_LEN) != 0)) {
+		return FALSE;
+	}
+	for (i=0; i<MOAS_CONFIG_LEN; i++) {
+		sum += image[i];
+	}
+	if (sum != 0) {
+		return FALSE;
+	}
+	for (i=0; i<MOAS_ANTENNAS; i++) {
+		if (image[CONFIG_SYSTEMS + i] >= MOAS_ANTENNAS) {
+			return FALSE;
+		}
+	}
+	if ((image[CONFIG_POLARITY] & ~ALL_STATIONS) ||
+		(image[CONFIG_TYPE] & ~ALL_STATIONS) ||
+		(image[CONFIG_WAIT] & ~ALL_STATIONS)) {
+		return FALSE;
+	}
+	for (i=0; i<MOAS_STATIONS; i++) {
+		if ((image[CONFIG_CROSS + i] & ~(ALL_STATIONS & ~(1<<i))) ||
+			(image[CONFIG_ALTERNATES + i] & ~(ALL_STATIONS & ~(1<<i)))) {
+			return FALSE;
+		}
+		if ((get_delay(image + CONFIG_INHIBIT, i) > MAX_DELAY) ||
+			(get_delay(image + CONFIG_RECEIVE, i) > MAX_DELAY) ||
+			(get_delay(image + CONFIG_INTERRUPT, i) > MAX_DELAY)) {
+			return FALSE;
+		}
+	}
+
+	for (i=0; i<MOAS_ANTENNAS; i++) {
+		ctx->conflicts_table[i] = get_mask(image + CONFIG_CONFLICTS + 8*i);
+		ctx->fast_table[i] = get_mask(image + CONFIG_FAST + 8*i);
+		ctx->antenna_system_table[i] = image[CONFIG_SYSTEMS + i];
+	}
+
+	ctx->global_relays = get_mask(image + CONFIG_GLOBAL);
+
+	for (i=0; i<MOAS_STATIONS; i++) {
+		ctx->inhibit_polarity[i] = ((image[CONFIG_POLARITY] & (1<<i)) != 0);
+		ctx->inhibit_type[i] = ((image[CONFIG_TYPE] & (1<<i)) != 0);
+		ctx->cross_inhibits[i] = image[CONFIG_CROSS + i];
+		ctx->alternates[i] = image[CONFIG_ALTERNATES + i];
+		ctx->inhibit_time[i] = get_delay(image + CONFIG_INHIBIT, i);
+		ctx->receive_delay[i] = get_delay(image + CONFIG_RECEIVE, i);
+		ctx->interrupt_delay[i] = get_delay(image + CONFIG_INTERRUPT, i);
+	}
+	ctx->wait_mode = image[CONFIG_WAIT];
+
+	ctx->dirty_inputs = TRUE;
+	do_pins(ctx);
+	flush_output(ctx);
+	return TRUE;
+}
+
+// A snapshot starts with this and ends with a byte which makes the sum
+// of every byte zero.  In between is each field in snapshot_fields in
+// turn.  Numbers are written seven bits to a byte, low bits first, with
+// the top bit set in every byte but the last, so the many small values
+// take one byte each.  Character fields only hold the characters in
+// use.  The version goes up whenever the fields change.
+#define SNAPSHOT_MAGIC     "MOASSNP7"
+#define SNAPSHOT_MAGIC_LEN 8
+
+// The longest a number can be when written
+#define SNAPSHOT_NUMBER_LEN 10
+
+enum {
+	FIELD_INT,
+	FIELD_MASK,
+	FIELD_CHARS
+};
+
+typedef struct snapshot_field {
+	size_t offset;
+	int kind;
+	int count;
+
+	// The largest value an int may have.  Restoring anything larger
+	// could index outside the tables.
+	int max;
+
+	// For character fields, the int field before it which counts the
+	// characters in use.  Characters left over from earlier are not
+	// written, so they cannot make two snapshots of one state differ.
+	size_t used;
+} snapshot_field;
+
+#define FIELD_COUNT(f, type) ((int)(sizeof(((moas_ctx *)0)->f) / sizeof(type)))
+#define INT_FIELD(f, max)  { offsetof(moas_ctx, f), FIELD_INT, FIELD_COUNT(f, int), max, 0 }
+#define MASK_FIELD(f)      { offsetof(moas_ctx, f), FIELD_MASK, FIELD_COUNT(f, uint64_t), 0, 0 }
+#define CHARS_FIELD(f, n)  { offsetof(moas_ctx, f), FIELD_CHARS, FIELD_COUNT(f, char), 0, offsetof(moas_ctx, n) }
+
+static const snapshot_field snapshot_fields[] = {
+	MASK_FIELD(global_relays),
+	INT_FIELD(actual_tx_antennas, MOAS_ANTENNAS-1),
+	INT_FIELD(actual_rx_antennas, MOAS_ANTENNAS-1),
+	MASK_FIELD(actual_tx_relays),
+	MASK_FIELD(actual_rx_relays),
+	INT_FIELD(current_tx_antennas, MOAS_ANTENNAS-1),
+	INT_FIELD(current_rx_antennas, MOAS_ANTENNAS-1),
+	MASK_FIELD(current_tx_relays),
+	MASK_FIELD(current_rx_relays),
+	INT_FIELD(pending_tx_antennas, MOAS_ANTENNAS-1),
+	INT_FIELD(pending_rx_antennas, MOAS_ANTENNAS-1),
+	MASK_FIELD(pending_tx_relays),
+	MASK_FIELD(pending_rx_relays),
+	INT_FIELD(alternate_antennas, MOAS_ANTENNAS-1),
+	MASK_FIELD(alternate_relays),
+	MASK_FIELD(actual_alternate_relays),
+	MASK_FIELD(actual_relays),
+	INT_FIELD(actual_inhibits, TRUE),
+	INT_FIELD(output_inhibits, ALL_STATIONS),
+	MASK_FIELD(station_relays),
+	INT_FIELD(dirty_stations, ALL_STATIONS),
+	INT_FIELD(pin_inhibits, ALL_STATIONS),
+	INT_FIELD(pin_transmitting, ALL_STATIONS),
+	INT_FIELD(pin_alternates, ALL_STATIONS),
+	INT_FIELD(dirty_inputs, TRUE),
+	MASK_FIELD(output_relays),
+	INT_FIELD(output_relay_array, TRUE),
+	INT_FIELD(tx_pending, ALL_STATIONS),
+	INT_FIELD(rx_pending, ALL_STATIONS),
+	INT_FIELD(extra_pending, ALL_STATIONS),
+	INT_FIELD(alt_pending, ALL_STATIONS),
+	INT_FIELD(trbits, ALL_STATIONS),
+	INT_FIELD(tr_last, ALL_STATIONS),
+	INT_FIELD(wait_mode, ALL_STATIONS),
+	INT_FIELD(command_wait_mode, ALL_STATIONS),
+	INT_FIELD(same_antenna_wait_mode, ALL_STATIONS),
+	INT_FIELD(conflict_sent_rx, TRUE),
+	INT_FIELD(conflict_sent_tx, TRUE),
+	INT_FIELD(inhibit_polarity, TRUE),
+	INT_FIELD(inhibit_type, TRUE),
+	INT_FIELD(cross_inhibits, ALL_STATIONS),
+	INT_FIELD(inhibit_time, MAX_DELAY),
+	INT_FIELD(receive_delay, MAX_DELAY),
+	INT_FIELD(interrupt_delay, MAX_DELAY),
+	INT_FIELD(receive_holds, ALL_STATIONS),
+	INT_FIELD(settle_inhibits, ALL_STATIONS),
+	INT_FIELD(interrupt_waits, ALL_STATIONS),
+	INT_FIELD(interrupt_ready, ALL_STATIONS),
+	INT_FIELD(interrupt_inhibits, ALL_STATIONS),
+	MASK_FIELD(receive_due),
+	MASK_FIELD(settle_due),
+	MASK_FIELD(interrupt_due),
+	MASK_FIELD(tx_requested),
+	MASK_FIELD(rx_requested),
+	MASK_FIELD(started),
+	INT_FIELD(alternates, ALL_STATIONS),
+	INT_FIELD(command_buffer_in, COMMAND_BUFFER_LEN),
+	CHARS_FIELD(command_buffer, command_buffer_in),
+	INT_FIELD(command_inhibits, ALL_STATIONS),
+	INT_FIELD(batch, TRUE),
+	INT_FIELD(batch_tx, ALL_STATIONS),
+	INT_FIELD(batch_rx, ALL_STATIONS),
+	INT_FIELD(batch_alt, ALL_STATIONS),
+	INT_FIELD(batch_extra, ALL_STATIONS),
+	INT_FIELD(batch_set, ALL_STATIONS),
+	INT_FIELD(batch_reset, ALL_STATIONS),
+	INT_FIELD(batch_global, TRUE),
+	INT_FIELD(batch_tx_antennas, MOAS_ANTENNAS-1),
+	INT_FIELD(batch_rx_antennas, MOAS_ANTENNAS-1),
+	INT_FIELD(batch_alternate_antennas, MOAS_ANTENNAS-1),
+	MASK_FIELD(batch_tx_requested),
+	MASK_FIELD(batch_rx_requested),
+	MASK_FIELD(batch_tx_relays),
+	MASK_FIELD(batch_rx_relays),
+	MASK_FIELD(batch_alternate_relays),
+	MASK_FIELD(batch_extra_relays),
+	MASK_FIELD(batch_set_relays),
+	MASK_FIELD(batch_reset_relays),
+	MASK_FIELD(batch_global_relays),
+	INT_FIELD(unit_id, 99),
+	INT_FIELD(antenna_system_table, MOAS_ANTENNAS-1),
+	INT_FIELD(pending_tx_systems, MOAS_ANTENNAS-1),
+	INT_FIELD(pending_rx_systems, MOAS_ANTENNAS-1),
+	INT_FIELD(current_tx_systems, MOAS_ANTENNAS-1),
+	MASK_FIELD(conflicts_table),
+	MASK_FIELD(fast_table),
+	MASK_FIELD(current_extra_relays),
+	MASK_FIELD(pending_extra_relays),
+	MASK_FIELD(set_relays),
+	MASK_FIELD(reset_relays),
+	MASK_FIELD(sr_relays),
+	INT_FIELD(operate, TRUE),
+	INT_FIELD(resolver_on, TRUE),
+	INT_FIELD(antenna_events, TRUE),
+	INT_FIELD(tr_events, TRUE),
+	INT_FIELD(inhibit_events, TRUE),
+	INT_FIELD(extra_relay_events, TRUE),
+};
+
+#define SNAPSHOT_FIELDS ((int)(sizeof(snapshot_fields)/sizeof(snapshot_fields[0])))
+
+// A snapshot being written or read
+typedef struct snapshot_cursor {
+	unsigned char *out;
+	const unsigned char *in;
+	size_t pos;
+	size_t len;
+	unsigned char sum;
+} snapshot_cursor;
+
+static void
+snapshot_put(snapshot_cursor *cur, uint64_t n)
+//----------------------------------------------------------------------
+// Write a number, or only count its length if there is no room
+//----------------------------------------------------------------------
+{
+	unsigned char c;
+
+	do {
+		c = (unsigned char)(n & 0x7f);
+		n >>= 7;
+		if (n) {
+			c |= 0x80;
+		}
+		if (cur->out) {
+			cur->out[cur->pos] = c;
+			cur->sum += c;
+		}
+		cur->pos++;
+	} while (n);
+}
+
+static int
+snapshot_get(snapshot_cursor *cur, uint64_t *n)
+//----------------------------------------------------------------------
+// Read a number.  Returns FALSE if the snapshot ends first.
+//----------------------------------------------------------------------
+{
+	uint64_t value = 0;
+	unsigned char c;
+	int shift;
+
+	for (shift=0; shift<7*SNAPSHOT_NUMBER_LEN; shift+=7) {
+		if (cur->pos >= cur->len) {
+			return FALSE;
+		}
+		c = cur->in[cur->pos++];
+		value |= ((uint64_t)(c & 0x7f)) << shift;
+		if (!(c & 0x80)) {
+			*n = value;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void
+snapshot_write(moas_ctx *ctx, snapshot_cursor *cur)
+//----------------------------------------------------------------------
+// Write every field of a switch
+//----------------------------------------------------------------------
+{
+	const snapshot_field *f;
+	const unsigned char *base = (const unsigned char *)ctx;
+	const int *ints;
+	const uint64_t *masks;
+	const char *chars;
+	int used;
+	int i;
+	int j;
+
+	for (i=0; i<SNAPSHOT_FIELDS; i++) {
+		f = &snapshot_fields[i];
+		switch (f->kind) {
+		case FIELD_INT:
+			ints = (const int *)(base + f->offset);
+			for (j=0; j<f->count; j++) {
+				snapshot_put(cur, (unsigned)ints[j]);
+			}
+			break;
+
+		case FIELD_MASK:
+			masks = (const uint64_t *)(base + f->offset);
+			for (j=0; j<f->count; j++) {
+				snapshot_put(cur, masks[j]);
+			}
+			break;
+
+		case FIELD_CHARS:
+			chars = (const char *)(base + f->offset);
+			used = *(const int *)(base + f->used);
+			for (j=0; j<used; j++) {
+				snapshot_put(cur, (unsigned char)chars[j]);
+			}
+			break;
+		}
+	}
+}
+
+static int
+snapshot_read(moas_ctx *ctx, snapshot_cursor *cur)
+//----------------------------------------------------------------------
+// Read every field of a switch.  Returns FALSE if a value is not valid.
+//----------------------------------------------------------------------
+{
+	const snapshot_field *f;
+	unsigned char *base = (unsigned char *)ctx;
+	int *ints;
+	uint64_t *masks;
+	char *chars;
+	uint64_t n;
+	int used;
+	int i;
+	int j;
+
+	for (i=0; i<SNAPSHOT_FIELDS; i++) {
+		f = &snapshot_fields[i];
+		switch (f->kind) {
+		case FIELD_INT:
+			ints = (int *)(base + f->offset);
+			for (j=0; j<f->count; j++) {
+				if (!snapshot_get(cur, &n) || (n > (uint64_t)f->max)) {
+					return FALSE;
+				}
+				ints[j] = (int)n;
+			}
+			break;
+
+		case FIELD_MASK:
+			masks = (uint64_t *)(base + f->offset);
+			for (j=0; j<f->count; j++) {
+				if (!snapshot_get(cur, &masks[j])) {
+					return FALSE;
+				}
+			}
+			break;
+
+		case FIELD_CHARS:
+			chars = (char *)(base + f->offset);
+			used = *(const int *)(base + f->used);
+			for (j=0; j<f->count; j++) {
+				n = 0;
+				if ((j < used) && (!snapshot_get(cur, &n) || (n > 0xff))) {
+					return FALSE;
+				}
+				chars[j] = (char)n;
+			}
+			break;
+		}
+	}
+	return TRUE;
+}
+
+static void
+report_state(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Give the owner the antennas, relays and inhibits as they were last
+// worked out, after the switch state was replaced
+//----------------------------------------------------------------------
+{
+	int temp_inhibits[MOAS_STATIONS];
+	int i;
+
+	callback_antennas(ctx, ctx->actual_tx_antennas, ctx->actual_rx_antennas);
+
+	if (!ctx->operate) {
+		for (i=0; i<MOAS_STATIONS; i++) {
+			temp_inhibits[i] = TRUE;
+		}
+		callback_update(ctx, ctx->output_relays, ALL_STATIONS,
+						ctx->output_relay_array, temp_inhibits);
+	}
+	else {
+		callback_update(ctx, ctx->output_relays, ctx->output_inhibits,
+						ctx->output_relay_array, ctx->actual_inhibits);
+	}
+	flush_output(ctx);
+}
+
+static void
+copy_state(moas_ctx *to, const moas_ctx *from)
+//----------------------------------------------------------------------
+// Copy the switch state, keeping the callbacks, the timing wheel and
+// the owner's view.  The timers must be restarted afterwards.
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+	void *user;
+	moas_wheel *wheel;
+	int output_threshold;
+	int queue_depth;
+	int queue_max_depth;
+	unsigned long long queue_dropped;
+#if defined(MOAS_STATS)
+	stats_block *stats;
+#endif
+	relay_mask old_relays;
+	int old_inhibits;
+	int old_tx_antennas[MOAS_STATIONS];
+	int old_rx_antennas[MOAS_STATIONS];
+
+	// Replies held for the owner go out before the state is replaced
+	flush_output(to);
+
+	callbacks = to->callbacks;
+	user = to->user;
+	wheel = to->wheel;
+	output_threshold = to->output_threshold;
+	queue_depth = to->queue_depth;
+	queue_max_depth = to->queue_max_depth;
+	queue_dropped = to->queue_dropped;
+#if defined(MOAS_STATS)
+	stats = to->stats;
+#endif
+	old_relays = to->old_relays;
+	old_inhibits = to->old_inhibits;
+	memcpy(old_tx_antennas, to->old_tx_antennas, sizeof(old_tx_antennas));
+	memcpy(old_rx_antennas, to->old_rx_antennas, sizeof(old_rx_antennas));
+
+	stop_timers(to);
+	if (to != from) {
+		memcpy(to, from, sizeof(moas_ctx));
+	}
+
+	to->callbacks = callbacks;
+	to->user = user;
+	to->wheel = wheel;
+	to->output_buffer_len = 0;
+	to->output_threshold = output_threshold;
+	to->queue_depth = queue_depth;
+	to->queue_max_depth = queue_max_depth;
+	to->queue_dropped = queue_dropped;
+#if defined(MOAS_STATS)
+	to->stats = stats;
+#endif
+	init_timers(to);
+	to->old_relays = old_relays;
+	to->old_inhibits = old_inhibits;
+	memcpy(to->old_tx_antennas, old_tx_antennas, sizeof(old_tx_antennas));
+	memcpy(to->old_rx_antennas, old_rx_antennas, sizeof(old_rx_antennas));
+}
+
+size_t moas_snapshot_ctx(moas_ctx *ctx, unsigned char *blob, size_t len)
+//----------------------------------------------------------------------
+// Save the switch state
+//----------------------------------------------------------------------
+{
+	snapshot_cursor cur;
+	size_t total;
+
+	// Find the length first
+	memset(&cur, 0, sizeof(cur));
+	cur.pos = SNAPSHOT_MAGIC_LEN;
+	snapshot_write(ctx, &cur);
+	total = cur.pos + 1;
+	if (total > len) {
+		return total;
+	}
+
+	memset(&cur, 0, sizeof(cur));
+	memcpy(blob, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+	for (cur.pos=0; cur.pos<SNAPSHOT_MAGIC_LEN; cur.pos++) {
+		cur.sum += blob[cur.pos];
+	}
+	cur.out = blob;
+	snapshot_write(ctx, &cur);
+	blob[cur.pos] = (unsigned char)(0 - cur.sum);
+	return total;
+}
+
+int moas_restore_ctx(moas_ctx *ctx, const unsigned char *blob, size_t len)
+//----------------------------------------------------------------------
+// Put the switch state back to a snapshot
+//----------------------------------------------------------------------
+{
+	snapshot_cursor cur;
+	moas_ctx *temp;
+	unsigned char sum = 0;
+	size_t i;
+
+	if ((len <= SNAPSHOT_MAGIC_LEN) ||
+		(memcmp(blob, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0)) {
+		return FALSE;
+	}
+	for (i=0; i<len; i++) {
+		sum += blob[i];
+	}
+	if (sum != 0) {
+		return FALSE;
+	}
+
+	// Read into a copy so nothing changes if the snapshot is bad
+	temp = (moas_ctx *)malloc(sizeof(moas_ctx));
+	if (temp == NULL) {
+		return FALSE;
+	}
+	memcpy(temp, ctx, sizeof(moas_ctx));
+
+	memset(&cur, 0, sizeof(cur));
+	cur.in = blob;
+	cur.pos = SNAPSHOT_MAGIC_LEN;
+	cur.len = len - 1;
+	if (!snapshot_read(temp, &cur) || (cur.pos != cur.len)) {
+		free(temp);
+		return FALSE;
+	}
+
+	copy_state(ctx, temp);
+	free(temp);
+	restart_timers(ctx);
+	report_state(ctx);
+	return TRUE;
+}
+
+moas_ctx *moas_fork_ctx(moas_ctx *ctx, const moas_callbacks *callbacks,
+	void *user)
+//----------------------------------------------------------------------
+// Create a copy of a switch
+//----------------------------------------------------------------------
+{
+	moas_ctx *fork = (moas_ctx *)malloc(sizeof(moas_ctx));
+
+	if (fork == NULL) {
+		return NULL;
+	}
+
+	memcpy(fork, ctx, sizeof(moas_ctx));
+
+#if defined(MOAS_STATS)
+	// The copy counts from nothing but starts from the same relays
+	fork->stats = (stats_block *)calloc(1, sizeof(stats_block));
+	if (fork->stats == NULL) {
+		free(fork);
+		return NULL;
+	}
+	fork->stats->relays = ctx->stats->relays;
+	fork->stats->inhibits = ctx->stats->inhibits;
+#endif
+
+	if (callbacks) {
+		fork->callbacks = *callbacks;
+	}
+	fork->user = user;
+	fork->output_buffer_len = 0;
+	fork->queue_depth = 0;
+	fork->queue_max_depth = 0;
+	fork->queue_dropped = 0;
+	reset_owner_view(fork);
+
+	// The copy's timers run on the same wheel
+	init_timers(fork);
+	restart_timers(fork);
+
+	report_state(fork);
+	return fork;
+}
+
+void moas_copy_ctx(moas_ctx *to, const moas_ctx *from)
+//----------------------------------------------------------------------
+// Make a switch a copy of another
+//----------------------------------------------------------------------
+{
+	copy_state(to, from);
+	restart_timers(to);
+	report_state(to);
+}
+
+void moas_initialize_ctx(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Set up the initial state for the server
+//----------------------------------------------------------------------
+{
+	int i;
 
-static int conflict_sent_rx[MOAS_STATIONS];
-static int conflict_sent_tx[MOAS_STATIONS];
+	// Anything produced before the reset still goes out
+	flush_output(ctx);
 
-static int inhibit_polarity[MOAS_STATIONS];
+	stop_timers(ctx);
+	ctx->receive_holds = 0;
+	ctx->settle_inhibits = 0;
+	ctx->interrupt_waits = 0;
+	ctx->interrupt_ready = 0;
+	ctx->interrupt_inhibits = 0;
 
-static int inhibit_type[MOAS_STATIONS];
+	ctx->global_relays = 0;
+	ctx->actual_relays = 0;
+	ctx->sr_relays = 0;
 
-// These are the cross-station inhibits (where
-// one station transmitting inhibits others)
-static int cross_inhibits[MOAS_STATIONS];
+	ctx->output_relays = 0;
+	for (i=0; i<MOAS_RELAYS; i++) {
+		ctx->output_relay_array[i] = FALSE;
+	}
 
-// These are the last inhibits sent to the
-// emulator program
-static int old_inhibits;
+	ctx->output_inhibits = 0;
 
-// These are the cross-station alternates (where
-// one station transmitting forces another to use
-// the alternate antenna
-static int alternates[MOAS_STATIONS];
- 
-// The actual switch has a circular buffer but
-// it isn't needed here.
-static char command_buffer[COMMAND_BUFFER_LEN];
-static int command_buffer_in;
+	ctx->dirty_stations = ALL_STATIONS;
+	ctx->dirty_inputs = TRUE;
+	ctx->pin_inhibits = 0;
+	ctx->pin_transmitting = 0;
+	ctx->pin_alternates = 0;
 
-// Stations inhibited by commands
-static int command_inhibits;
+	for (i=0; i<MOAS_STATIONS; i++) {
+		ctx->actual_tx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->actual_rx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->current_tx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->current_rx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->pending_tx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->pending_rx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->alternate_antennas[i] = MOAS_ANTENNAS-1;
+
+		ctx->conflict_sent_rx[i] = FALSE;
+		ctx->conflict_sent_tx[i] = FALSE;
+		ctx->inhibit_polarity[i] = FALSE;
+		ctx->inhibit_type[i] = FALSE;
+		ctx->actual_inhibits[i] = FALSE;
+		ctx->station_relays[i] = 0;
+
+		ctx->pending_tx_systems[i] = 0;
+		ctx->pending_rx_systems[i] = 0;
+		ctx->current_tx_systems[i] = 0;
+
+		ctx->alternates[i] = 0;
+
+		ctx->cross_inhibits[i] = 0;
+
+		ctx->inhibit_time[i] = 0;
+		ctx->receive_delay[i] = 0;
+		ctx->interrupt_delay[i] = 0;
+		ctx->receive_due[i] = 0;
+		ctx->settle_due[i] = 0;
+		ctx->interrupt_due[i] = 0;
+
+		ctx->actual_tx_relays[i] = 0;
+		ctx->actual_rx_relays[i] = 0;
+		ctx->current_tx_relays[i] = 0;
+		ctx->current_rx_relays[i] = 0;
+		ctx->pending_tx_relays[i] = 0;
+		ctx->pending_rx_relays[i] = 0;
+		ctx->current_extra_relays[i] = 0;
+		ctx->pending_extra_relays[i] = 0;
+		ctx->alternate_relays[i] = 0;
+		ctx->actual_alternate_relays[i] = 0;
+		ctx->set_relays[i] = 0;
+		ctx->reset_relays[i] = 0;
+	}
 
-// Unit identifier
-static int unit_id;
+	for (i=0; i<MOAS_ANTENNAS; i++) {
+		ctx->antenna_system_table[i] = FALSE;
+		ctx->conflicts_table[i] = 0;
+		ctx->fast_table[i] = 0;
+	}
 
-static int antenna_system_table[MOAS_ANTENNAS];
+	ctx->unit_id = 0;
+	ctx->command_buffer_in = 0;
 
-// These are the pending antenna sytems for each station.
-// If an antenna change is pending these represent the
-// pending antenna, otherwise they are zero.
-static int pending_tx_systems[MOAS_STATIONS];
-static int pending_rx_systems[MOAS_STATIONS];
+	ctx->trbits = 0;
+	ctx->tr_last = 0;
 
-// These are the current antenna sytems for each
-// station.  Only the transmit entries are used.
-static int current_tx_systems[MOAS_STATIONS];
+	ctx->tx_pending = 0;
+	ctx->rx_pending = 0;
+	ctx->extra_pending = 0;
+	ctx->alt_pending = 0;
 
-// This is the conflicts table.  In the actual
-// switch it is a triangle.
-static int conflicts_table[MOAS_ANTENNAS][MOAS_ANTENNAS];
+	ctx->wait_mode = 0x3f;
+	ctx->command_wait_mode = 0;
+	ctx->same_antenna_wait_mode = 0;
 
-// This is the fast table.  In the actual
-// switch it is a triangle.
-static int fast_table[MOAS_ANTENNAS][MOAS_ANTENNAS];
+	ctx->command_inhibits = 0;
 
-// These are the current and pending extra relays to be
-// set on transmit.
-static int current_extra_relays[MOAS_RELAYS][MOAS_STATIONS];
-static int pending_extra_relays[MOAS_RELAYS][MOAS_STATIONS];
+	ctx->batch = FALSE;
+	clear_batch(ctx);
 
-// These are the relays to be set when a station transmits
-static int set_relays[MOAS_RELAYS][MOAS_STATIONS];
+	ctx->operate = FALSE;
+	ctx->resolver_on = TRUE;
 
-// These are the relays to be reset when a station transmits
-static int reset_relays[MOAS_RELAYS][MOAS_STATIONS];
+	ctx->antenna_events = FALSE;
+	ctx->tr_events = FALSE;
+	ctx->inhibit_events = FALSE;
+	ctx->extra_relay_events = FALSE;
 
-// These are the resulting relays from the set/reset when a station transmits
-static int sr_relays[MOAS_RELAYS];
+	do_pins(ctx);
+}
 
-// TRUE if switch is in operate state
-static int operate;
+static void
+clear_batch(moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Forget the antenna commands given in a batch.  The staged values are
+// cleared as well so they cannot make two snapshots of one state
+// differ.
+//----------------------------------------------------------------------
+{
+	int i;
 
-// TRUE if the conflict resolver is on
-static int resolver_on;
+	ctx->batch_tx = 0;
+	ctx->batch_rx = 0;
+	ctx->batch_alt = 0;
+	ctx->batch_extra = 0;
+	ctx->batch_set = 0;
+	ctx->batch_reset = 0;
+	ctx->batch_global = FALSE;
+	ctx->batch_global_relays = 0;
 
-// The events which should be sent to the controlling program
-static int antenna_events;
-static int tr_events;
-static int inhibit_events;
-static int extra_relay_events;
+	for (i=0; i<MOAS_STATIONS; i++) {
+		ctx->batch_tx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->batch_rx_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->batch_alternate_antennas[i] = MOAS_ANTENNAS-1;
+		ctx->batch_tx_requested[i] = 0;
+		ctx->batch_rx_requested[i] = 0;
+		ctx->batch_tx_relays[i] = 0;
+		ctx->batch_rx_relays[i] = 0;
+		ctx->batch_alternate_relays[i] = 0;
+		ctx->batch_extra_relays[i] = 0;
+		ctx->batch_set_relays[i] = 0;
+		ctx->batch_reset_relays[i] = 0;
+	}
+}
 
 static int
-sixtodigit(int d)
+stage_antenna(moas_ctx *ctx, int station, char kind, int antenna, relay_mask ry)
 //----------------------------------------------------------------------
-// Convert a sixbit character to an integer value
+// Keep an antenna command given in a batch until the batch is
+// committed.  Returns FALSE if the kind of command is unknown.
 //----------------------------------------------------------------------
 {
-	if (d <= '9') {
-		return (d - '0');
-	}
-	if (d <= 'Z') {
-		return (d - 'A' + 10);
-	}
-	if (d <= 'z') {
-		return (d - 'a' + 36);
-	}
-	if (d == '{') {
-		return 62;
+	switch (kind) {
+	case 'T':
+	case 'R':
+	case 'B':
+		if (kind != 'R') {
+			ctx->batch_tx_antennas[station] = antenna;
+			ctx->batch_tx |= 1<<station;
+			ctx->batch_tx_requested[station] = wheel_time(ctx);
+			ctx->batch_tx_relays[station] = ry;
+		}
+		if (kind != 'T') {
+			ctx->batch_rx_antennas[station] = antenna;
+			ctx->batch_rx |= 1<<station;
+			ctx->batch_rx_requested[station] = wheel_time(ctx);
+			ctx->batch_rx_relays[station] = ry;
+		}
+		return TRUE;
+
+	case 'A':
+		ctx->batch_alternate_antennas[station] = antenna;
+		ctx->batch_alt |= 1<<station;
+		ctx->batch_alternate_relays[station] = ry;
+		return TRUE;
+
+	case 'X':
+		ctx->batch_extra |= 1<<station;
+		ctx->batch_extra_relays[station] = ry;
+		return TRUE;
+
+	case 'S':
+		ctx->batch_set |= 1<<station;
+		ctx->batch_set_relays[station] = ry;
+		return TRUE;
+
+	case 'C':
+		ctx->batch_reset |= 1<<station;
+		ctx->batch_reset_relays[station] = ry;
+		return TRUE;
 	}
-	return 63;
+	return FALSE;
 }
 
-void moas_initialize()
+static void
+commit_batch(moas_ctx *ctx)
 //----------------------------------------------------------------------
-// Set up the initial state for the server
+// End a batch.  The antenna commands given in it become pending
+// changes, as if they had just been given, and are resolved together.
 //----------------------------------------------------------------------
 {
-	int i;
-	int j;
+	int staged = ctx->batch_tx | ctx->batch_rx | ctx->batch_alt |
+				 ctx->batch_extra | ctx->batch_set | ctx->batch_reset;
+	int stn;
 
-	for (i=0; i<MOAS_RELAYS; i++) {
-		global_relays [i] = FALSE;
-		actual_relays[i] = FALSE;
-		sr_relays[i] = FALSE;
+	ctx->batch = FALSE;
+	if (!staged && !ctx->batch_global) {
+		return;
 	}
 
-	old_inhibits = 0x3f;
-
-	for (i=0; i<MOAS_STATIONS; i++) {
-		actual_tx_antennas[i] = MOAS_ANTENNAS-1;
-		actual_rx_antennas[i] = MOAS_ANTENNAS-1;
-		current_tx_antennas[i] = MOAS_ANTENNAS-1;
-		current_rx_antennas[i] = MOAS_ANTENNAS-1;
-		pending_tx_antennas[i] = MOAS_ANTENNAS-1;
-		pending_rx_antennas[i] = MOAS_ANTENNAS-1;
-		alternate_antennas[i] = MOAS_ANTENNAS-1;
-
-		conflict_sent_rx[i] = FALSE;
-		conflict_sent_tx[i] = FALSE;
-		inhibit_polarity[i] = FALSE;
-		inhibit_type[i] = FALSE;
-		actual_inhibits[i] = FALSE;
-
-		pending_tx_systems[i] = 0;
-		pending_rx_systems[i] = 0;
-		current_tx_systems[i] = 0;
-
-		alternates[i] = 0;
-
-		cross_inhibits[i] = 0;
-
-		for (j=0; j<MOAS_RELAYS; j++) {
-			actual_tx_relays [j][i] = FALSE;
-			actual_rx_relays [j][i] = FALSE;
-			current_tx_relays [j][i] = FALSE;
-			current_rx_relays [j][i] = FALSE;
-			pending_tx_relays [j][i] = FALSE;
-			pending_rx_relays [j][i] = FALSE;
-			current_extra_relays[j][i] = FALSE;
-			pending_extra_relays[j][i] = FALSE;
-			alternate_relays[j][i] = FALSE;
-			actual_alternate_relays[j][i] = FALSE;
-			set_relays[j][i] = FALSE;
-			reset_relays[j][i] = FALSE;
-		}
+	if (ctx->batch_global) {
+		ctx->global_relays = ctx->batch_global_relays;
 	}
 
-	for (i=0; i<MOAS_ANTENNAS; i++) {
-		antenna_system_table[i] = FALSE;
-
-		for (j=0; j<MOAS_ANTENNAS; j++) {
-			conflicts_table[j][i] = FALSE;
-			fast_table[j][i] = FALSE;
+	for (stn=0; stn<MOAS_STATIONS; stn++) {
+		if (!(staged & (1<<stn))) {
+			continue;
+		}
+		if (ctx->batch_tx & (1<<stn)) {
+			ctx->pending_tx_antennas[stn] = ctx->batch_tx_antennas[stn];
+			ctx->tx_requested[stn] = ctx->batch_tx_requested[stn];
+			ctx->pending_tx_relays[stn] = ctx->batch_tx_relays[stn];
+		}
+		if (ctx->batch_rx & (1<<stn)) {
+			ctx->pending_rx_antennas[stn] = ctx->batch_rx_antennas[stn];
+			ctx->rx_requested[stn] = ctx->batch_rx_requested[stn];
+			ctx->pending_rx_relays[stn] = ctx->batch_rx_relays[stn];
+		}
+		if (ctx->batch_alt & (1<<stn)) {
+			ctx->alternate_antennas[stn] = ctx->batch_alternate_antennas[stn];
+			ctx->alternate_relays[stn] = ctx->batch_alternate_relays[stn];
+		}
+		if (ctx->batch_extra & (1<<stn)) {
+			ctx->pending_extra_relays[stn] = ctx->batch_extra_relays[stn];
+		}
+		if (ctx->batch_set & (1<<stn)) {
+			ctx->set_relays[stn] = ctx->batch_set_relays[stn];
+		}
+		if (ctx->batch_reset & (1<<stn)) {
+			ctx->reset_relays[stn] = ctx->batch_reset_relays[stn];
 		}
 	}
+	ctx->tx_pending |= ctx->batch_tx;
+	ctx->rx_pending |= ctx->batch_rx;
+	ctx->alt_pending |= ctx->batch_alt;
+	ctx->extra_pending |= ctx->batch_extra;
 
-	unit_id = 0;
-	command_buffer_in = 0;
-
-	trbits = 0;
-	tr_last = 0;
-
-	tx_pending = 0;
-	rx_pending = 0;
-	extra_pending = 0;
-	alt_pending = 0;
-
-	wait_mode = 0x3f;
-	command_wait_mode = 0;
-	same_antenna_wait_mode = 0;
-
-	command_inhibits = 0;
-
-	operate = FALSE;
-	resolver_on = TRUE;
-
-	antenna_events = FALSE;
-	tr_events = FALSE;
-	inhibit_events = FALSE;
-	extra_relay_events = FALSE;
-
-	do_pins();
+	clear_batch(ctx);
+	do_resolver(ctx);
 }
 
 static void
-command_antenna()
+command_antenna(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process an antenna command
 //----------------------------------------------------------------------
 {
 	int station;
 	int antenna;
-	int ry[MOAS_RELAYS];
-	int i;
-
-	for (i=0; i<MOAS_RELAYS; i++) {
-		ry[i] = FALSE;
-	}
-
-	if ((command_buffer[1] == ';') ||
-		(command_buffer[2] == ';') ||
-		(command_buffer[3] == ';')) {
-		moas_callback_write("?A;");
+	relay_mask ry;
+	const char *end;
+	int bad;
+
+	if ((cmd[1] == ';') ||
+		(cmd[2] == ';') ||
+		(cmd[3] == ';')) {
+		callback_write(ctx, "?A;");
 		return;
 	}
 
-	for (i=4; command_buffer[i]!=';'; i++) {
-		ry[sixtodigit(command_buffer[i])] = TRUE;
+	// The relay list runs up to the semicolon
+	end = (const char *)memchr(cmd+4, ';', COMMAND_BUFFER_LEN);
+	ry = moas_simd_decode_relays(cmd+4, end - (cmd+4), &bad);
+	if (bad) {
+		callback_write(ctx, "?A;");
+		return;
 	}
 
 	// Station 0 is special - relays go to global relays
-	if (command_buffer[1] == '0') {
-		for (i=0; i<MOAS_ANTENNAS; i++) {
-			global_relays[i] = ry[i];
+	if (cmd[1] == '0') {
+		if (ctx->batch) {
+			ctx->batch_global = TRUE;
+			ctx->batch_global_relays = ry;
+			return;
 		}
-		do_pins();
+		ctx->global_relays = ry;
+		do_pins(ctx);
 		return;
 	}
 
-	station = command_buffer[1] - '1';
+	station = cmd[1] - '1';
 	if ((station < 0) || (station >= MOAS_STATIONS)) {
-		moas_callback_write("?A;");
+		callback_write(ctx, "?A;");
+		return;
+	}
+	antenna = sixtodigit(cmd[3]);
+	if (antenna == SIXBIT_INVALID) {
+		callback_write(ctx, "?A;");
 		return;
 	}
-	antenna = sixtodigit(command_buffer[3]);
 
-	switch (command_buffer[2]) {
+	// A batch keeps the command apart until it is committed
+	if (ctx->batch) {
+		if (!stage_antenna(ctx, station, cmd[2], antenna, ry)) {
+			callback_write(ctx, "?A;");
+		}
+		return;
+	}
+
+	switch (cmd[2]) {
 	case 'T':
-		pending_tx_antennas[station] = antenna;
+		ctx->pending_tx_antennas[station] = antenna;
 
-		tx_pending |= 1<<station;
+		ctx->tx_pending |= 1<<station;
+		ctx->tx_requested[station] = wheel_time(ctx);
 
-		for (i=0; i<MOAS_RELAYS; i++) {
-			pending_tx_relays[i][station] = ry[i];
-		}
+		ctx->pending_tx_relays[station] = ry;
 		break;
 
 	case 'R':
-		pending_rx_antennas[station] = antenna;
+		ctx->pending_rx_antennas[station] = antenna;
 
-		rx_pending |= 1<<station;
+		ctx->rx_pending |= 1<<station;
+		ctx->rx_requested[station] = wheel_time(ctx);
 
-		for (i=0; i<MOAS_RELAYS; i++) {
-			pending_rx_relays[i][station] = ry[i];
-		}
+		ctx->pending_rx_relays[station] = ry;
 		break;
 
 	case 'B':
-		pending_tx_antennas[station] = antenna;
-		pending_rx_antennas[station] = antenna;
+		ctx->pending_tx_antennas[station] = antenna;
+		ctx->pending_rx_antennas[station] = antenna;
 
-		tx_pending |= 1<<station;
-		rx_pending |= 1<<station;
+		ctx->tx_pending |= 1<<station;
+		ctx->rx_pending |= 1<<station;
+		ctx->tx_requested[station] = wheel_time(ctx);
+		ctx->rx_requested[station] = ctx->tx_requested[station];
 
-		for (i=0; i<MOAS_RELAYS; i++) {
-			pending_tx_relays[i][station] = ry[i];
-			pending_rx_relays[i][station] = ry[i];
-		}
+		ctx->pending_tx_relays[station] = ry;
+		ctx->pending_rx_relays[station] = ry;
 		break;
 
 	case 'A':
-		alternate_antennas[station] = antenna;
+		ctx->alternate_antennas[station] = antenna;
 		// Set RX pending so the conflict resolver will recompute
 		// the receive antenna.
-		alt_pending |= 1<<station;
+		ctx->alt_pending |= 1<<station;
 
-		for (i=0; i<MOAS_RELAYS; i++) {
-			alternate_relays[i][station] = ry[i];
-		}
+		ctx->alternate_relays[station] = ry;
 		break;
 
 	case 'X':
-		extra_pending |= 1<<station;
+		ctx->extra_pending |= 1<<station;
 
-		for (i=0; i<MOAS_RELAYS; i++) {
-			pending_extra_relays[i][station] = ry[i];
-		}
+		ctx->pending_extra_relays[station] = ry;
 		break;
 
 	case 'S':
-		for (i=0; i<MOAS_RELAYS; i++) {
-			set_relays[i][station] = ry[i];
-		}
+		ctx->set_relays[station] = ry;
 		break;
 
 	case 'C':
-		for (i=0; i<MOAS_RELAYS; i++) {
-			reset_relays[i][station] = ry[i];
-		}
+		ctx->reset_relays[station] = ry;
 		break;
 
 	default:
-		moas_callback_write("?A;");
+		callback_write(ctx, "?A;");
 		break;
 	}
-	do_resolver();
+
+	do_resolver(ctx);
 }
 
 static void
-command_conflict_table()
+command_conflict_table(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a conflict table command
 //----------------------------------------------------------------------
 {
 	int i;
-	int j;
 	int ant1;
 	int ant2;
 
-	switch (command_buffer[1]) {
+	switch (cmd[1]) {
 	case '0':
 		for (i=0; i<MOAS_ANTENNAS; i++) {
-			for (j=0; j<MOAS_ANTENNAS; j++) {
-				conflicts_table[i][j] = FALSE;
-			}
+			ctx->conflicts_table[i] = 0;
 		}
 		break;
 	
 	case '1':
 		for (i=0; i<MOAS_ANTENNAS; i++) {
-			for (j=0; j<MOAS_ANTENNAS; j++) {
-				conflicts_table[i][j] = TRUE;
-			}
+			ctx->conflicts_table[i] = ~(antenna_mask)0;
 		}
 		break;
 
 	case 'C':
-		for (i=2; command_buffer[i] != ';'; i+=2) {
-			ant1 = sixtodigit(command_buffer[i]);
-			if (command_buffer[i+1] == ';') {
-				moas_callback_write("?A;");
+		for (i=2; cmd[i] != ';'; i+=2) {
+			ant1 = sixtodigit(cmd[i]);
+			if (cmd[i+1] == ';') {
+				callback_write(ctx, "?A;");
+				break;
+			}
+			ant2 = sixtodigit(cmd[i+1]);
+			if ((ant1 | ant2) & SIXBIT_INVALID) {
+				callback_write(ctx, "?A;");
 				break;
 			}
-			ant2 = sixtodigit(command_buffer[i+1]);
-			conflicts_table[ant1][ant2] = TRUE;
-			conflicts_table[ant2][ant1] = TRUE;
+			ctx->conflicts_table[ant1] |= ANTENNA(ant2);
+			ctx->conflicts_table[ant2] |= ANTENNA(ant1);
 		}
 		break;
 
 	case 'c':
-		for (i=2; command_buffer[i] != ';'; i+=2) {
-			ant1 = sixtodigit(command_buffer[i]);
-			if (command_buffer[i+1] == ';') {
-				moas_callback_write("?A;");
+		for (i=2; cmd[i] != ';'; i+=2) {
+			ant1 = sixtodigit(cmd[i]);
+			if (cmd[i+1] == ';') {
+				callback_write(ctx, "?A;");
+				break;
+			}
+			ant2 = sixtodigit(cmd[i+1]);
+			if ((ant1 | ant2) & SIXBIT_INVALID) {
+				callback_write(ctx, "?A;");
 				break;
 			}
-			ant2 = sixtodigit(command_buffer[i+1]);
-			conflicts_table[ant1][ant2] = FALSE;
-			conflicts_table[ant2][ant1] = FALSE;
+			ctx->conflicts_table[ant1] &= ~ANTENNA(ant2);
+			ctx->conflicts_table[ant2] &= ~ANTENNA(ant1);
 		}
 		break;
 
 	default:
-		moas_callback_write("?a;");
+		callback_write(ctx, "?a;");
 		break;
 	}
 }
 
 static void
-command_fast_table()
+command_fast_table(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a fast table command
 //----------------------------------------------------------------------
 {
 	int i;
-	int j;
 	int ant1;
 	int ant2;
 
-	switch (command_buffer[1]) {
+	switch (cmd[1]) {
 	case '0':
 		for (i=0; i<MOAS_ANTENNAS; i++) {
-			for (j=0; j<MOAS_ANTENNAS; j++) {
-				fast_table[i][j] = FALSE;
-			}
+			ctx->fast_table[i] = 0;
 		}
 		break;
 	
 	case '1':
 		for (i=0; i<MOAS_ANTENNAS; i++) {
-			for (j=0; j<MOAS_ANTENNAS; j++) {
-				fast_table[i][j] = TRUE;
-			}
+			ctx->fast_table[i] = ~(antenna_mask)0;
 		}
 		break;
 
 	case 'F':
-		for (i=2; command_buffer[i] != ';'; i+=2) {
-			ant1 = sixtodigit(command_buffer[i]);
-			if (command_buffer[i+1] == ';') {
-				moas_callback_write("?A;");
+		for (i=2; cmd[i] != ';'; i+=2) {
+			ant1 = sixtodigit(cmd[i]);
+			if (cmd[i+1] == ';') {
+				callback_write(ctx, "?A;");
+				break;
+			}
+			ant2 = sixtodigit(cmd[i+1]);
+			if ((ant1 | ant2) & SIXBIT_INVALID) {
+				callback_write(ctx, "?A;");
 				break;
 			}
-			ant2 = sixtodigit(command_buffer[i+1]);
-			fast_table[ant1][ant2] = TRUE;
-			fast_table[ant2][ant1] = TRUE;
+			ctx->fast_table[ant1] |= ANTENNA(ant2);
+			ctx->fast_table[ant2] |= ANTENNA(ant1);
 		}
 		break;
 
 	case 'f':
-		for (i=2; command_buffer[i] != ';'; i+=2) {
-			ant1 = sixtodigit(command_buffer[i]);
-			if (command_buffer[i+1] == ';') {
-				moas_callback_write("?A;");
+		for (i=2; cmd[i] != ';'; i+=2) {
+			ant1 = sixtodigit(cmd[i]);
+			if (cmd[i+1] == ';') {
+				callback_write(ctx, "?A;");
 				break;
 			}
-			ant2 = sixtodigit(command_buffer[i+1]);
-			fast_table[ant1][ant2] = FALSE;
-			fast_table[ant2][ant1] = FALSE;
+			ant2 = sixtodigit(cmd[i+1]);
+			if ((ant1 | ant2) & SIXBIT_INVALID) {
+				callback_write(ctx, "?A;");
+				break;
+			}
+			ctx->fast_table[ant1] &= ~ANTENNA(ant2);
+			ctx->fast_table[ant2] &= ~ANTENNA(ant1);
 		}
 		break;
 
 	default:
-		moas_callback_write("?a;");
+		callback_write(ctx, "?a;");
 		break;
 	}
 }
 
 static void
-command_inhibit()
+command_inhibit(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process an inhibit command
 //----------------------------------------------------------------------
@@ -527,20 +2246,21 @@ command_inhibit()
 	int i;
 	int station;
 
-	for (i=1; command_buffer[i] != ';'; i++) {
-		station = command_buffer[i] - '1';
+	for (i=1; cmd[i] != ';'; i++) {
+		station = cmd[i] - '1';
 		if ((station < 0) || (station >= MOAS_STATIONS)) {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			return;
 		}
-		command_inhibits |= 1<<station;
+		ctx->command_inhibits |= 1<<station;
+		ctx->dirty_inputs = TRUE;
 	}
 
-	do_pins();
+	do_pins(ctx);
 }
 
 static void
-command_inhibit_other_station()
+command_inhibit_other_station(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process an inhibit other station command
 //----------------------------------------------------------------------
@@ -549,34 +2269,35 @@ command_inhibit_other_station()
 	int station;
 	int other;
 
-	if (command_buffer[1] == ';') {
-		moas_callback_write("?A;");
+	if (cmd[1] == ';') {
+		callback_write(ctx, "?A;");
 		return;
 	}
-	station = command_buffer[1] - '1';
+	station = cmd[1] - '1';
 	if ((station < 0) || (station >= MOAS_STATIONS)) {
-		moas_callback_write("?A;");
+		callback_write(ctx, "?A;");
 		return;
 	}
 
-	cross_inhibits[station] = 0;
+	ctx->cross_inhibits[station] = 0;
+	ctx->dirty_inputs = TRUE;
 
-	for (i=2; command_buffer[i] != ';'; i++) {
-		other = command_buffer[i] - '1';
+	for (i=2; cmd[i] != ';'; i++) {
+		other = cmd[i] - '1';
 		if ((other < 0) || (other >= MOAS_STATIONS)) {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			return;
 		}
 		if (other == station) {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			return;
 		}
-		cross_inhibits[station] |= 1<<other;
+		ctx->cross_inhibits[station] |= 1<<other;
 	}
 }
 
 static void
-command_inhibit_polarity()
+command_inhibit_polarity(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process an inhibit polarity command
 //----------------------------------------------------------------------
@@ -584,49 +2305,49 @@ command_inhibit_polarity()
 	int station;
 	int i;
 
-	switch (command_buffer[1]) {
+	switch (cmd[1]) {
 	case '0':
 		for (i=0; i<MOAS_STATIONS; i++) {
-			inhibit_polarity[i] = FALSE;
+			ctx->inhibit_polarity[i] = FALSE;
 		}
 		break;
 
 	case '1':
 		for (i=0; i<MOAS_STATIONS; i++) {
-			inhibit_polarity[i] = TRUE;
+			ctx->inhibit_polarity[i] = TRUE;
 		}
 		break;
 
 	case 'E':
-		for (i=2; command_buffer[i] != ';'; i++) {
-			station = command_buffer[i] - '1';
+		for (i=2; cmd[i] != ';'; i++) {
+			station = cmd[i] - '1';
 			if ((station < 0) || (station >= MOAS_STATIONS)) {
-				moas_callback_write("?A;");
+				callback_write(ctx, "?A;");
 				return;
 			}
-			inhibit_polarity[i] = TRUE;
+			ctx->inhibit_polarity[station] = TRUE;
 		}
 		break;
 
 	case 'I':
-		for (i=2; command_buffer[i] != ';'; i++) {
-			station = command_buffer[i] - '1';
+		for (i=2; cmd[i] != ';'; i++) {
+			station = cmd[i] - '1';
 			if ((station < 0) || (station >= MOAS_STATIONS)) {
-				moas_callback_write("?A;");
+				callback_write(ctx, "?A;");
 				return;
 			}
-			inhibit_polarity[i] = FALSE;
+			ctx->inhibit_polarity[station] = FALSE;
 		}
 		break;
 	
 	default:
-		moas_callback_write("?A;");
+		callback_write(ctx, "?A;");
 		break;
 	}
 }
 
 static void
-command_inhibit_type()
+command_inhibit_type(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process an inhibit type command
 //----------------------------------------------------------------------
@@ -634,67 +2355,118 @@ command_inhibit_type()
 	int station;
 	int i;
 
-	switch (command_buffer[1]) {
+	ctx->dirty_inputs = TRUE;
+
+	switch (cmd[1]) {
 	case '0':
 		for (i = 0; i < MOAS_STATIONS; i++) {
-			inhibit_type[i] = FALSE;
+			ctx->inhibit_type[i] = FALSE;
 		}
 		break;
 
 	case '1':
 		for (i = 0; i < MOAS_STATIONS; i++) {
-			inhibit_type[i] = TRUE;
+			ctx->inhibit_type[i] = TRUE;
 		}
 		break;
 
 	case 'T':
-		for (i = 2; command_buffer[i] != ';'; i++) {
-			station = command_buffer[i] - '1';
+		for (i = 2; cmd[i] != ';'; i++) {
+			station = cmd[i] - '1';
 			if ((station < 0) || (station >= MOAS_STATIONS)) {
-				moas_callback_write("?A;");
+				callback_write(ctx, "?A;");
 				return;
 			}
-			inhibit_type[i] = TRUE;
+			ctx->inhibit_type[station] = TRUE;
 		}
 		break;
 
 	case 'A':
-		for (i = 2; command_buffer[i] != ';'; i++) {
-			station = command_buffer[i] - '1';
+		for (i = 2; cmd[i] != ';'; i++) {
+			station = cmd[i] - '1';
 			if ((station < 0) || (station >= MOAS_STATIONS)) {
-				moas_callback_write("?A;");
+				callback_write(ctx, "?A;");
 				return;
 			}
-			inhibit_type[i] = FALSE;
+			ctx->inhibit_type[station] = FALSE;
 		}
 		break;
 
 	default:
-		moas_callback_write("?A;");
+		callback_write(ctx, "?A;");
 		break;
 	}
 }
 
+static int
+set_delay(const char *cmd, int *delays)
+//----------------------------------------------------------------------
+// Set a delay from a timer command.  The command holds a station, or 0
+// for every station, then the delay in milliseconds as up to three
+// sixbit digits, most significant first.  No digits is no delay.
+// Returns FALSE if the command is not valid.
+//----------------------------------------------------------------------
+{
+	int station;
+	int delay = 0;
+	int digit;
+	int i;
+
+	if (cmd[1] == ';') {
+		return FALSE;
+	}
+	station = cmd[1] - '1';
+	if ((station < -1) || (station >= MOAS_STATIONS)) {
+		return FALSE;
+	}
+
+	for (i=2; cmd[i] != ';'; i++) {
+		digit = sixtodigit(cmd[i]);
+		if ((digit == SIXBIT_INVALID) || (i >= 2 + DELAY_DIGITS)) {
+			return FALSE;
+		}
+		delay = (delay << 6) | digit;
+	}
+
+	if (station < 0) {
+		for (i=0; i<MOAS_STATIONS; i++) {
+			delays[i] = delay;
+		}
+	}
+	else {
+		delays[station] = delay;
+	}
+	return TRUE;
+}
+
 static void
-command_inhibit_time()
+command_inhibit_time(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
-// Process an inhibit time command
+// Process an inhibit time command.  A station whose relays move is
+// inhibited for this long so its radio cannot transmit into relays
+// which have not settled.
 //----------------------------------------------------------------------
 {
-	// Timers are ignored in the emulator
+	if (!set_delay(cmd, ctx->inhibit_time)) {
+		callback_write(ctx, "?A;");
+	}
 }
 
 static void
-command_interrupt_mode_delay()
+command_interrupt_mode_delay(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
-// Process an interrupt mode delay command
+// Process an interrupt mode delay command.  A transmit antenna change
+// which has to force stations in inhibit mode into receive inhibits
+// them and waits this long for them to stop before it is made.
 //----------------------------------------------------------------------
 {
-	// Timers are ignored in the emulator
+	if (!set_delay(cmd, ctx->interrupt_delay)) {
+		callback_write(ctx, "?A;");
+	}
 }
 
 static void
-command_mode()
+command_mode(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a mode command
 //----------------------------------------------------------------------
@@ -702,145 +2474,139 @@ command_mode()
 	int i;
 	int station;
 
-	if ((command_buffer[1] != 'W') && (command_buffer[1] != 'I')) {
-		moas_callback_write("?A;");
+	if ((cmd[1] != 'W') && (cmd[1] != 'I')) {
+		callback_write(ctx, "?A;");
 		return;
 	}
 
-	for (i=2; command_buffer[i] != ';'; i++) {
-		station = command_buffer[i] - '1';
+	for (i=2; cmd[i] != ';'; i++) {
+		station = cmd[i] - '1';
 		if ((station < 0) || (station >= MOAS_STATIONS)) {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			return;
 		}
-		if (command_buffer[1] == 'W') {
-			wait_mode |= 1<<station;
+		if (cmd[1] == 'W') {
+			ctx->wait_mode |= 1<<station;
 		}
 		else {
-			wait_mode &= ~(1<<station);
+			ctx->wait_mode &= ~(1<<station);
 		}
 	}
 }
 
 static void
-command_ping()
+command_ping(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a ping command
 //----------------------------------------------------------------------
 {
-	if (operate) {
-		moas_callback_write("';");
+	if (ctx->operate) {
+		callback_write(ctx, "';");
 	}
 	else {
-		moas_callback_write(".;");
+		callback_write(ctx, ".;");
 	}
 }
 
 static void
-command_receive_delay()
+command_receive_delay(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
-// Process a receive delay command
+// Process a receive delay command.  A station which stops transmitting
+// stays on its transmit relays this long before going to receive.
 //----------------------------------------------------------------------
 {
-	// Timers are ignored in the emulator
+	if (!set_delay(cmd, ctx->receive_delay)) {
+		callback_write(ctx, "?A;");
+	}
 }
 
 static void
-command_relay_status()
+command_relay_status(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a relay status command
 //----------------------------------------------------------------------
 {
-	char buffer[(MOAS_RELAYS+5)/6+3];
-	int i;
-	int j = 1;
-	int ry = 0;
+	char buffer[MOAS_RELAY_DIGITS+3];
 
 	buffer[0] =	'|';
 
-	for (i=63; i>=0; i--) {
-		ry = ry << 1;
-		if (actual_relays[i]) {
-			ry++;
-		}
-		if (!(i%6)) {
-			buffer[j++] = sixbit[ry];
-		}
-	}
+	// The first digit holds the four highest relays and
+	// each following digit holds the next six.
+	moas_simd_encode_relays(ctx->actual_relays, buffer+1);
 
-	buffer[j++] = ';';
-	buffer[j] = 0;
-	moas_callback_write(buffer);
+	buffer[MOAS_RELAY_DIGITS+1] = ';';
+	buffer[MOAS_RELAY_DIGITS+2] = 0;
+	callback_write(ctx, buffer);
 }
 
 static void
-command_set_state()
+command_set_state(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a set state command
 //----------------------------------------------------------------------
 {
 	int i;
 
-	for (i=1; command_buffer[i]!=';'; i++) {
-		switch (command_buffer[i]) {
+	for (i=1; cmd[i]!=';'; i++) {
+		switch (cmd[i]) {
 		case '0':
-			moas_initialize();
+			moas_initialize_ctx(ctx);
 			return;
 
 		case '1':
-			operate = TRUE;
-			do_pins();
+			ctx->operate = TRUE;
+			do_pins(ctx);
 			return;
 
 		case 'A':
-			antenna_events = TRUE;
+			ctx->antenna_events = TRUE;
 			break;
 
 		case 'a':
-			antenna_events = FALSE;
+			ctx->antenna_events = FALSE;
 			break;
 
 		case 'T':
-			tr_events = TRUE;
+			ctx->tr_events = TRUE;
 			break;
 			
 		case 't':
-			tr_events = FALSE;
+			ctx->tr_events = FALSE;
 			break;
 
 		case 'I':
-			inhibit_events = TRUE;
+			ctx->inhibit_events = TRUE;
 			break;
 
 		case 'i':
-			inhibit_events = FALSE;
+			ctx->inhibit_events = FALSE;
 			break;
 
 		case 'R':
-			resolver_on = TRUE;
+			ctx->resolver_on = TRUE;
 			break;
 
 		case 'r':
-			resolver_on = FALSE;
+			ctx->resolver_on = FALSE;
 			break;
 
 		case 'X':
-			extra_relay_events = TRUE;
+			ctx->extra_relay_events = TRUE;
 			break;
 
 		case 'x':
-			extra_relay_events = FALSE;
+			ctx->extra_relay_events = FALSE;
 			break;
 
 		default:
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			break;
 		}
 	}
 }
 
 static void
-command_status()
+command_status(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a status command
 //----------------------------------------------------------------------
@@ -849,17 +2615,17 @@ command_status()
 	int i;
 	int j;
 
-	if (command_buffer[1] == 'B') {
+	if (cmd[1] == 'B') {
 		buffer[0] = '"';
 		buffer[1] = 'B';
 
 		// Add the transmit/receive/inhibit status
 		for (i=0; i<MOAS_STATIONS; i++) {
-			if (command_inhibits & (1<<i)) {
+			if (ctx->command_inhibits & (1<<i)) {
 				buffer[i+2] = 'I';
 			}
 			else {
-				if (trbits & (1<<i)) {
+				if (ctx->trbits & (1<<i)) {
 					buffer[i+2] = 'T';
 				}
 				else {
@@ -870,46 +2636,46 @@ command_status()
 
 		// Add the transmit antennas
 		for (i=0; i<MOAS_STATIONS; i++) {
-			buffer[MOAS_STATIONS+i+2] = sixbit[actual_tx_antennas[i]];
+			buffer[MOAS_STATIONS+i+2] = sixbit[ctx->actual_tx_antennas[i]];
 		}
 
 		// Add the receive antennas
 		for (i=0; i<MOAS_STATIONS; i++) {
-			buffer[(2*MOAS_STATIONS)+i+2] = sixbit[actual_rx_antennas[i]];
+			buffer[(2*MOAS_STATIONS)+i+2] = sixbit[ctx->actual_rx_antennas[i]];
 		}
 
 		// Add the alternate antennas
 		for (i=0; i<MOAS_STATIONS; i++) {
-			buffer[(3*MOAS_STATIONS)+i+2] = sixbit[alternate_antennas[i]];
+			buffer[(3*MOAS_STATIONS)+i+2] = sixbit[ctx->alternate_antennas[i]];
 		}
 
 		buffer[(4*MOAS_STATIONS)+2] = ';';
 		buffer[(4*MOAS_STATIONS)+3] = '\0';
-		moas_callback_write(buffer);
+		callback_write(ctx, buffer);
 	}
 	else {
-		if (command_buffer[1] == 'I') {
+		if (cmd[1] == 'I') {
 			buffer[0] = '"';
 			buffer[1] = 'I';
 			j = 2;
 
 			for (i=0; i<MOAS_STATIONS; i++) {
-				if (inhibit_polarity[i]) {
+				if (ctx->inhibit_polarity[i]) {
 					buffer[j++] = sixbit[i];
 				}
 			}
 			buffer[j++] = ';';
 			buffer[j++] = '\0';
-			moas_callback_write(buffer);
+			callback_write(ctx, buffer);
 		}
 		else {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 		}
 	}
 }
 
 static void
-command_system()
+command_system(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process an antenna system command
 //----------------------------------------------------------------------
@@ -918,33 +2684,37 @@ command_system()
 	int system;
 	int i;
 
-	switch (command_buffer[1]) {
+	switch (cmd[1]) {
 	case '0':
 		for (i=0; i<MOAS_ANTENNAS; i++) {
-			antenna_system_table[i] = 0;
+			ctx->antenna_system_table[i] = 0;
 		}
 		break;
 
 	case 'S':
-		for (i=2; command_buffer[i] != ';'; i+=2) {
-			antenna = sixtodigit(command_buffer[i]);
-			if (command_buffer[i+1] == ';') {
-				moas_callback_write("?A;");
+		for (i=2; cmd[i] != ';'; i+=2) {
+			antenna = sixtodigit(cmd[i]);
+			if (cmd[i+1] == ';') {
+				callback_write(ctx, "?A;");
+				break;
+			}
+			system = sixtodigit(cmd[i+1]);
+			if ((antenna | system) & SIXBIT_INVALID) {
+				callback_write(ctx, "?A;");
 				break;
 			}
-			system = sixtodigit(command_buffer[i+1]);
-			antenna_system_table[antenna] = system;
+			ctx->antenna_system_table[antenna] = system;
 		}
 		break;
 
 	default:
-		moas_callback_write("?A;");
+		callback_write(ctx, "?A;");
 		break;
 	}
 }
 
 static void
-command_uninhibit()
+command_uninhibit(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process an uninhibit command
 //----------------------------------------------------------------------
@@ -952,20 +2722,21 @@ command_uninhibit()
 	int i;
 	int station;
 
-	for (i=1; command_buffer[i] != ';'; i++) {
-		station = command_buffer[i] - '1';
+	for (i=1; cmd[i] != ';'; i++) {
+		station = cmd[i] - '1';
 		if ((station < 0) || (station >= MOAS_STATIONS)) {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			return;
 		}
-		command_inhibits &= ~(1<<station);
+		ctx->command_inhibits &= ~(1<<station);
+		ctx->dirty_inputs = TRUE;
 	}
 
-	do_pins();
+	do_pins(ctx);
 }
 
 static void
-command_unit_id()
+command_unit_id(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a unit ID command
 //----------------------------------------------------------------------
@@ -974,26 +2745,26 @@ command_unit_id()
 	int i;
 
 	// If a unit ID was supplied set it
-	if (command_buffer[1] != ';') {
-		if ((command_buffer[1] < '0') || (command_buffer[1] > '9')) {
-			moas_callback_write("?A;");
+	if (cmd[1] != ';') {
+		if ((cmd[1] < '0') || (cmd[1] > '9')) {
+			callback_write(ctx, "?A;");
 			return;
 		}
-		i = command_buffer[1] - '0';
+		i = cmd[1] - '0';
 	
-		if (command_buffer[2] != ';') {
-			if ((command_buffer[1] < '0') || (command_buffer[1] > '9')) {
-				moas_callback_write("?A;");
+		if (cmd[2] != ';') {
+			if ((cmd[2] < '0') || (cmd[2] > '9')) {
+				callback_write(ctx, "?A;");
 				return;
 			}
-			i = (i * 10) + command_buffer[2] - '0';
+			i = (i * 10) + cmd[2] - '0';
 
-			if (command_buffer[3] != ';') {
-				moas_callback_write("?A;");
+			if (cmd[3] != ';') {
+				callback_write(ctx, "?A;");
 				return;
 			}
 		}
-		unit_id = i;
+		ctx->unit_id = i;
 	}
 
 	buffer[0] = ':';
@@ -1001,23 +2772,23 @@ command_unit_id()
 	buffer[2] = (VER_MINOR / 10) + '0';
 	buffer[3] = (VER_MINOR % 10) + '0';
 
-	if (unit_id > 9) {
-		buffer[4] = (unit_id / 10) + '0';
-		buffer[5] = (unit_id % 10) + '0';
+	if (ctx->unit_id > 9) {
+		buffer[4] = (ctx->unit_id / 10) + '0';
+		buffer[5] = (ctx->unit_id % 10) + '0';
 		buffer[6] = ';';
 		buffer[7] = '\0';
 	}
 	else {
-		buffer[4] = unit_id + '0';
+		buffer[4] = ctx->unit_id + '0';
 		buffer[5] = ';';
 		buffer[6] = '\0';
 	}
 
-	moas_callback_write(buffer);
+	callback_write(ctx, buffer);
 }
 
 static void
-command_use_alternate_antenna()
+command_use_alternate_antenna(moas_ctx *ctx, const char *cmd)
 //----------------------------------------------------------------------
 // Process a use alternate antenna command
 //----------------------------------------------------------------------
@@ -1026,183 +2797,473 @@ command_use_alternate_antenna()
 	int station;
 	int other;
 
-	if (command_buffer[1] == ';') {
-		moas_callback_write("?A;");
+	if (cmd[1] == ';') {
+		callback_write(ctx, "?A;");
 		return;
 	}
-	station = command_buffer[1] - '1';
+	station = cmd[1] - '1';
 	if ((station < 0) || (station >= MOAS_STATIONS)) {
-		moas_callback_write("?A;");
+		callback_write(ctx, "?A;");
 		return;
 	}
 
 
-	alternates[station] = 0;
+	ctx->alternates[station] = 0;
+	ctx->dirty_inputs = TRUE;
 
 
-	for (i=2; command_buffer[i] != ';'; i++) {
-		other = command_buffer[i] - '1';
+	for (i=2; cmd[i] != ';'; i++) {
+		other = cmd[i] - '1';
 		if ((other < 0) || (other >= MOAS_STATIONS)) {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			return;
 		}
 		if (other == station) {
-			moas_callback_write("?A;");
+			callback_write(ctx, "?A;");
 			return;
 		}
-		alternates[station] |= 1<<other;
+		ctx->alternates[station] |= 1<<other;
 	}
 }
 
-static void
-command_vendor_extension()
+static char *
+put_number(char *p, uint64_t n)
 //----------------------------------------------------------------------
-// Process a vendor extension command
+// Add a number as VENDOR_DIGITS sixbit digits, most significant first.
+// Numbers too large for them give the largest.  Returns the end.
 //----------------------------------------------------------------------
 {
+	int i;
+
+	if (n >> (6 * VENDOR_DIGITS)) {
+		n = ((uint64_t)1 << (6 * VENDOR_DIGITS)) - 1;
+	}
+	for (i=VENDOR_DIGITS-1; i>=0; i--) {
+		*p++ = sixbit[(n >> (6 * i)) & 63];
+	}
+	return p;
 }
 
-void moas_character(char c)
+static char *
+put_pending_ages(moas_ctx *ctx, char *p, char kind, int pending,
+	const uint64_t *requested)
 //----------------------------------------------------------------------
-// Handle a character received from the "serial port"
+// Add the age of each station's antenna change which has not been made
 //----------------------------------------------------------------------
 {
-	// Ignore characters less than a space.  This includes CR and
-	// LF which makes it easier to send commands from a terminal.
-	if (c < ' ') {
-		return;
+	uint64_t now = wheel_time(ctx);
+	int stn;
+
+	for (stn=0; stn<MOAS_STATIONS; stn++) {
+		if (pending & (1<<stn)) {
+			*p++ = (char)('1' + stn);
+			*p++ = kind;
+			p = put_number(p, (now - requested[stn]) / 1000);
+		}
 	}
+	return p;
+}
 
-	// The dollar sign erases the current command.
-	if (c == '$') {
-		command_buffer_in = 0;
+static void
+command_vendor_extension(moas_ctx *ctx, const char *cmd)
+//----------------------------------------------------------------------
+// Process a vendor extension command.  These batch antenna commands
+// and report how the switch is doing.
+//
+//    #B;   Begin a batch.  Antenna commands until it ends are kept
+//          apart and only become pending changes, resolved together,
+//          when it ends.  Transmit/receive changes and timers in the
+//          batch only resolve the changes from before it.
+//    #E;   End a batch
+//
+// Every number in a reply is VENDOR_DIGITS sixbit digits and times are
+// in milliseconds on the switch's timing wheel.
+//
+//    #U;   #Utttttt;   Time since the switch was given its wheel
+//    #P;   #P{sKaaaaaa};  Each station s with a transmit (K=T) or
+//                      receive (K=R) antenna change which has not been
+//                      made, and the time since it was asked for
+//    #Q;   #Qddddddmmmmmmxxxxxx;  Messages in the owner's output queue,
+//                      the most it has held and the messages it
+//                      dropped, as reported with moas_output_queue_ctx
+//
+// A switch without a wheel gives every time as 0.  These need a switch
+// built with MOAS_STATS and are rejected without it:
+//
+//    #C;   #C{cnnnnnn};  Each command character c seen, except ; and
+//                      DEL, and how many commands started with it
+//    #R;   #Rrrrrrriiiiiimmmmmm;  Conflict resolver runs, the subsets
+//                      of changes they tried, and the most one run
+//                      tried
+//    #Z;   Clear the statistics
+//----------------------------------------------------------------------
+{
+	char buffer[MOAS_STATS_OPCODES*(VENDOR_DIGITS+1)+4];
+	char *p = buffer;
+#if defined(MOAS_STATS)
+	moas_stats *st;
+	int i;
+#endif
+
+	if ((cmd[1] == ';') || (cmd[2] != ';')) {
+		callback_write(ctx, "?A;");
 		return;
 	}
 
-	// Commands end with a semicolon.
-	command_buffer[command_buffer_in++] = c;
-	if (c != ';') {
+	switch (cmd[1]) {
+	case 'B':
+		ctx->batch = TRUE;
+		return;
+
+	case 'E':
+		if (!ctx->batch) {
+			callback_write(ctx, "?A;");
+			return;
+		}
+		commit_batch(ctx);
 		return;
 	}
 
-	command_buffer_in = 0;
+	*p++ = '#';
+	*p++ = cmd[1];
 
-	switch (command_buffer[0]) {
+	switch (cmd[1]) {
+	case 'U':
+		p = put_number(p, (wheel_time(ctx) - ctx->started) / 1000);
+		break;
 
-		// Antenna command
-		case '!':
-			command_antenna();
-			break;
+	case 'P':
+		p = put_pending_ages(ctx, p, 'T', ctx->tx_pending, ctx->tx_requested);
+		p = put_pending_ages(ctx, p, 'R', ctx->rx_pending, ctx->rx_requested);
+		break;
 
-		// Status command
-		case '"':
-			command_status();
-			break;
+	case 'Q':
+		p = put_number(p, ctx->queue_depth);
+		p = put_number(p, ctx->queue_max_depth);
+		p = put_number(p, ctx->queue_dropped);
+		break;
 
-		// Vendor command
-		case '#':
-			command_vendor_extension();
-			break;
+#if defined(MOAS_STATS)
+	case 'C':
+		st = &ctx->stats->stats;
+		for (i=0; i<MOAS_STATS_OPCODES-1; i++) {
+			if (st->commands[i].count && (i != ';' - ' ')) {
+				*p++ = (char)(' ' + i);
+				p = put_number(p, st->commands[i].count);
+			}
+		}
+		break;
 
-		// Conflict command
-		case '%':
-			command_conflict_table();
-			break;
+	case 'R':
+		st = &ctx->stats->stats;
+		p = put_number(p, st->resolver_runs);
+		p = put_number(p, st->resolver_iterations);
+		p = put_number(p, st->resolver_max_iterations);
+		break;
 
-		// Fast command
-		case '&':
-			command_fast_table();
-			break;
+	case 'Z':
+		moas_clear_stats_ctx(ctx);
+		return;
+#endif
 
-		// Ping command
-		case '\'':
-			command_ping();
-			break;
+	default:
+		callback_write(ctx, "?A;");
+		return;
+	}
 
-		// Inhibit command
-		case '(':
-			command_inhibit();
-			break;
+	*p++ = ';';
+	*p = '\0';
+	callback_write(ctx, buffer);
+}
 
-		// Uninhibit command
-		case ')':
-			command_uninhibit();
-			break;
+static void
+command_unknown(moas_ctx *ctx, const char *cmd)
+//----------------------------------------------------------------------
+// Process a command which is not known
+//----------------------------------------------------------------------
+{
+	callback_write(ctx, "?U;");
+}
 
-		// State command
-		case '*':
-			command_set_state();
-			break;
+// This is the routine for each command, indexed by the first character
+// of the command.  The control characters never start a command.
+typedef void (*command_routine)(moas_ctx *ctx, const char *cmd);
+
+static const command_routine command_table[256] = {
+	// 0x00 - 0x1f
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown,                 // space
+	command_antenna,                 // !
+	command_status,                  // "
+	command_vendor_extension,        // #
+	command_unknown,                 // $
+	command_conflict_table,          // %
+	command_fast_table,              // &
+	command_ping,                    // '
+	command_inhibit,                 // (
+	command_uninhibit,               // )
+	command_set_state,               // *
+	command_unknown,                 // +
+	command_unknown,                 // ,
+	command_unknown,                 // -
+	command_unknown,                 // .
+	command_mode,                    // /
+	command_unknown,                 // 0
+	command_unknown,                 // 1
+	command_unknown,                 // 2
+	command_unknown,                 // 3
+	command_unknown,                 // 4
+	command_unknown,                 // 5
+	command_unknown,                 // 6
+	command_unknown,                 // 7
+	command_unknown,                 // 8
+	command_unknown,                 // 9
+	command_unit_id,                 // :
+	command_unknown,                 // ;
+	command_unknown,                 // <
+	command_inhibit_type,            // =
+	command_unknown,                 // >
+	command_unknown,                 // ?
+	command_use_alternate_antenna,   // @
+	command_unknown,                 // A
+	command_unknown,                 // B
+	command_unknown,                 // C
+	command_unknown,                 // D
+	command_unknown,                 // E
+	command_unknown,                 // F
+	command_unknown,                 // G
+	command_unknown,                 // H
+	command_unknown,                 // I
+	command_unknown,                 // J
+	command_unknown,                 // K
+	command_unknown,                 // L
+	command_unknown,                 // M
+	command_unknown,                 // N
+	command_unknown,                 // O
+	command_unknown,                 // P
+	command_unknown,                 // Q
+	command_unknown,                 // R
+	command_unknown,                 // S
+	command_unknown,                 // T
+	command_unknown,                 // U
+	command_unknown,                 // V
+	command_unknown,                 // W
+	command_unknown,                 // X
+	command_unknown,                 // Y
+	command_unknown,                 // Z
+	command_inhibit_time,            // [
+	command_receive_delay,           // backslash
+	command_interrupt_mode_delay,    // ]
+	command_inhibit_polarity,        // ^
+	command_system,                  // _
+	command_unknown,                 // `
+	command_unknown,                 // a
+	command_unknown,                 // b
+	command_unknown,                 // c
+	command_unknown,                 // d
+	command_unknown,                 // e
+	command_unknown,                 // f
+	command_unknown,                 // g
+	command_unknown,                 // h
+	command_unknown,                 // i
+	command_unknown,                 // j
+	command_unknown,                 // k
+	command_unknown,                 // l
+	command_unknown,                 // m
+	command_unknown,                 // n
+	command_unknown,                 // o
+	command_unknown,                 // p
+	command_unknown,                 // q
+	command_unknown,                 // r
+	command_unknown,                 // s
+	command_unknown,                 // t
+	command_unknown,                 // u
+	command_unknown,                 // v
+	command_unknown,                 // w
+	command_unknown,                 // x
+	command_unknown,                 // y
+	command_unknown,                 // z
+	command_unknown,                 // {
+	command_relay_status,            // |
+	command_unknown,                 // }
+	command_inhibit_other_station,   // ~
+	command_unknown,                 // delete
+	// 0x80 - 0xff
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown,
+	command_unknown, command_unknown, command_unknown, command_unknown
+};
 
-		// Mode command
-		case '/':
-			command_mode();
-			break;
+static void
+do_command(moas_ctx *ctx, const char *cmd)
+//----------------------------------------------------------------------
+// Process a complete command.  The command ends with a semicolon and
+// holds no characters less than a space.
+//----------------------------------------------------------------------
+{
+#if defined(MOAS_STATS)
+	uint64_t start;
+
+	if (ctx->stats) {
+		start = stats_clock();
+		command_table[(unsigned char)cmd[0]](ctx, cmd);
+		stats_latency(&ctx->stats->stats.commands[stats_opcode(cmd[0])],
+					  start);
+		return;
+	}
+#endif
+	command_table[(unsigned char)cmd[0]](ctx, cmd);
+}
 
-		// Unit ID command
-		case ':':
-			command_unit_id();
-			break;
+static void
+character(moas_ctx *ctx, char c)
+//----------------------------------------------------------------------
+// Handle a character received from the "serial port"
+//----------------------------------------------------------------------
+{
+	// Ignore characters less than a space.  This includes CR and
+	// LF which makes it easier to send commands from a terminal.
+	if (c < ' ') {
+		return;
+	}
 
-		// Inhibit Type command
-		case '=':
-			command_inhibit_type();
-			break;
+	// The dollar sign erases the current command.
+	if (c == '$') {
+		ctx->command_buffer_in = 0;
+		return;
+	}
 
-		// Alternate command
-		case '@':
-			command_use_alternate_antenna();
-			break;
+	// A command too long for the buffer is thrown away when it ends
+	if (ctx->command_buffer_in >= COMMAND_BUFFER_LEN) {
+		if (c == ';') {
+			ctx->command_buffer_in = 0;
+		}
+		return;
+	}
 
-		// Inhibit time command
-		case '[':
-			command_inhibit_time();
-			break;
+	// Commands end with a semicolon.
+	ctx->command_buffer[ctx->command_buffer_in++] = c;
+	if (c != ';') {
+		return;
+	}
 
-		// RX delay command
-		case '\\':
-			command_receive_delay();
-			break;
+	ctx->command_buffer_in = 0;
 
-		// Force RX time command
-		case ']':
-			command_interrupt_mode_delay();
-			break;
+	do_command(ctx, ctx->command_buffer);
+}
 
-		// Inhibit polarity command
-		case '^':
-			command_inhibit_polarity();
-			break;
+void moas_character_ctx(moas_ctx *ctx, char c)
+//----------------------------------------------------------------------
+// Handle a character and write what it produced
+//----------------------------------------------------------------------
+{
+	character(ctx, c);
+	flush_output(ctx);
+}
 
-		// Antenna system command
-		case '_':
-			command_system();
-			break;
+void moas_feed_ctx(moas_ctx *ctx, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Handle a block of characters received from the "serial port"
+//----------------------------------------------------------------------
+{
+	size_t i;
+	size_t n;
+	char c;
 
-		// Relay status command
-		case '|':
-			command_relay_status();
-			break;
+	while (len > 0) {
 
-		// Inhibit station command
-		case '~':
-			command_inhibit_other_station();
-			break;
+		// Find the end of the next run of ordinary characters
+		for (i=0; i<len; i++) {
+			c = buffer[i];
+			if ((c < ' ') || (c == '$') || (c == ';')) {
+				break;
+			}
+		}
 
-		default:
-			moas_callback_write("?U;");
-			break;
+		// A whole command with nothing before it is processed where
+		// it is without copying it into the command buffer
+		if ((i < len) && (buffer[i] == ';') &&
+			(ctx->command_buffer_in == 0) && (i < COMMAND_BUFFER_LEN)) {
+			do_command(ctx, buffer);
+		}
+		else {
+			// Add the run to the command buffer, dropping anything
+			// past the end of it
+			n = COMMAND_BUFFER_LEN - ctx->command_buffer_in;
+			if (n > i) {
+				n = i;
+			}
+			memcpy(ctx->command_buffer + ctx->command_buffer_in, buffer, n);
+			if (i > n) {
+				ctx->command_buffer_in = COMMAND_BUFFER_LEN;
+			}
+			else {
+				ctx->command_buffer_in += (int)n;
+			}
+
+			// The character ending the run is handled as usual
+			if (i < len) {
+				character(ctx, buffer[i]);
+			}
+		}
+
+		if (i < len) {
+			i++;
+		}
+		buffer += i;
+		len -= i;
 	}
+
+	flush_output(ctx);
 }
 
-void moas_txrx(int station, int state)
+void moas_txrx_ctx(moas_ctx *ctx, int station, int state)
 //----------------------------------------------------------------------
 // Handle a transmit/receive change
 //----------------------------------------------------------------------
 {
 	char buffer[32];
-	int inhibits = command_inhibits;
+	int inhibits = ctx->command_inhibits;
 	int stn;
+#if defined(MOAS_STATS)
+	uint64_t start = ctx->stats ? stats_clock() : 0;
+#endif
 
 	// Internal calculations are zero-based
 	station--;
@@ -1212,144 +3273,515 @@ void moas_txrx(int station, int state)
 		if (inhibits & (1<<stn)) {
 			continue;
 		}
-		if (trbits & (1<<stn)) {
-			inhibits |= cross_inhibits[stn];
+		if (ctx->trbits & (1<<stn)) {
+			inhibits |= ctx->cross_inhibits[stn];
 		}
 	}
 
 	if (state) {
-		trbits |= (1<<station);
-		if (tr_events && (!(inhibits & 1<<station))) {
+		ctx->trbits |= (1<<station);
+		ctx->dirty_inputs = TRUE;
+		if (ctx->tr_events && (!(inhibits & 1<<station))) {
 			buffer[0] = '<';
 			buffer[1] = station + '1';
-			buffer[2] = sixbit[actual_rx_antennas[station]];
+			buffer[2] = sixbit[ctx->actual_rx_antennas[station]];
 			buffer[3] = ';';
 			buffer[4] = '\0';
-			moas_callback_write(buffer);
+			callback_write(ctx, buffer);
 		}
 	}
 	else {
-		trbits &= ~(1<<station);
-		if (tr_events && (!(inhibits & 1<<station))) {
+		ctx->trbits &= ~(1<<station);
+		ctx->dirty_inputs = TRUE;
+		if (ctx->tr_events && (!(inhibits & 1<<station))) {
 			buffer[0] = '>';
 			buffer[1] = station + '1';
-			buffer[2] = sixbit[actual_rx_antennas[station]];
+			buffer[2] = sixbit[ctx->actual_rx_antennas[station]];
 			buffer[3] = ';';
 			buffer[4] = '\0';
-			moas_callback_write(buffer);
+			callback_write(ctx, buffer);
 		}
 	}
 
-	do_resolver();
+	do_resolver(ctx);
+
+#if defined(MOAS_STATS)
+	if (ctx->stats) {
+		stats_latency(&ctx->stats->stats.txrx, start);
+	}
+#endif
+	flush_output(ctx);
+}
+
+static void
+update_receive_holds(moas_ctx *ctx, int tr_temp)
+//----------------------------------------------------------------------
+// Keep stations which stop transmitting on their transmit relays for
+// their receive delay.  A station which transmits again no longer
+// waits.
+//----------------------------------------------------------------------
+{
+	int stopped;
+	int stn;
+
+	if (!ctx->wheel) {
+		return;
+	}
+
+	for (stn=0; stn<MOAS_STATIONS; stn++) {
+		if (ctx->receive_holds & tr_temp & (1<<stn)) {
+			moas_timer_stop(&ctx->receive_timers[stn]);
+		}
+	}
+	ctx->receive_holds &= ~tr_temp;
+
+	stopped = ctx->pin_transmitting & ~tr_temp & ~ctx->receive_holds;
+	for (stn=0; stopped; stn++) {
+		if ((stopped & (1<<stn)) && ctx->receive_delay[stn]) {
+			ctx->receive_holds |= 1<<stn;
+			start_timer(ctx, &ctx->receive_timers[stn],
+						&ctx->receive_due[stn], ctx->receive_delay[stn]);
+		}
+		stopped &= ~(1<<stn);
+	}
+}
+
+static void
+start_settling(moas_ctx *ctx, int moved)
+//----------------------------------------------------------------------
+// Inhibit stations whose relays moved until their inhibit time ends
+//----------------------------------------------------------------------
+{
+	int stn;
+
+	for (stn=0; moved; stn++) {
+		if ((moved & (1<<stn)) && ctx->inhibit_time[stn]) {
+			ctx->settle_inhibits |= 1<<stn;
+			start_timer(ctx, &ctx->settle_timers[stn],
+						&ctx->settle_due[stn], ctx->inhibit_time[stn]);
+		}
+		moved &= ~(1<<stn);
+	}
+}
+
+static int
+interrupt_delayed(moas_ctx *ctx, int stn)
+//----------------------------------------------------------------------
+// TRUE if a station's transmit antenna change must wait for its
+// interrupt mode delay.  The delay starts the first time this is asked.
+//----------------------------------------------------------------------
+{
+	if (!ctx->wheel || !ctx->interrupt_delay[stn] ||
+		(ctx->interrupt_ready & (1<<stn))) {
+		return FALSE;
+	}
+
+	if (!(ctx->interrupt_waits & (1<<stn))) {
+		ctx->interrupt_waits |= 1<<stn;
+		start_timer(ctx, &ctx->interrupt_timers[stn],
+					&ctx->interrupt_due[stn], ctx->interrupt_delay[stn]);
+	}
+	return TRUE;
 }
 
-static void do_pins()
+static void do_pins(moas_ctx *ctx)
 //----------------------------------------------------------------------
 // Update outputs due to a possible state change
 //----------------------------------------------------------------------
 {
-	int inhibits = command_inhibits;
+	int inhibits;
 	int temp_inhibits[MOAS_STATIONS];
 	int tr_temp;
+	int started;
 
 	int alts;
 
+	relay_mask relays;
+	relay_mask changed;
+	relay_mask old;
+	int moved;
+
 	int stn;
 	int i;
 
-	if (!operate) {
-		// If not in operate mode show all stations as inhibited
+	if (!ctx->operate) {
+		// If not in operate mode show all stations as inhibited.
+		// Everything is worked out again when it is.
 		for (i=0; i<MOAS_STATIONS; i++) {
 			temp_inhibits[i] = TRUE;
 		}
+		ctx->dirty_inputs = TRUE;
+		ctx->dirty_stations = ALL_STATIONS;
 
-		moas_callback_update(actual_relays, temp_inhibits);
+		callback_update(ctx, ctx->output_relays, ALL_STATIONS,
+						ctx->output_relay_array, temp_inhibits);
 		return;
 	}
 
-	// Figure out which stations are inhibited
-	for (stn=0; stn<MOAS_STATIONS; stn++) {
-		if (inhibits & (1<<stn)) {
-			continue;
-		}
-		if (trbits & (1<<stn)) {
-			inhibits |= cross_inhibits[stn];
+	// Set or reset relays as needed due to stations starting
+	// to transmit
+	started = ctx->trbits & ~ctx->tr_last;
+	for (stn=0; started; stn++) {
+		if (started & (1<<stn)) {
+			ctx->sr_relays = (ctx->sr_relays | ctx->set_relays[stn]) & ~ctx->reset_relays[stn];
+			started &= ~(1<<stn);
 		}
 	}
 
-	// Set or reset relays as needed due to stations starting
-	// to transmit
-	for (stn=0; stn<MOAS_STATIONS; stn++) {
-		if ((trbits & (1<<stn)) && !(tr_last & (1<<stn))) {
-			for (i=0; i<MOAS_RELAYS; i++) {
-				if (set_relays[i][stn]) {
-					sr_relays[i] = TRUE;
-				}
-				if (reset_relays[i][stn]) {
-					sr_relays[i] = FALSE;
-				}
+	// The inhibits and which relays each station uses only
+	// change when the transmit state or the inhibit and
+	// alternate settings change.
+	if (ctx->dirty_inputs) {
+		// Figure out which stations are inhibited
+		inhibits = ctx->command_inhibits;
+		for (stn=0; stn<MOAS_STATIONS; stn++) {
+			if (inhibits & (1<<stn)) {
+				continue;
+			}
+			if (ctx->trbits & (1<<stn)) {
+				inhibits |= ctx->cross_inhibits[stn];
 			}
 		}
-	}
 
-	// Stations which are transmitting are not inhibited
-	tr_temp = trbits & (~inhibits);
+		// Stations which are transmitting are not inhibited
+		tr_temp = ctx->trbits & (~inhibits);
+
+		// Stations in their receive delay stay on their transmit
+		// relays
+		update_receive_holds(ctx, tr_temp);
+
+		// Adjust inhibits based on inhibit only on transmit
+		for (stn = 0; stn < MOAS_STATIONS; stn++) {
+			if (ctx->inhibit_type[stn] && (ctx->trbits & (1 << stn))) {
+				inhibits &= (~(1 << stn));
+			}
+		}
 
-	// Adjust inhibits based on inhibit only on transmit
-	for (stn = 0; stn < MOAS_STATIONS; stn++) {
-		if (inhibit_type[stn] && (trbits & (1 << stn))) {
-			inhibits &= (~(1 << stn));
+		// Figure out which stations need alternates
+		alts = 0;
+		for (stn=0; stn<MOAS_STATIONS; stn++) {
+			if (tr_temp & (1<<stn)) {
+				alts |= ctx->alternates[stn];
+			}
 		}
+
+		// Stations which changed between their transmit, alternate
+		// and receive relays need their relays worked out again
+		tr_temp |= ctx->receive_holds;
+		ctx->dirty_stations |= (tr_temp ^ ctx->pin_transmitting) |
+							   (alts ^ ctx->pin_alternates);
+
+		ctx->pin_inhibits = inhibits;
+		ctx->pin_transmitting = tr_temp;
+		ctx->pin_alternates = alts;
+		ctx->dirty_inputs = FALSE;
 	}
 
-	// Figure out which stations need alternates
-	alts = 0;
-	for (stn=0; stn<MOAS_STATIONS; stn++) {
-		if (tr_temp & (1<<stn)) {
-			alts |= alternates[stn];
+	// Set the relays for each station which changed
+	moved = 0;
+	for (stn=0; ctx->dirty_stations; stn++) {
+		if (!(ctx->dirty_stations & (1<<stn))) {
+			continue;
+		}
+		old = ctx->station_relays[stn];
+		if (ctx->pin_transmitting & (1<<stn)) {
+			ctx->station_relays[stn] = ctx->actual_tx_relays[stn];
+		}
+		else {
+			if (ctx->pin_alternates & (1<<stn)) {
+				// Load the alternate antenna if it has no conflict.
+				// Otherwise load no relays.
+				ctx->station_relays[stn] = ctx->actual_alternate_relays[stn];
+			}
+			else {
+				ctx->station_relays[stn] = ctx->actual_rx_relays[stn];
+			}
 		}
+		if (ctx->station_relays[stn] != old) {
+			moved |= 1<<stn;
+		}
+		ctx->dirty_stations &= ~(1<<stn);
 	}
 
-	// Set the global relays and set/reset relays
-	for (i=0; i<MOAS_RELAYS; i++) {
-		actual_relays[i] = global_relays[i] || sr_relays[i];
+	// Stations are inhibited while their relays settle and while an
+	// antenna change waits for them to stop transmitting
+	if (moved && ctx->wheel) {
+		start_settling(ctx, moved);
 	}
+	inhibits = ctx->pin_inhibits | ctx->settle_inhibits |
+			   ctx->interrupt_inhibits;
 
-	// Set the relays for each station
+	// Combine the global relays, set/reset relays and the relays
+	// for each station
+	relays = ctx->global_relays | ctx->sr_relays;
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
-		if (tr_temp & (1<<stn)) {
-			for (i=0; i<MOAS_RELAYS; i++) {
-				actual_relays[i] = actual_relays[i] || actual_tx_relays[i][stn];
-			}
+		relays |= ctx->station_relays[stn];
+	}
+	ctx->actual_relays = relays;
+
+	// Bring the expanded relays up to date
+	changed = ctx->output_relays ^ relays;
+	while (changed) {
+		i = lowest_relay(changed);
+		ctx->output_relay_array[i] = ((relays & RELAY(i)) != 0);
+		changed &= changed - 1;
+	}
+	ctx->output_relays = relays;
+
+	// Bring the expanded inhibits up to date
+	if (ctx->output_inhibits != inhibits) {
+		for (i=0; i<MOAS_STATIONS; i++) {
+			ctx->actual_inhibits[i] = ((inhibits & (1<<i)) != 0);
+		}
+		ctx->output_inhibits = inhibits;
+	}
+
+	// Give the emulator the current information
+	callback_update(ctx, relays, inhibits,
+					ctx->output_relay_array, ctx->actual_inhibits);
+
+	ctx->tr_last = ctx->trbits;
+}
+
+static void
+set_station_relays(moas_ctx *ctx, relay_mask *relay_set, int stn, relay_mask relays)
+//----------------------------------------------------------------------
+// Change one of a station's relay sets and remember that the station's
+// share of the actual relays must be worked out again
+//----------------------------------------------------------------------
+{
+	if (relay_set[stn] != relays) {
+		relay_set[stn] = relays;
+		ctx->dirty_stations |= 1<<stn;
+	}
+}
+
+static antenna_mask
+occupied_antennas(moas_ctx *ctx, int station, int attempt_tx_pending, int attempt_rx_pending)
+//----------------------------------------------------------------------
+// Return the antennas used by every station except one.  A station
+// uses its pending antennas if they are part of the attempt and its
+// current antennas otherwise.
+//----------------------------------------------------------------------
+{
+	antenna_mask occupied = 0;
+	int i;
+
+	for (i=0; i<MOAS_STATIONS; i++) {
+		if (i == station) {
+			continue;
+		}
+
+		if (attempt_tx_pending & (1<<i)) {
+			occupied |= ANTENNA(ctx->pending_tx_antennas[i]);
 		}
 		else {
-			if (alts & (1<<stn)) {
-				// Load the alternate antenna if it has no conflict.
-				// Otherwise load no relays.
-				for (i=0; i<MOAS_RELAYS; i++) {
-					actual_relays[i] = actual_relays[i] || actual_alternate_relays[i][stn];
+			occupied |= ANTENNA(ctx->current_tx_antennas[i]);
+		}
+
+		if (attempt_rx_pending & (1<<i)) {
+			occupied |= ANTENNA(ctx->pending_rx_antennas[i]);
+		}
+		else {
+			occupied |= ANTENNA(ctx->current_rx_antennas[i]);
+		}
+	}
+	return occupied;
+}
+
+// This is the pairwise conflict graph among the pending antenna
+// changes of one kind (transmit or receive).  It is built once per
+// resolver run and answers whether a station's change conflicts
+// when some set of the changes is made.
+typedef struct change_graph {
+	// The stations with a pending change
+	int candidates;
+
+	// Candidates which conflict no matter which changes are made
+	int fixed;
+
+	// For each candidate, the other candidates which conflict with it
+	// if they change and the ones which conflict if they do not change
+	int if_changed[MOAS_STATIONS];
+	int if_unchanged[MOAS_STATIONS];
+
+#if defined(MOAS_STATS)
+	// Subsets tried by search_changes
+	int iterations;
+#endif
+} change_graph;
+
+static void
+build_change_graph(moas_ctx *ctx, change_graph *graph, int candidates,
+	const int *pending, const int *current,
+	const int *other_pending, const int *other_current, int other_attempt)
+//----------------------------------------------------------------------
+// Work out which pending changes conflict with each other and with
+// the antennas which cannot change.  The other antennas are the
+// receive antennas when transmit changes are checked and the other
+// way around.  The other antenna is pending if its station is in
+// the other attempt and current otherwise.
+//----------------------------------------------------------------------
+{
+	antenna_mask row;
+	antenna_mask other;
+	int stn;
+	int i;
+
+	graph->candidates = candidates;
+	graph->fixed = 0;
+
+	for (stn=0; stn<MOAS_STATIONS; stn++) {
+		graph->if_changed[stn] = 0;
+		graph->if_unchanged[stn] = 0;
+
+		if (!(candidates & (1<<stn))) {
+			continue;
+		}
+
+		row = ctx->conflicts_table[pending[stn]];
+
+		for (i=0; i<MOAS_STATIONS; i++) {
+			if (i == stn) {
+				continue;
+			}
+
+			if (other_attempt & (1<<i)) {
+				other = ANTENNA(other_pending[i]);
+			}
+			else {
+				other = ANTENNA(other_current[i]);
+			}
+			if (row & other) {
+				graph->fixed |= 1<<stn;
+			}
+
+			if (candidates & (1<<i)) {
+				if (row & ANTENNA(pending[i])) {
+					graph->if_changed[stn] |= 1<<i;
+				}
+				if (row & ANTENNA(current[i])) {
+					graph->if_unchanged[stn] |= 1<<i;
 				}
 			}
 			else {
-				for (i=0; i<MOAS_RELAYS; i++) {
-					actual_relays[i] = actual_relays[i] || actual_rx_relays[i][stn];
+				if (row & ANTENNA(current[i])) {
+					graph->fixed |= 1<<stn;
 				}
 			}
 		}
 	}
+}
 
-	// Set up inhibits for the callback
-	for (i=0; i<MOAS_STATIONS; i++) {
-		temp_inhibits[i] = ((inhibits & (1<<i)) != 0);
+static int
+has_conflict(const change_graph *graph, int stn, int attempt)
+//----------------------------------------------------------------------
+// TRUE if a station's change conflicts when the attempt is made
+//----------------------------------------------------------------------
+{
+	return ((graph->fixed & (1<<stn)) ||
+			(graph->if_changed[stn] & attempt) ||
+			(graph->if_unchanged[stn] & graph->candidates & ~attempt));
+}
+
+static int
+search_changes(change_graph *graph, int stn, int changed,
+	int unchanged, int forbid_change, int forbid_keep)
+//----------------------------------------------------------------------
+// Find the numerically largest set of candidates with no conflicts.
+//
+// This picks the same set as trying every subset in decreasing order,
+// which is what the actual switch does, but it decides one station at
+// a time from the highest down and tries changing it before keeping
+// it.  A choice which conflicts with the choices already made is not
+// followed, which skips every subset containing that pair.
+//
+// forbid_change holds the stations which would conflict with the
+// changes already chosen if they changed, and forbid_keep the ones
+// which would conflict if they did not.
+//----------------------------------------------------------------------
+{
+	int result;
+
+#if defined(MOAS_STATS)
+	graph->iterations++;
+#endif
+
+	// Skip stations which have nothing pending
+	while ((stn >= 0) && !(graph->candidates & (1<<stn))) {
+		stn--;
+	}
+	if (stn < 0) {
+		return changed;
 	}
 
-	// Give the emulator the current information
-	moas_callback_update(actual_relays, temp_inhibits);
+	// Try making the change
+	if (!(graph->fixed & (1<<stn)) &&
+		!(graph->if_changed[stn] & changed) &&
+		!(graph->if_unchanged[stn] & unchanged) &&
+		!(forbid_change & (1<<stn))) {
+		result = search_changes(graph, stn-1,
+								changed | (1<<stn), unchanged,
+								forbid_change | graph->if_changed[stn],
+								forbid_keep | graph->if_unchanged[stn]);
+		if (result >= 0) {
+			return result;
+		}
+	}
+
+	// Try leaving it pending
+	if (!(forbid_keep & (1<<stn))) {
+		return search_changes(graph, stn-1, changed, unchanged | (1<<stn),
+							  forbid_change, forbid_keep);
+	}
+
+	return -1;
+}
+
+static void
+report_conflicts(moas_ctx *ctx, const change_graph *graph, int accepted,
+	char kind, const int *pending, int *conflict_sent)
+//----------------------------------------------------------------------
+// Send the conflict events which trying each subset in turn would
+// have sent.  Each station only sends one until its change is made,
+// so this only walks the subsets while some station has not sent one.
+//----------------------------------------------------------------------
+{
+	char buffer[8];
+	int attempt = graph->candidates;
+	int unsent = 0;
+	int stn;
+
+	if (!ctx->antenna_events) {
+		return;
+	}
 
-	tr_last = trbits;
+	for (stn=0; stn<MOAS_STATIONS; stn++) {
+		if (!conflict_sent[stn]) {
+			unsent |= 1<<stn;
+		}
+	}
+
+	while ((attempt != accepted) && (graph->candidates & unsent)) {
+		for (stn=0; stn<MOAS_STATIONS; stn++) {
+			if ((attempt & unsent & (1<<stn)) &&
+				has_conflict(graph, stn, attempt)) {
+				buffer[0] = '!';
+				buffer[1] = stn + '1';
+				buffer[2] = kind;
+				buffer[3] = sixbit[pending[stn]];
+				buffer[4] = ';';
+				buffer[5] = '\0';
+				callback_write(ctx, buffer);
+				conflict_sent[stn] = TRUE;
+				unsent &= ~(1<<stn);
+			}
+		}
+		attempt = (attempt - 1) & graph->candidates;
+	}
 }
 
-static void do_resolver()
+static void do_resolver(moas_ctx *ctx)
 //----------------------------------------------------------------------
 // Run the conflict resolver and update antennas
 //----------------------------------------------------------------------
@@ -1357,56 +3789,62 @@ static void do_resolver()
 	char buffer[32];
 	int stn;
 	int dependencies;
-	int temp_tx_pending = tx_pending;
-	int temp_rx_pending = rx_pending;
+	int temp_tx_pending = ctx->tx_pending;
+	int temp_rx_pending = ctx->rx_pending;
 	int attempt_tx_pending;
 	int attempt_rx_pending;
 	int alts;
 
 	int alt_conflicts;
-	int has_conflicts;
+	change_graph graph;
 
 	int inhibits;
 	int tr_temp;
+	int busy;
+	int forced;
 
 	int i;
 
 
 
-	if (!operate) {
-		do_pins();
+	if (!ctx->operate) {
+		do_pins(ctx);
 		return;
 	}
 
 	// Figure out which stations are inhibited
-	inhibits = command_inhibits;
+	inhibits = ctx->command_inhibits;
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
 		if (inhibits & (1<<stn)) {
 			continue;
 		}
-		if (trbits & (1<<stn)) {
-			inhibits |= cross_inhibits[stn];
+		if (ctx->trbits & (1<<stn)) {
+			inhibits |= ctx->cross_inhibits[stn];
 		}
 	}
-	tr_temp = trbits & ~inhibits;
+	tr_temp = ctx->trbits & ~inhibits;
+
+	// Stations in their receive delay are still on their transmit
+	// relays so they hold up changes like transmitting stations
+	update_receive_holds(ctx, tr_temp);
+	busy = tr_temp | ctx->receive_holds;
 
 	// Handle pending extra relays.  The station must
 	// be in receive state to transfer them.
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
-		if ((extra_pending & (1<<stn)) && !(tr_temp & (1<<stn))) {
-			for (i=0; i<MOAS_RELAYS; i++) {
-				current_extra_relays[i][stn] = pending_extra_relays[i][stn];
-				actual_tx_relays[i][stn] = current_tx_relays[i][stn] || current_extra_relays[i][stn];
-			}
-			if (extra_relay_events) {
+		if ((ctx->extra_pending & (1<<stn)) && !(busy & (1<<stn))) {
+			ctx->current_extra_relays[stn] = ctx->pending_extra_relays[stn];
+			set_station_relays(ctx, ctx->actual_tx_relays, stn,
+							   ctx->current_tx_relays[stn] | ctx->current_extra_relays[stn]);
+			if (ctx->extra_relay_events) {
 				buffer[0] = '!';
 				buffer[1] = stn + '1';
 				buffer[2] = 'X';
 				buffer[3] = ';';
 				buffer[4] = '\0';
-				moas_callback_write(buffer);
+				callback_write(ctx, buffer);
 			}
-			extra_pending &= ~(1<<stn);
+			ctx->extra_pending &= ~(1<<stn);
 		}
 	}
 
@@ -1415,19 +3853,20 @@ static void do_resolver()
 	alt_conflicts = 0;
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
 		if (tr_temp & (1<<stn)) {
-			alts |= alternates[stn];
+			alts |= ctx->alternates[stn];
 		}
 	}
 
 	// Check for pending transmit antenna changes
+	forced = 0;
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
-		if (tx_pending & (1<<stn)) {
+		if (ctx->tx_pending & (1<<stn)) {
 
 			// Station has a pending antenna.  Check to see
 			// if it is part of a shared system and find out
 			// what other stations are using the system.
-			int ant = pending_tx_antennas[stn];
-			int sys = antenna_system_table[ant];
+			int ant = ctx->pending_tx_antennas[stn];
+			int sys = ctx->antenna_system_table[ant];
 			if (sys) {
 				dependencies = 0;
 				for (i=0; i<MOAS_STATIONS; i++) {
@@ -1436,9 +3875,9 @@ static void do_resolver()
 					// This takes care of the case where a station is
 					// changing to or from an antenna which is not part
 					// of the system.
-					if ((tx_pending & (1<<i)) &&
-						((sys == antenna_system_table[pending_tx_antennas[i]]) ||
-						 (sys == antenna_system_table[current_tx_antennas[i]]))) {
+					if ((ctx->tx_pending & (1<<i)) &&
+						((sys == ctx->antenna_system_table[ctx->pending_tx_antennas[i]]) ||
+						 (sys == ctx->antenna_system_table[ctx->current_tx_antennas[i]]))) {
 						dependencies |= (1<<i);
 					}
 				}
@@ -1450,26 +3889,35 @@ static void do_resolver()
 			// Stations which are in inhibit mode can be in transmit
 			// because they can be forced into receive.  So if all
 			// dependencies are in inhibit mode it can be done.
-			if (dependencies & wait_mode) {
+			if (dependencies & ctx->wait_mode) {
 
 				// If the station is transmitting in wait mode it cannot
 				// be changed now.
-				if (tr_temp & dependencies) {
+				if (busy & dependencies) {
 					temp_tx_pending &= ~(1<<stn);
 				}
 			}
+			else if ((busy & dependencies) && interrupt_delayed(ctx, stn)) {
+
+				// The stations are inhibited first and the change
+				// waits for the interrupt mode delay so they have
+				// stopped transmitting when the relays move.
+				temp_tx_pending &= ~(1<<stn);
+				forced |= busy & dependencies;
+			}
 		}
 	}
+	ctx->interrupt_inhibits = forced;
 
 	// Check for pending receive antenna changes
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
-		if (rx_pending & (1<<stn)) {
+		if (ctx->rx_pending & (1<<stn)) {
 
 			// Station has a pending antenna.  Check to see
 			// if it is part of a shared system and find out
 			// what other stations are using the system.
-			int ant = pending_rx_antennas[stn];
-			int sys = antenna_system_table[ant];
+			int ant = ctx->pending_rx_antennas[stn];
+			int sys = ctx->antenna_system_table[ant];
 
 			// Normally a receive antenna can be changed any time
 			// because if the station is transmitting the change will
@@ -1485,9 +3933,9 @@ static void do_resolver()
 					// This takes care of the case where a station is
 					// changing to or from an antenna which is not part
 					// of the system.
-					if ((tx_pending & (1<<i)) &&
-						((sys == antenna_system_table[pending_tx_antennas[i]]) ||
-						 (sys == antenna_system_table[current_tx_antennas[i]]))) {
+					if ((ctx->tx_pending & (1<<i)) &&
+						((sys == ctx->antenna_system_table[ctx->pending_tx_antennas[i]]) ||
+						 (sys == ctx->antenna_system_table[ctx->current_tx_antennas[i]]))) {
 						dependencies |= (1<<i);
 					}
 				}
@@ -1495,11 +3943,11 @@ static void do_resolver()
 				// Stations which are in inhibit mode can be in transmit
 				// because they can be forced into receive.  So if all
 				// dependencies are in inhibit mode it can be done.
-				if (dependencies & wait_mode) {
+				if (dependencies & ctx->wait_mode) {
 
 					// If the station is transmitting in wait mode it cannot
 					// be changed now.
-					if (tr_temp & dependencies) {
+					if (busy & dependencies) {
 						temp_rx_pending &= ~(1<<stn);
 					}
 				}
@@ -1507,169 +3955,56 @@ static void do_resolver()
 		}
 	}
 
-	// Check for conflicts with pending transmit antenna changes
-	attempt_tx_pending = temp_tx_pending;
-	attempt_rx_pending = temp_rx_pending;
-
-	while (attempt_tx_pending) {
-		has_conflicts = FALSE;
-
-		for (stn=0; stn<MOAS_STATIONS; stn++) {
-			if (attempt_tx_pending & (1<<stn)) {
-				int ant = pending_tx_antennas[stn];
-
-				// Check for conflicts with other antennas
-				for (i=0; i<MOAS_STATIONS; i++) {
-					int other_tx;
-					int other_rx;
-
-					if (i == stn) {
-						continue;
-					}
-
-					if (attempt_tx_pending & (1<<i)) {
-						other_tx = pending_tx_antennas[i];
-					}
-					else {
-						other_tx = current_tx_antennas[i];
-					}
-
-					if (attempt_rx_pending & (1<<i)) {
-						other_rx = pending_rx_antennas[i];
-					}
-					else {
-						other_rx = current_rx_antennas[i];
-					}
-
-					if ((conflicts_table[ant][other_tx]) ||
-						(conflicts_table[ant][other_rx])) {
-						has_conflicts = TRUE;
-						if (antenna_events && !conflict_sent_tx[stn]) {
-							buffer[0] = '!';
-							buffer[1] = stn + '1';
-							buffer[2] = 'C';
-							buffer[3] = sixbit[pending_tx_antennas[stn]];
-							buffer[4] = ';';
-							buffer[5] = '\0';
-							moas_callback_write(buffer);
-							conflict_sent_tx[stn] = TRUE;
-						}
-						break;
-					}
-				}
-			}
-		}
-		if (!has_conflicts) {
-			break;
-		}
-		
-		// This algorithm tries all combinations of antennas.
-		// And it tries each exactly once.
-		attempt_tx_pending = (attempt_tx_pending - 1) & temp_tx_pending;
-	}
-
-	// Check for conflicts with pending receive antenna changes
-	while (attempt_rx_pending) {
-		has_conflicts = FALSE;
-
-		for (stn=0; stn<MOAS_STATIONS; stn++) {
-			if (attempt_rx_pending & (1<<stn)) {
-				int ant = pending_rx_antennas[stn];
-
-				// Check for conflicts with other antennas
-				for (i=0; i<MOAS_STATIONS; i++) {
-					int other_tx;
-					int other_rx;
-
-					if (i == stn) {
-						continue;
-					}
-
-					if (attempt_tx_pending & (1<<i)) {
-						other_tx = pending_tx_antennas[i];
-					}
-					else {
-						other_tx = current_tx_antennas[i];
-					}
-
-					if (attempt_rx_pending & (1<<i)) {
-						other_rx = pending_rx_antennas[i];
-					}
-					else {
-						other_rx = current_rx_antennas[i];
-					}
-
-					if ((conflicts_table[ant][other_tx]) ||
-						(conflicts_table[ant][other_rx])) {
-						has_conflicts = TRUE;
-						if (antenna_events && !conflict_sent_rx[stn]) {
-							buffer[0] = '!';
-							buffer[1] = stn + '1';
-							buffer[2] = 'c';
-							buffer[3] = sixbit[pending_rx_antennas[stn]];
-							buffer[4] = ';';
-							buffer[5] = '\0';
-							moas_callback_write(buffer);
-							conflict_sent_rx[stn] = TRUE;
-						}
-						break;
-					}
-				}
-			}
+	// Find the largest set of pending transmit antenna changes
+	// which can be made without conflicts.  The receive antennas
+	// are taken as if all of their possible changes are made.
+#if defined(MOAS_STATS)
+	graph.iterations = 0;
+#endif
+	build_change_graph(ctx, &graph, temp_tx_pending,
+					   ctx->pending_tx_antennas, ctx->current_tx_antennas,
+					   ctx->pending_rx_antennas, ctx->current_rx_antennas,
+					   temp_rx_pending);
+	attempt_tx_pending = search_changes(&graph, MOAS_STATIONS-1, 0, 0, 0, 0);
+	report_conflicts(ctx, &graph, attempt_tx_pending, 'C',
+					 ctx->pending_tx_antennas, ctx->conflict_sent_tx);
+
+	// Then do the same for the receive antennas using the transmit
+	// antennas which were accepted.
+	build_change_graph(ctx, &graph, temp_rx_pending,
+					   ctx->pending_rx_antennas, ctx->current_rx_antennas,
+					   ctx->pending_tx_antennas, ctx->current_tx_antennas,
+					   attempt_tx_pending);
+	attempt_rx_pending = search_changes(&graph, MOAS_STATIONS-1, 0, 0, 0, 0);
+	report_conflicts(ctx, &graph, attempt_rx_pending, 'c',
+					 ctx->pending_rx_antennas, ctx->conflict_sent_rx);
+
+#if defined(MOAS_STATS)
+	if (ctx->stats) {
+		moas_stats *st = &ctx->stats->stats;
+
+		st->resolver_runs++;
+		st->resolver_iterations += graph.iterations;
+		if ((unsigned long long)graph.iterations > st->resolver_max_iterations) {
+			st->resolver_max_iterations = graph.iterations;
 		}
-		if (!has_conflicts) {
-			break;
-		}
-
-		// This algorithm tries all combinations of antennas.
-		// And it tries each exactly once.
-		attempt_rx_pending = (attempt_rx_pending - 1) & temp_rx_pending;
+		st->iterations[stats_bucket(graph.iterations)]++;
 	}
+#endif
 
 	//Check for conflicts with alternates
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
 		if (alts & (1<<stn)) {
-			int ant = alternate_antennas[stn];
-			int conflict = FALSE;
+			int ant = ctx->alternate_antennas[stn];
 
 			// Check for conflicts with other antennas
-			for (i=0; i<MOAS_STATIONS; i++) {
-				int other_tx;
-				int other_rx;
-
-				if (i == stn) {
-					continue;
-				}
-
-				if (attempt_tx_pending & (1<<i)) {
-					other_tx = pending_tx_antennas[i];
-				}
-				else {
-					other_tx = current_tx_antennas[i];
-				}
-
-				if (attempt_rx_pending & (1<<i)) {
-					other_rx = pending_rx_antennas[i];
-				}
-				else {
-					other_rx = current_rx_antennas[i];
-				}
-
-				if ((conflicts_table[ant][other_tx]) ||
-					(conflicts_table[ant][other_rx])) {
-						conflict = TRUE;
-						break;
-				}
-			}
-			if (conflict) {
-				for (i=0; i<MOAS_RELAYS; i++) {
-					actual_alternate_relays[i][stn] = FALSE;
-				}
+			if (ctx->conflicts_table[ant] &
+				occupied_antennas(ctx, stn, attempt_tx_pending, attempt_rx_pending)) {
+				set_station_relays(ctx, ctx->actual_alternate_relays, stn, 0);
 			}
 			else {
-				for (i=0; i<MOAS_RELAYS; i++) {
-					actual_alternate_relays[i][stn] = alternate_relays[i][stn];
-				}
+				set_station_relays(ctx, ctx->actual_alternate_relays, stn,
+								   ctx->alternate_relays[stn]);
 			}
 		}
 	}
@@ -1678,22 +4013,23 @@ static void do_resolver()
 	// If there is nothing pending update the outputs
 	// and return
 	if (!attempt_tx_pending && !attempt_rx_pending) {
-		do_pins();
+		do_pins(ctx);
 		return;
 	}
 
 	// Move pending transmit antennas to current and actual
 	for (stn=0; stn<MOAS_STATIONS; stn++) {
 		if (attempt_tx_pending & (1<<stn)) {
-			int ant = pending_tx_antennas[stn];
-			current_tx_antennas[stn] = ant;
-			actual_tx_antennas[stn] = ant;
-			for (i=0; i<MOAS_RELAYS; i++) {
-				int relay = pending_tx_relays[i][stn];
-				current_tx_relays[i][stn] = relay;
-				actual_tx_relays[i][stn] = relay || current_extra_relays[i][stn];
-			}
-			conflict_sent_tx[stn] = FALSE;
+			int ant = ctx->pending_tx_antennas[stn];
+			ctx->current_tx_antennas[stn] = ant;
+			ctx->actual_tx_antennas[stn] = ant;
+			ctx->current_tx_relays[stn] = ctx->pending_tx_relays[stn];
+			set_station_relays(ctx, ctx->actual_tx_relays, stn,
+							   ctx->current_tx_relays[stn] | ctx->current_extra_relays[stn]);
+			ctx->conflict_sent_tx[stn] = FALSE;
+
+			// A change which waited for its interrupt mode delay is done
+			moas_timer_stop(&ctx->interrupt_timers[stn]);
 		}
 	}
 
@@ -1704,69 +4040,62 @@ static void do_resolver()
 		int ant;
 
 		if (attempt_rx_pending & (1<<stn)) {
-			ant = pending_rx_antennas[stn];
+			ant = ctx->pending_rx_antennas[stn];
 
-			current_rx_antennas[stn] = ant;			
-			for (i=0; i<MOAS_RELAYS; i++) {
-				int relay = pending_rx_relays[i][stn];
-				current_rx_relays[i][stn] = relay;
-			}
-			conflict_sent_rx[stn] = FALSE;
+			ctx->current_rx_antennas[stn] = ant;			
+			ctx->current_rx_relays[stn] = ctx->pending_rx_relays[stn];
+			ctx->conflict_sent_rx[stn] = FALSE;
 		}
 		else {
-			ant = current_rx_antennas[stn];
+			ant = ctx->current_rx_antennas[stn];
 		}
 
-		if (fast_table[ant][current_tx_antennas[stn]]) {
-			actual_rx_antennas[stn] = current_rx_antennas[stn];
-			for (i=0; i<MOAS_RELAYS; i++) {
-				int relay = current_rx_relays[i][stn];
-				actual_rx_relays[i][stn] = relay;
-			}
+		if (ctx->fast_table[ant] & ANTENNA(ctx->current_tx_antennas[stn])) {
+			ctx->actual_rx_antennas[stn] = ctx->current_rx_antennas[stn];
+			set_station_relays(ctx, ctx->actual_rx_relays, stn,
+							   ctx->current_rx_relays[stn]);
 		}
 		else {
-			actual_rx_antennas[stn] = current_tx_antennas[stn];
-			for (i=0; i<MOAS_RELAYS; i++) {
-				int relay = current_tx_relays[i][stn];
-				actual_rx_relays[i][stn] = relay;
-			}
+			ctx->actual_rx_antennas[stn] = ctx->current_tx_antennas[stn];
+			set_station_relays(ctx, ctx->actual_rx_relays, stn,
+							   ctx->current_tx_relays[stn]);
 		}
 	}
 
 	// Notify controlling program of any antenna changes if desired
-	if (antenna_events) {
+	if (ctx->antenna_events) {
 		for (stn=0; stn<MOAS_STATIONS; stn++) {
 			if (attempt_tx_pending & (1<<stn)) {
 				buffer[0] = '!';
 				buffer[1] = stn + '1';
-				if (fast_table[current_tx_antennas[stn]][current_rx_antennas[stn]]) {
+				if (ctx->fast_table[ctx->current_tx_antennas[stn]] & ANTENNA(ctx->current_rx_antennas[stn])) {
 					buffer[2] = 'F';
 				}
 				else {
 					buffer[2] = 'S';
 				}
-				buffer[3] = sixbit[current_tx_antennas[stn]];
+				buffer[3] = sixbit[ctx->current_tx_antennas[stn]];
 				buffer[4] = ';';
 				buffer[5] = '\0';
-				moas_callback_write(buffer);
+				callback_write(ctx, buffer);
 			}
 
 			if (attempt_rx_pending & (1<<stn)) {
 				buffer[0] = '!';
 				buffer[1] = stn + '1';
-				if (fast_table[current_tx_antennas[stn]][current_rx_antennas[stn]]) {
+				if (ctx->fast_table[ctx->current_tx_antennas[stn]] & ANTENNA(ctx->current_rx_antennas[stn])) {
 					buffer[2] = 'f';
 				}
 				else {
 					buffer[2] = 's';
 				}
-				buffer[3] = sixbit[current_rx_antennas[stn]];
+				buffer[3] = sixbit[ctx->current_rx_antennas[stn]];
 				buffer[4] = ';';
 				buffer[5] = '\0';
-				moas_callback_write(buffer);
+				callback_write(ctx, buffer);
 			}
 
-			if (alt_pending & (1<<stn)) {
+			if (ctx->alt_pending & (1<<stn)) {
 				buffer[0] = '!';
 				buffer[1] = stn + '1';
 				if (alt_conflicts & (1<<stn)) {
@@ -1775,19 +4104,21 @@ static void do_resolver()
 				else {
 					buffer[2] = 'A';
 				}
-				buffer[3] = sixbit[alternate_antennas[stn]];
+				buffer[3] = sixbit[ctx->alternate_antennas[stn]];
 				buffer[4] = ';';
 				buffer[5] = '\0';
-				moas_callback_write(buffer);
+				callback_write(ctx, buffer);
 			}
 		}
 	}
 
 	// Remove completed transitions from pending
-	tx_pending &= ~attempt_tx_pending;
-	rx_pending &= ~attempt_rx_pending;
-	alt_pending = 0;
-
-	moas_callback_antennas(actual_tx_antennas, actual_rx_antennas);
-	do_pins();
+	ctx->tx_pending &= ~attempt_tx_pending;
+	ctx->rx_pending &= ~attempt_rx_pending;
+	ctx->interrupt_waits &= ~attempt_tx_pending;
+	ctx->interrupt_ready &= ~attempt_tx_pending;
+	ctx->alt_pending = 0;
+
+	callback_antennas(ctx, ctx->actual_tx_antennas, ctx->actual_rx_antennas);
+	do_pins(ctx);
 }
\ No newline at end of file
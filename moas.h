@@ -13,10 +13,13 @@
 // output because it is a 9600 baud serial line.  Even if the emulation was
 // more faithful the switch CPU speed is 16 MHz and it could choke on things
 // that the emulator can easily handle with a 32 or 64 bit processor.
+// An owner which wants the output paced like the real line can put the
+// model in moas_line.h between the switch and its transport.
 //
-// Also the emulator has no timers.  All timed events happen instantly.  The
-// timers protect the radio hardware from hot switching but that is not an
-// issue for the emulator.
+// The timers protect the radio hardware from hot switching.  A switch
+// only times its inhibit time, receive delay and interrupt mode delay
+// when its owner gives it a timing wheel (see moas_timer.h).  Without one
+// all timed events happen instantly.
 //
 // This emulator was NOT intended to drive actual hardware and should not
 // be used that way without major alteration.
@@ -24,11 +27,360 @@
 #ifndef MOAS_H
 #define MOAS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MOAS_STATIONS  6
 #define MOAS_ANTENNAS  64
 #define MOAS_RELAYS    64
 
-// These are the routines which must be called to use the emulator:
+// Each emulated switch is held in a context.  Any number of contexts
+// may be used and they share no state, so different contexts may be
+// used from different threads.  A single context must only be used by
+// one thread at a time.
+typedef struct moas_ctx moas_ctx;
+
+// A timing wheel holds the timers of one or more switches.  See
+// moas_timer.h.
+typedef struct moas_wheel moas_wheel;
+
+// These are the routines a context uses to report to its owner.  The
+// user value given to moas_create is passed back to each of them.  Any
+// of them may be NULL if the owner is not interested.
+typedef struct moas_callbacks {
+	// Write a status or event string.  See moas_callback_write.
+	void (*write)(void *user, const char *buffer);
+
+	// Relay and inhibit update.  See moas_callback_update.
+	void (*update)(void *user, const int *relays, const int *inhibits);
+
+	// Antennas.  See moas_callback_antennas.
+	void (*antennas)(void *user, const int *tx, const int *rx);
+
+	// Relay and inhibit changes.  If this is given it is called
+	// instead of update, and only when a relay or inhibit changed
+	// since the last call.  Before the first call all relays are off
+	// and all stations are inhibited.
+	//    changed  Relays which changed, relay n in bit n
+	//    relays   All relays which are now selected
+	//    changed_inhibits Stations whose inhibit changed, station 1
+	//             in bit 0
+	//    inhibits All stations which are now inhibited
+	void (*relays_changed)(void *user, uint64_t changed, uint64_t relays,
+		int changed_inhibits, int inhibits);
+
+	// Antenna changes.  If this is given it is called instead of
+	// antennas, and only when an actual antenna changed since the
+	// last call.  Before the first call all antennas are 63.
+	//    changed  Stations whose transmit or receive antenna changed,
+	//             station 1 in bit 0
+	//    tx, rx   The same arrays given to antennas
+	void (*antennas_changed)(void *user, int changed, const int *tx,
+		const int *rx);
+} moas_callbacks;
+
+// Create a switch context.  The switch is initialized as if by
+// moas_initialize_ctx so the update callback is called before this
+// returns.
+// Routine:  moas_create
+//
+// Inputs:
+//    callbacks Routines used to report to the owner.  They are copied.
+//    user    Value passed to the callbacks
+// Outputs:
+//    Returns the new context or NULL if there is no memory
+moas_ctx *moas_create(const moas_callbacks *callbacks, void *user);
+
+// Destroy a switch context
+// Routine:  moas_destroy
+//
+// Inputs:
+//    ctx     Context to destroy.  NULL is ignored.
+void moas_destroy(moas_ctx *ctx);
+
+// Initialize the switch in a context.  This is always successful.
+// Routine:  moas_initialize_ctx
+//
+// Inputs:
+//    ctx     Switch context
+void moas_initialize_ctx(moas_ctx *ctx);
+
+// Give the switch in a context a character
+// Routine: moas_character_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    c       Character to give to switch
+void moas_character_ctx(moas_ctx *ctx, char c);
+
+// Give the switch in a context a block of characters.  This is the
+// same as giving them one at a time with moas_character_ctx, but
+// commands wholly inside the block are processed where they are.
+// Routine: moas_feed_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    buffer  Characters to give to switch
+//    len     Number of characters
+void moas_feed_ctx(moas_ctx *ctx, const char *buffer, size_t len);
+
+// Change the transmit/receive state of the switch in a context
+// Routine: moas_txrx_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    station Station which is transmitting or receiving
+//    state   TRUE if transmitting, FALSE if receiving
+void moas_txrx_ctx(moas_ctx *ctx, int station, int state);
+
+// Replies and events are held and given to the write callback together
+// when moas_character_ctx, moas_feed_ctx or moas_txrx_ctx finishes, or
+// sooner once this much output is waiting.  0 writes every reply as
+// it is made.  The default is the largest amount which can be held.
+// Routine: moas_output_threshold_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    threshold Number of characters
+void moas_output_threshold_ctx(moas_ctx *ctx, int threshold);
+
+// A band change sends every station new transmit, receive and alternate
+// antennas.  Each antenna command normally runs the conflict resolver
+// and updates the relays, so the relays go through every step in
+// between.  Antenna commands given in a batch are kept apart until the
+// batch is committed, then become pending together and are resolved
+// once, so the relays move once.  The #B; and #E; commands do the same
+// over the serial port.  A transmit/receive change or a timer during a
+// batch only resolves the changes from before it.  Resetting the switch
+// ends a batch and drops what was given in it.
+// Routine: moas_begin_batch_ctx
+//
+// Inputs:
+//    ctx     Switch context
+void moas_begin_batch_ctx(moas_ctx *ctx);
+
+// Commit a batch of antenna commands and write what it produced.
+// Nothing is resolved if no batch is open.
+// Routine: moas_commit_batch_ctx
+//
+// Inputs:
+//    ctx     Switch context
+void moas_commit_batch_ctx(moas_ctx *ctx);
+
+// Tell the switch what the owner's output queue holds, such as a
+// serial line model (see moas_line_report in moas_line.h).  The #Q;
+// command reports it.  A switch starts with all of them 0.
+// Routine: moas_output_queue_ctx
+//
+// Inputs:
+//    ctx       Switch context
+//    depth     Messages queued now
+//    max_depth Most messages queued at once
+//    dropped   Messages dropped because the queue was full
+void moas_output_queue_ctx(moas_ctx *ctx, int depth, int max_depth,
+	unsigned long long dropped);
+
+// Write any held replies and events now.  The routines above already do
+// this before they return.
+// Routine: moas_flush_ctx
+//
+// Inputs:
+//    ctx     Switch context
+void moas_flush_ctx(moas_ctx *ctx);
+
+// Give the switch in a context a timing wheel for its timers.  Its
+// delays are then timed on the wheel's clock and the relay and inhibit
+// changes they hold back happen when the owner runs the wheel.  Without a
+// wheel, which is how a context starts, they happen at once.  Timers
+// which are running move to a new wheel, or expire at once if the wheel
+// is taken away.  A copy made by moas_fork_ctx uses the same wheel.
+// Routine: moas_timers_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    wheel   Timing wheel, or NULL for none
+void moas_timers_ctx(moas_ctx *ctx, moas_wheel *wheel);
+
+// A configuration image holds everything a controlling program sets up
+// before it uses the switch: the conflicts, fast and antenna system
+// tables, global relays, inhibit polarity and type, cross inhibits,
+// alternates, wait modes and timer delays.  Loading one sets all of
+// them at once instead of sending hundreds of commands.  The image is
+// the same on every machine.
+#define MOAS_CONFIG_LEN 1174
+
+// Save the configuration of the switch in a context
+// Routine: moas_save_config_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    image   Filled in with MOAS_CONFIG_LEN bytes
+void moas_save_config_ctx(moas_ctx *ctx, unsigned char *image);
+
+// Load a configuration into the switch in a context.  Nothing is
+// changed if the image is not valid.  Relays and inhibits are worked
+// out again and reported as they would be after the commands.
+// Routine: moas_load_config_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    image   Configuration image
+//    len     Length of the image
+// Outputs:
+//    Returns TRUE if the image was valid and loaded
+int moas_load_config_ctx(moas_ctx *ctx, const unsigned char *image,
+	size_t len);
+
+// A snapshot holds the whole state of a switch, including a partly
+// received command, so the switch can be put back the way it was.  Two
+// switches in the same state give the same snapshot.  The owner's view
+// of the relays and antennas, replies held for the owner and the output
+// threshold are not part of it.  Held replies are written before a
+// switch is restored or copied over.  A switch which is restored,
+// copied or forked reports its relays and antennas as if they had just
+// changed.
+
+// Save the state of the switch in a context
+// Routine: moas_snapshot_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    blob    Filled in with the snapshot
+//    len     Room in blob
+// Outputs:
+//    Returns the length of the snapshot.  Nothing is written if it is
+//    longer than len, so a len of 0 finds the length needed.
+size_t moas_snapshot_ctx(moas_ctx *ctx, unsigned char *blob, size_t len);
+
+// Put the switch in a context back to a snapshot.  Nothing is changed
+// if the snapshot is not valid.
+// Routine: moas_restore_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    blob    Snapshot
+//    len     Length of the snapshot
+// Outputs:
+//    Returns TRUE if the snapshot was valid and restored
+int moas_restore_ctx(moas_ctx *ctx, const unsigned char *blob, size_t len);
+
+// Create a new context holding a copy of a switch.  This is much
+// faster than a snapshot and restore.
+// Routine: moas_fork_ctx
+//
+// Inputs:
+//    ctx     Switch context to copy
+//    callbacks Routines the copy uses to report to its owner, or NULL
+//            to use the same ones as ctx
+//    user    Value passed to the copy's callbacks
+// Outputs:
+//    Returns the new context or NULL if there is no memory
+moas_ctx *moas_fork_ctx(moas_ctx *ctx, const moas_callbacks *callbacks,
+	void *user);
+
+// Make one switch a copy of another without creating a context.  The
+// copy keeps its own callbacks.
+// Routine: moas_copy_ctx
+//
+// Inputs:
+//    to      Switch context to change
+//    from    Switch context to copy
+void moas_copy_ctx(moas_ctx *to, const moas_ctx *from);
+
+// A switch built with MOAS_STATS defined keeps statistics about what
+// it does.  Without it nothing is kept and the engine does no extra
+// work.  Statistics belong to a context and are not part of its state,
+// so a snapshot does not hold them and a fork starts with none.
+//
+// Times are measured in nanoseconds and counted in buckets of powers
+// of two.  Bucket 0 is under 128 ns, bucket n is from 64 << n to
+// 128 << n ns and the last bucket also has everything longer.
+#define MOAS_STATS_BUCKETS 16
+
+// Commands are counted by their first character, from space to DEL.
+// DEL also counts commands starting with characters above it.
+#define MOAS_STATS_OPCODES 96
+
+typedef struct moas_latency {
+	unsigned long long count;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long long buckets[MOAS_STATS_BUCKETS];
+} moas_latency;
+
+typedef struct moas_stats {
+	// Time to carry out each kind of command, by its first character
+	// less a space
+	moas_latency commands[MOAS_STATS_OPCODES];
+
+	// Time to handle each transmit/receive change
+	moas_latency txrx;
+
+	// Conflict resolver runs, and the subsets of the pending changes
+	// it tried.  The iterations of each run are counted in buckets of
+	// powers of two: bucket 0 is none and bucket n is from 2^(n-1) to
+	// 2^n - 1.
+	unsigned long long resolver_runs;
+	unsigned long long resolver_iterations;
+	unsigned long long resolver_max_iterations;
+	unsigned long long iterations[MOAS_STATS_BUCKETS];
+
+	// Relay and inhibit outputs.  An update is a change to any of
+	// them and each relay or inhibit which changed is counted too.
+	unsigned long long relay_updates;
+	unsigned long long relay_changes;
+	unsigned long long inhibit_changes;
+
+	// Error replies: ?A; for a bad command, ?U; for an unknown one
+	// and any others
+	unsigned long long bad_commands;
+	unsigned long long unknown_commands;
+	unsigned long long other_errors;
+} moas_stats;
+
+// Read the statistics of a switch
+// Routine: moas_stats_ctx
+//
+// Inputs:
+//    ctx     Switch context
+//    stats   Filled in with the statistics, or all zero if they are
+//            not kept
+// Outputs:
+//    Returns TRUE if the switch keeps statistics
+int moas_stats_ctx(moas_ctx *ctx, moas_stats *stats);
+
+// Clear the statistics of a switch
+// Routine: moas_clear_stats_ctx
+//
+// Inputs:
+//    ctx     Switch context
+void moas_clear_stats_ctx(moas_ctx *ctx);
+
+// Write statistics as text, one line for each thing measured.  Only
+// the kinds of command which were seen are written.  The lines are
+//
+//    command C count N total_ns N max_ns N buckets N ...
+//    txrx count N total_ns N max_ns N buckets N ...
+//    resolver runs N iterations N max_iterations N buckets N ...
+//    relays updates N changes N inhibit_changes N
+//    errors bad N unknown N other N
+//
+// C is the command's first character, or DEL for the last count.
+// Routine: moas_format_stats
+//
+// Inputs:
+//    stats   Statistics to write
+//    buffer  Filled in with the text, which is always terminated if
+//            size is not 0
+//    size    Room in buffer
+// Outputs:
+//    Returns the length of the whole text, which was cut short if it
+//    is size or more
+size_t moas_format_stats(const moas_stats *stats, char *buffer, size_t size);
+
+// These are the routines which must be called to use the emulator
+// as a single switch.  They use a default context which reports
+// through the moas_callback_ routines further down.
 
 // Initialize the switch.  This is always successful.
 // Routine:  moas_initialize
@@ -44,6 +396,14 @@ void moas_initialize();
 //    c       Character to give to switch
 void moas_character(char c);
 
+// Give the switch a block of characters
+// Routine: moas_feed
+//
+// Inputs:
+//    buffer  Characters to give to switch
+//    len     Number of characters
+void moas_feed(const char *buffer, size_t len);
+
 // Change the transmit/receive state
 // Routine: moas_txrx
 //
@@ -52,7 +412,8 @@ void moas_character(char c);
 //    state   TRUE if transmitting, FALSE if receiving
 void moas_txrx(int station, int state);
 
-// These are the routines which must be defined to use the emulator:
+// These are the routines which must be defined to use the emulator
+// as a single switch:
 
 // Write a status or event string
 // Routine:  moas_callback_write
@@ -0,0 +1,1032 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - benchmarks
+//
+// This times the parts of the emulator which run for every command and
+// every transmit/receive change so one version of the engine can be
+// compared with another.
+//
+//    moas_bench [-f json|csv] [-t seconds] [-r repeats] [name ...]
+//
+//    -f        Output format, default json (one object per line)
+//    -t        Time to spend on each repeat, default 0.2 seconds
+//    -r        Number of repeats, default 5
+//    name      Only run benchmarks whose names start with one of these
+//
+// Each benchmark is run enough times to fill the time, and that is
+// repeated.  The median and fastest repeat are reported.  An item is
+// one command, one transmit/receive round trip, one resolver run, one
+// band change, one fork or one snapshot and restore depending on the
+// benchmark.  On Linux the farm benchmarks run 10000 switches on a
+// worker for each processor and an item is one command or one
+// transmit/receive change given to any of them.  The fields are
+//
+//    name          Benchmark
+//    version       Engine version from the unit ID reply
+//    items         Items timed in the median repeat
+//    ns_per_item   Median time for one item
+//    ns_per_item_min  Fastest time for one item
+//    items_per_sec Items a second at the median
+//    bytes_per_sec Input characters a second at the median, or 0 if
+//                  the benchmark is not fed characters
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(MOAS_BENCH_FARM)
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "moas.h"
+
+#if defined(MOAS_BENCH_FARM)
+#include "moas_farm.h"
+#endif
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// Size of the generated command streams
+#define INPUT_LEN 16384
+
+#define MAX_REPEATS 32
+
+// Switches in the farm benchmarks
+#define FARM_SWITCHES 10000
+
+static const char sixbit[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz{}";
+
+// Everything one benchmark works with
+typedef struct bench_state {
+	moas_ctx *sw;
+
+	// Characters given to the switch for each operation
+	char *input;
+	size_t input_len;
+
+	// Items in each operation
+	long items;
+
+	// Transmit/receive state being toggled
+	int station;
+	int state;
+
+	// What the switch produced, so none of it can be left out
+	unsigned long output;
+	unsigned long changes;
+
+	// Generator for the command streams
+	unsigned long seed;
+
+#if defined(MOAS_BENCH_FARM)
+	// The farm, the input given to each of its switches and how much
+	// of it the workers have handed to the switches
+	moas_farm *farm;
+	size_t block_len;
+	unsigned long long done;
+#endif
+} bench_state;
+
+typedef struct benchmark {
+	const char *name;
+
+	// Set the switch up and work out the items in one operation
+	int (*setup)(bench_state *b);
+
+	// Do a number of operations
+	void (*run)(bench_state *b, long ops);
+
+	// Free what the set up made besides the switch, or NULL
+	void (*finish)(bench_state *b);
+} benchmark;
+
+static double
+now(void)
+//----------------------------------------------------------------------
+// Return a monotonic time in seconds
+//----------------------------------------------------------------------
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned long
+next_random(bench_state *b)
+//----------------------------------------------------------------------
+// Return the next value from a fixed generator so every run is given
+// the same commands
+//----------------------------------------------------------------------
+{
+	b->seed = b->seed * 1103515245UL + 12345UL;
+	return (b->seed >> 16) & 0x7fff;
+}
+
+static void
+bench_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Count replies and events
+//----------------------------------------------------------------------
+{
+	bench_state *b = (bench_state *)user;
+
+	b->output += strlen(buffer);
+}
+
+static void
+bench_relays(void *user, uint64_t changed, uint64_t relays,
+	int changed_inhibits, int inhibits)
+//----------------------------------------------------------------------
+// Count relay and inhibit changes
+//----------------------------------------------------------------------
+{
+	bench_state *b = (bench_state *)user;
+
+	b->changes++;
+}
+
+static void
+bench_antennas(void *user, int changed, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Count antenna changes
+//----------------------------------------------------------------------
+{
+	bench_state *b = (bench_state *)user;
+
+	b->changes++;
+}
+
+static void
+send_commands(bench_state *b, const char *commands)
+//----------------------------------------------------------------------
+// Give set up commands to the switch
+//----------------------------------------------------------------------
+{
+	moas_feed_ctx(b->sw, commands, strlen(commands));
+}
+
+static int
+add_command(bench_state *b, const char *cmd)
+//----------------------------------------------------------------------
+// Add a command to the input.  Returns FALSE when it is full.
+//----------------------------------------------------------------------
+{
+	size_t len = strlen(cmd);
+
+	if (b->input_len + len > INPUT_LEN) {
+		return FALSE;
+	}
+	memcpy(b->input + b->input_len, cmd, len);
+	b->input_len += len;
+	b->items++;
+	return TRUE;
+}
+
+static void
+random_relays(bench_state *b, char *digits)
+//----------------------------------------------------------------------
+// Make a relay list of one to eleven digits, ending with a semicolon
+//----------------------------------------------------------------------
+{
+	int len = 1 + (int)(next_random(b) % 11);
+	int i;
+
+	for (i=0; i<len; i++) {
+		digits[i] = sixbit[next_random(b) % 64];
+	}
+	digits[len] = ';';
+	digits[len+1] = '\0';
+}
+
+static int
+setup_mix(bench_state *b)
+//----------------------------------------------------------------------
+// A controlling program's traffic: antenna changes for every station
+// with status, relay status, ping and inhibit commands between them
+//----------------------------------------------------------------------
+{
+	char cmd[32];
+	char relays[16];
+	int stn;
+	int k;
+
+	send_commands(b, "*1;*A;*T;*X;");
+
+	for (k=0; ; k++) {
+		stn = k % MOAS_STATIONS + 1;
+
+		random_relays(b, relays);
+		sprintf(cmd, "!%dT%c%s", stn, sixbit[next_random(b) % 64], relays);
+		if (!add_command(b, cmd)) {
+			break;
+		}
+		random_relays(b, relays);
+		sprintf(cmd, "!%dR%c%s", stn, sixbit[next_random(b) % 64], relays);
+		if (!add_command(b, cmd)) {
+			break;
+		}
+
+		switch (k % 8) {
+		case 0:
+			strcpy(cmd, "|;");
+			break;
+		case 1:
+			strcpy(cmd, "\"B;");
+			break;
+		case 2:
+			strcpy(cmd, "';");
+			break;
+		case 3:
+			sprintf(cmd, "(%d;", stn);
+			break;
+		case 4:
+			sprintf(cmd, ")%d;", stn);
+			break;
+		case 5:
+			random_relays(b, relays);
+			sprintf(cmd, "!%dX%s", stn, relays);
+			break;
+		case 6:
+			strcpy(cmd, "\"I;");
+			break;
+		default:
+			strcpy(cmd, ":;");
+			break;
+		}
+		if (!add_command(b, cmd)) {
+			break;
+		}
+	}
+	return TRUE;
+}
+
+static int
+setup_pairs(bench_state *b, const char *clear, char kind)
+//----------------------------------------------------------------------
+// An upload of a whole table in the longest commands the switch takes.
+// Each command holds pairs of sixbit digits.
+//----------------------------------------------------------------------
+{
+	// A command, kind, pairs and the semicolon fill the command buffer
+	char cmd[128];
+	int pair = 0;
+	int len;
+
+	send_commands(b, "*1;");
+
+	if (!add_command(b, clear)) {
+		return FALSE;
+	}
+
+	for (;;) {
+		cmd[0] = kind == 'S' ? '_' : (kind == 'F' ? '&' : '%');
+		cmd[1] = kind;
+		len = 2;
+		while (len < (int)sizeof(cmd) - 3) {
+			cmd[len++] = sixbit[pair % 64];
+			if (kind == 'S') {
+				cmd[len++] = sixbit[(pair / 64) % 8 + 1];
+			}
+			else {
+				cmd[len++] = sixbit[(pair / 64) % 64];
+			}
+			pair++;
+		}
+		cmd[len++] = ';';
+		cmd[len] = '\0';
+		if (!add_command(b, cmd)) {
+			break;
+		}
+	}
+	return TRUE;
+}
+
+static int
+setup_conflict_upload(bench_state *b)
+//----------------------------------------------------------------------
+// Conflicts table upload
+//----------------------------------------------------------------------
+{
+	return setup_pairs(b, "%0;", 'C');
+}
+
+static int
+setup_fast_upload(bench_state *b)
+//----------------------------------------------------------------------
+// Fast table upload
+//----------------------------------------------------------------------
+{
+	return setup_pairs(b, "&0;", 'F');
+}
+
+static int
+setup_system_upload(bench_state *b)
+//----------------------------------------------------------------------
+// Antenna system table upload
+//----------------------------------------------------------------------
+{
+	return setup_pairs(b, "_0;", 'S');
+}
+
+static void
+setup_antennas(bench_state *b)
+//----------------------------------------------------------------------
+// Put the switch in operate with a transmit, receive and alternate
+// antenna for every station and no conflicts
+//----------------------------------------------------------------------
+{
+	char cmd[32];
+	int stn;
+
+	send_commands(b, "*1;*A;*T;");
+	for (stn=1; stn<=MOAS_STATIONS; stn++) {
+		sprintf(cmd, "!%dT%c%c;", stn, sixbit[stn], sixbit[stn]);
+		send_commands(b, cmd);
+		sprintf(cmd, "!%dR%c%c;", stn, sixbit[stn+10], sixbit[stn+10]);
+		send_commands(b, cmd);
+		sprintf(cmd, "!%dA%c%c;", stn, sixbit[stn+20], sixbit[stn+20]);
+		send_commands(b, cmd);
+	}
+	b->items = 1;
+}
+
+static int
+setup_txrx_plain(bench_state *b)
+//----------------------------------------------------------------------
+// Transmit/receive with no cross inhibits or alternates
+//----------------------------------------------------------------------
+{
+	setup_antennas(b);
+	return TRUE;
+}
+
+static int
+setup_txrx_cross(bench_state *b)
+//----------------------------------------------------------------------
+// Transmit/receive where every station inhibits every other one
+//----------------------------------------------------------------------
+{
+	setup_antennas(b);
+	send_commands(b, "~123456;~213456;~312456;~412356;~512346;~612345;");
+	return TRUE;
+}
+
+static int
+setup_txrx_alternates(bench_state *b)
+//----------------------------------------------------------------------
+// Transmit/receive where every station moves every other one to its
+// alternate antenna
+//----------------------------------------------------------------------
+{
+	setup_antennas(b);
+	send_commands(b, "@123456;@213456;@312456;@412356;@512346;@612345;");
+	return TRUE;
+}
+
+static int
+setup_txrx_both(bench_state *b)
+//----------------------------------------------------------------------
+// Transmit/receive with both cross inhibits and alternates.  Half the
+// stations inhibit the others and the other half use alternates.
+//----------------------------------------------------------------------
+{
+	setup_antennas(b);
+	send_commands(b, "~1456;~2456;~3456;@4123;@5123;@6123;");
+	return TRUE;
+}
+
+static int
+setup_resolver(bench_state *b)
+//----------------------------------------------------------------------
+// Every antenna conflicts with every other one and all six stations
+// have transmit and receive changes pending, so each resolver run
+// checks every change against every station and can make none
+//----------------------------------------------------------------------
+{
+	char cmd[32];
+	int stn;
+
+	send_commands(b, "*1;*A;%1;");
+	for (stn=1; stn<=MOAS_STATIONS; stn++) {
+		sprintf(cmd, "!%dB%c%c%c;", stn, sixbit[stn], sixbit[stn],
+				sixbit[stn+6]);
+		send_commands(b, cmd);
+	}
+	b->items = 1;
+	return TRUE;
+}
+
+static int
+add_band_change(bench_state *b, int band, int batch)
+//----------------------------------------------------------------------
+// Add one band change.  Returns FALSE when it does not fit.
+//----------------------------------------------------------------------
+{
+	char cmd[32];
+	int stn;
+
+	if (batch && !add_command(b, "#B;")) {
+		return FALSE;
+	}
+	for (stn=1; stn<=MOAS_STATIONS; stn++) {
+		sprintf(cmd, "!%dT%c%c;", stn, sixbit[band+stn], sixbit[band+stn]);
+		if (!add_command(b, cmd)) {
+			return FALSE;
+		}
+		sprintf(cmd, "!%dR%c%c;", stn, sixbit[band+stn+10],
+				sixbit[band+stn+10]);
+		if (!add_command(b, cmd)) {
+			return FALSE;
+		}
+		sprintf(cmd, "!%dA%c%c;", stn, sixbit[band+stn+20],
+				sixbit[band+stn+20]);
+		if (!add_command(b, cmd)) {
+			return FALSE;
+		}
+	}
+	return !batch || add_command(b, "#E;");
+}
+
+static int
+setup_band(bench_state *b, int batch)
+//----------------------------------------------------------------------
+// Band changes which give every station a new transmit, receive and
+// alternate antenna, going back and forth between two bands.  An item
+// is a whole band change.
+//----------------------------------------------------------------------
+{
+	size_t len;
+	long changes;
+
+	setup_antennas(b);
+
+	for (changes=0; ; changes++) {
+		len = b->input_len;
+		if (!add_band_change(b, (changes & 1) ? 30 : 0, batch)) {
+			b->input_len = len;
+			break;
+		}
+	}
+	b->items = changes;
+	return TRUE;
+}
+
+static int
+setup_band_change(bench_state *b)
+//----------------------------------------------------------------------
+// Band changes one antenna command at a time
+//----------------------------------------------------------------------
+{
+	return setup_band(b, FALSE);
+}
+
+static int
+setup_band_batch(bench_state *b)
+//----------------------------------------------------------------------
+// Band changes in batches
+//----------------------------------------------------------------------
+{
+	return setup_band(b, TRUE);
+}
+
+static int
+setup_branch(bench_state *b)
+//----------------------------------------------------------------------
+// A switch which has been running a while, to be copied
+//----------------------------------------------------------------------
+{
+	setup_mix(b);
+	moas_feed_ctx(b->sw, b->input, b->input_len);
+	setup_txrx_both(b);
+	b->input_len = 0;
+	b->items = 1;
+	return TRUE;
+}
+
+static void
+run_feed(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Give the input to the switch a block at a time
+//----------------------------------------------------------------------
+{
+	long i;
+
+	for (i=0; i<ops; i++) {
+		moas_feed_ctx(b->sw, b->input, b->input_len);
+	}
+}
+
+static void
+run_character(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Give the input to the switch a character at a time
+//----------------------------------------------------------------------
+{
+	long i;
+	size_t j;
+
+	for (i=0; i<ops; i++) {
+		for (j=0; j<b->input_len; j++) {
+			moas_character_ctx(b->sw, b->input[j]);
+		}
+	}
+}
+
+static void
+run_txrx(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Key and unkey each station in turn
+//----------------------------------------------------------------------
+{
+	long i;
+
+	for (i=0; i<ops; i++) {
+		moas_txrx_ctx(b->sw, b->station + 1, TRUE);
+		moas_txrx_ctx(b->sw, b->station + 1, FALSE);
+		b->station = (b->station + 1) % MOAS_STATIONS;
+	}
+}
+
+static void
+run_resolver(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Run the resolver once for each transmit/receive change of station 1
+//----------------------------------------------------------------------
+{
+	long i;
+
+	for (i=0; i<ops; i++) {
+		b->state = !b->state;
+		moas_txrx_ctx(b->sw, 1, b->state);
+	}
+}
+
+static void
+run_fork(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Fork the switch and throw the copy away
+//----------------------------------------------------------------------
+{
+	moas_ctx *fork;
+	long i;
+
+	for (i=0; i<ops; i++) {
+		fork = moas_fork_ctx(b->sw, NULL, b);
+		moas_destroy(fork);
+	}
+}
+
+static void
+run_snapshot(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Save the switch and put it back
+//----------------------------------------------------------------------
+{
+	unsigned char blob[4096];
+	size_t len;
+	long i;
+
+	for (i=0; i<ops; i++) {
+		len = moas_snapshot_ctx(b->sw, blob, sizeof(blob));
+		if ((len > sizeof(blob)) || !moas_restore_ctx(b->sw, blob, len)) {
+			fprintf(stderr, "moas_bench: snapshot failed\n");
+			exit(1);
+		}
+	}
+}
+
+#if defined(MOAS_BENCH_FARM)
+static void
+farm_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Take a reply on a worker thread.  The switches share nothing with
+// each other, so the replies are not counted.
+//----------------------------------------------------------------------
+{
+}
+
+static unsigned long long
+farm_progress(bench_state *b, int txrx)
+//----------------------------------------------------------------------
+// Return the characters or transmit/receive changes the workers have
+// given to the switches
+//----------------------------------------------------------------------
+{
+	moas_farm_counters counters;
+	unsigned long long total = 0;
+	int shard;
+
+	for (shard=0; shard<moas_farm_shards(b->farm); shard++) {
+		moas_farm_read_counters(b->farm, shard, &counters);
+		total += txrx ? counters.txrx : counters.bytes;
+	}
+	return total;
+}
+
+static void
+farm_wait(bench_state *b, int txrx)
+//----------------------------------------------------------------------
+// Wait for the workers to finish everything queued
+//----------------------------------------------------------------------
+{
+	while (farm_progress(b, txrx) < b->done) {
+		sched_yield();
+	}
+}
+
+static void
+farm_feed(bench_state *b, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Queue characters for every switch, waiting for room when a queue is
+// full
+//----------------------------------------------------------------------
+{
+	int sw;
+
+	for (sw=0; sw<FARM_SWITCHES; sw++) {
+		while (!moas_farm_feed(b->farm, sw, buffer, (int)len)) {
+			sched_yield();
+		}
+	}
+	b->done += (unsigned long long)len * FARM_SWITCHES;
+}
+
+static int
+setup_farm(bench_state *b)
+//----------------------------------------------------------------------
+// Start a farm of switches in operate with an antenna for every
+// station, one worker for each processor
+//----------------------------------------------------------------------
+{
+	static const char *const setup[] = {
+		"*1;*A;*T;",
+		"!1T11;!1RAA;!2T22;!2RBB;!3T33;!3RCC;",
+		"!4T44;!4RDD;!5T55;!5REE;!6T66;!6RFF;",
+	};
+	moas_callbacks callbacks;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i;
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = farm_write;
+
+	b->farm = moas_farm_create(FARM_SWITCHES, cpus > 0 ? (int)cpus : 1,
+							   &callbacks, NULL);
+	if ((b->farm == NULL) || !moas_farm_start(b->farm)) {
+		return FALSE;
+	}
+	for (i=0; i<sizeof(setup)/sizeof(setup[0]); i++) {
+		farm_feed(b, setup[i], strlen(setup[i]));
+	}
+	farm_wait(b, FALSE);
+	b->done = 0;
+	return TRUE;
+}
+
+static int
+setup_farm_feed(bench_state *b)
+//----------------------------------------------------------------------
+// Each switch is given a station's band change and a status command
+// and then the change back
+//----------------------------------------------------------------------
+{
+	if (!setup_farm(b)) {
+		return FALSE;
+	}
+	add_command(b, "!1T77;");
+	add_command(b, "!1RGG;");
+	add_command(b, "\"B;");
+	add_command(b, "!1T11;");
+	add_command(b, "!1RAA;");
+	b->block_len = b->input_len;
+	b->input_len *= FARM_SWITCHES;
+	b->items *= FARM_SWITCHES;
+	return TRUE;
+}
+
+static int
+setup_farm_txrx(bench_state *b)
+//----------------------------------------------------------------------
+// Each switch has one station keyed and unkeyed
+//----------------------------------------------------------------------
+{
+	if (!setup_farm(b)) {
+		return FALSE;
+	}
+	b->items = 2 * FARM_SWITCHES;
+	return TRUE;
+}
+
+static void
+run_farm_feed(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Give every switch the input and wait for all of it to be processed
+//----------------------------------------------------------------------
+{
+	long i;
+
+	for (i=0; i<ops; i++) {
+		farm_feed(b, b->input, b->block_len);
+	}
+	farm_wait(b, FALSE);
+}
+
+static void
+run_farm_txrx(bench_state *b, long ops)
+//----------------------------------------------------------------------
+// Key and unkey a station of every switch, going through the stations
+// in turn, and wait for all of it to be processed
+//----------------------------------------------------------------------
+{
+	long i;
+	int sw;
+
+	for (i=0; i<ops; i++) {
+		for (sw=0; sw<FARM_SWITCHES; sw++) {
+			while (!moas_farm_txrx(b->farm, sw, b->station + 1, TRUE)) {
+				sched_yield();
+			}
+			while (!moas_farm_txrx(b->farm, sw, b->station + 1, FALSE)) {
+				sched_yield();
+			}
+		}
+		b->station = (b->station + 1) % MOAS_STATIONS;
+		b->done += 2 * FARM_SWITCHES;
+	}
+	farm_wait(b, TRUE);
+}
+
+static void
+finish_farm(bench_state *b)
+//----------------------------------------------------------------------
+// Stop the workers and free the farm
+//----------------------------------------------------------------------
+{
+	moas_farm_destroy(b->farm);
+}
+#endif
+
+static const benchmark benchmarks[] = {
+	{ "feed_mix",              setup_mix,             run_feed },
+	{ "character_mix",         setup_mix,             run_character },
+	{ "txrx_plain",            setup_txrx_plain,      run_txrx },
+	{ "txrx_cross_inhibits",   setup_txrx_cross,      run_txrx },
+	{ "txrx_alternates",       setup_txrx_alternates, run_txrx },
+	{ "txrx_cross_alternates", setup_txrx_both,       run_txrx },
+	{ "resolver_pending6",     setup_resolver,        run_resolver },
+	{ "band_change",           setup_band_change,     run_feed },
+	{ "band_change_batch",     setup_band_batch,      run_feed },
+	{ "upload_conflict",       setup_conflict_upload, run_feed },
+	{ "upload_fast",           setup_fast_upload,     run_feed },
+	{ "upload_system",         setup_system_upload,   run_feed },
+	{ "fork",                  setup_branch,          run_fork },
+	{ "snapshot_restore",      setup_branch,          run_snapshot },
+#if defined(MOAS_BENCH_FARM)
+	{ "farm_feed",             setup_farm_feed,       run_farm_feed,
+	  finish_farm },
+	{ "farm_txrx",             setup_farm_txrx,       run_farm_txrx,
+	  finish_farm },
+#endif
+};
+
+#define BENCHMARKS ((int)(sizeof(benchmarks)/sizeof(benchmarks[0])))
+
+static void
+version_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Pick the version out of a unit ID reply, which is :MNNU;
+//----------------------------------------------------------------------
+{
+	char *version = (char *)user;
+
+	if ((buffer[0] == ':') && (strlen(buffer) >= 5)) {
+		sprintf(version, "%c.%c%c", buffer[1], buffer[2], buffer[3]);
+	}
+}
+
+static void
+get_version(char *version)
+//----------------------------------------------------------------------
+// Ask a switch for its version
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+	moas_ctx *sw;
+
+	strcpy(version, "unknown");
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = version_write;
+	sw = moas_create(&callbacks, version);
+	if (sw != NULL) {
+		moas_feed_ctx(sw, ":;", 2);
+		moas_destroy(sw);
+	}
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+//----------------------------------------------------------------------
+// Order times for the median
+//----------------------------------------------------------------------
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int
+run_benchmark(const benchmark *bm, double seconds, int repeats,
+	int csv, const char *version)
+//----------------------------------------------------------------------
+// Time one benchmark and print the result
+//----------------------------------------------------------------------
+{
+	static char input[INPUT_LEN];
+	moas_callbacks callbacks;
+	bench_state b;
+	double times[MAX_REPEATS];
+	double start;
+	double elapsed;
+	double median;
+	long ops;
+	int r;
+
+	memset(&b, 0, sizeof(b));
+	b.input = input;
+	b.seed = 1;
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = bench_write;
+	callbacks.relays_changed = bench_relays;
+	callbacks.antennas_changed = bench_antennas;
+
+	b.sw = moas_create(&callbacks, &b);
+	if (b.sw == NULL) {
+		fprintf(stderr, "moas_bench: no memory\n");
+		return FALSE;
+	}
+	if (!bm->setup(&b) || (b.items == 0)) {
+		fprintf(stderr, "moas_bench: %s could not be set up\n", bm->name);
+		if (bm->finish) {
+			bm->finish(&b);
+		}
+		moas_destroy(b.sw);
+		return FALSE;
+	}
+
+	// Find how many operations fill a repeat
+	ops = 1;
+	for (;;) {
+		start = now();
+		bm->run(&b, ops);
+		elapsed = now() - start;
+		if ((elapsed >= seconds) || (ops >= 1L << 30)) {
+			break;
+		}
+		if (elapsed < seconds / 100) {
+			ops *= 10;
+		}
+		else {
+			ops = (long)(ops * seconds / elapsed * 1.1) + 1;
+		}
+	}
+
+	for (r=0; r<repeats; r++) {
+		start = now();
+		bm->run(&b, ops);
+		times[r] = (now() - start) / ((double)ops * b.items);
+	}
+	qsort(times, repeats, sizeof(times[0]), compare_doubles);
+	median = times[repeats / 2];
+
+	if (csv) {
+		printf("%s,%s,%ld,%.2f,%.2f,%.0f,%.0f\n",
+			   bm->name, version, ops * b.items,
+			   median * 1e9, times[0] * 1e9, 1.0 / median,
+			   b.input_len ? b.input_len / (median * b.items) : 0.0);
+	}
+	else {
+		printf("{\"name\":\"%s\",\"version\":\"%s\",\"items\":%ld,"
+			   "\"ns_per_item\":%.2f,\"ns_per_item_min\":%.2f,"
+			   "\"items_per_sec\":%.0f,\"bytes_per_sec\":%.0f}\n",
+			   bm->name, version, ops * b.items,
+			   median * 1e9, times[0] * 1e9, 1.0 / median,
+			   b.input_len ? b.input_len / (median * b.items) : 0.0);
+	}
+	fflush(stdout);
+
+	if (bm->finish) {
+		bm->finish(&b);
+	}
+	moas_destroy(b.sw);
+	return TRUE;
+}
+
+static void
+usage(void)
+//----------------------------------------------------------------------
+// Describe the arguments and exit
+//----------------------------------------------------------------------
+{
+	int i;
+
+	fprintf(stderr, "usage: moas_bench [-f json|csv] [-t seconds] "
+			"[-r repeats] [name ...]\n");
+	fprintf(stderr, "benchmarks:");
+	for (i=0; i<BENCHMARKS; i++) {
+		fprintf(stderr, " %s", benchmarks[i].name);
+	}
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Run the chosen benchmarks
+//----------------------------------------------------------------------
+{
+	char version[16];
+	double seconds = 0.2;
+	int repeats = 5;
+	int csv = FALSE;
+	int ok = TRUE;
+	int chosen;
+	int first;
+	int i;
+	int j;
+
+	for (i=1; (i < argc) && (argv[i][0] == '-'); i++) {
+		if ((strcmp(argv[i], "-f") == 0) && (i+1 < argc)) {
+			i++;
+			if (strcmp(argv[i], "csv") == 0) {
+				csv = TRUE;
+			}
+			else if (strcmp(argv[i], "json") != 0) {
+				usage();
+			}
+		}
+		else if ((strcmp(argv[i], "-t") == 0) && (i+1 < argc)) {
+			seconds = atof(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-r") == 0) && (i+1 < argc)) {
+			repeats = atoi(argv[++i]);
+		}
+		else {
+			usage();
+		}
+	}
+	if ((seconds <= 0) || (repeats < 1) || (repeats > MAX_REPEATS)) {
+		usage();
+	}
+	first = i;
+
+	get_version(version);
+
+	if (csv) {
+		printf("name,version,items,ns_per_item,ns_per_item_min,"
+			   "items_per_sec,bytes_per_sec\n");
+	}
+
+	for (i=0; i<BENCHMARKS; i++) {
+		chosen = (first == argc);
+		for (j=first; j<argc; j++) {
+			if (strncmp(benchmarks[i].name, argv[j], strlen(argv[j])) == 0) {
+				chosen = TRUE;
+			}
+		}
+		if (chosen && !run_benchmark(&benchmarks[i], seconds, repeats,
+									 csv, version)) {
+			ok = FALSE;
+		}
+	}
+
+	return ok ? 0 : 1;
+}
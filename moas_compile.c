@@ -0,0 +1,149 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - configuration image compiler
+//
+// This compiles a site description or a log of commands into a
+// configuration image which hosts load straight into a switch.  See
+// moas_config.h for the text.
+//
+//    moas_compile -o image [file]
+//    moas_compile -c image
+//
+//    -o image  Image to write
+//    -c image  Check that an image can be loaded
+//
+// The text is read from the file or standard input.  Lines which are
+// wrong are reported and no image is written.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "moas.h"
+#include "moas_config.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+#define READ_LEN 65536
+
+static void
+usage(void)
+//----------------------------------------------------------------------
+// Describe the arguments and exit
+//----------------------------------------------------------------------
+{
+	fprintf(stderr, "usage: moas_compile -o image [file]\n"
+			"       moas_compile -c image\n");
+	exit(2);
+}
+
+static void
+compile_error(void *user, int line, const char *message)
+//----------------------------------------------------------------------
+// Report a line which is wrong
+//----------------------------------------------------------------------
+{
+	fprintf(stderr, "%s:%d: %s\n", (const char *)user, line, message);
+}
+
+static int
+check(const char *path)
+//----------------------------------------------------------------------
+// Load an image into a switch
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+	moas_ctx *sw;
+	int ok;
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	sw = moas_create(&callbacks, NULL);
+	if (sw == NULL) {
+		fprintf(stderr, "moas_compile: no memory\n");
+		return 1;
+	}
+	ok = moas_config_load(sw, path);
+	moas_destroy(sw);
+
+	if (!ok) {
+		fprintf(stderr, "moas_compile: %s is not a configuration image\n",
+				path);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Compile text into an image
+//----------------------------------------------------------------------
+{
+	unsigned char image[MOAS_CONFIG_LEN];
+	const char *output = NULL;
+	const char *name = "<stdin>";
+	char *text = NULL;
+	size_t len = 0;
+	size_t n;
+	FILE *in = stdin;
+	int errors;
+	int i;
+
+	for (i=1; (i < argc) && (argv[i][0] == '-') && argv[i][1]; i++) {
+		if ((strcmp(argv[i], "-o") == 0) && (i+1 < argc)) {
+			output = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-c") == 0) && (i+2 == argc)) {
+			return check(argv[i+1]);
+		}
+		else {
+			usage();
+		}
+	}
+	if ((output == NULL) || (i < argc - 1)) {
+		usage();
+	}
+	if (i == argc - 1) {
+		name = argv[i];
+		in = fopen(name, "rb");
+		if (in == NULL) {
+			perror(name);
+			return 1;
+		}
+	}
+
+	// Read all of the text
+	for (;;) {
+		text = (char *)realloc(text, len + READ_LEN);
+		if (text == NULL) {
+			fprintf(stderr, "moas_compile: no memory\n");
+			return 1;
+		}
+		n = fread(text + len, 1, READ_LEN, in);
+		len += n;
+		if (n < READ_LEN) {
+			break;
+		}
+	}
+	if (in != stdin) {
+		fclose(in);
+	}
+
+	errors = moas_config_compile(text, len, image, compile_error,
+								 (void *)name);
+	free(text);
+	if (errors) {
+		fprintf(stderr, "moas_compile: %d error%s, no image written\n",
+				errors, errors == 1 ? "" : "s");
+		return 1;
+	}
+
+	if (!moas_config_write(output, image)) {
+		perror(output);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,378 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator configuration images
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "moas_config.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// The most words on a site description line
+#define MAX_WORDS 80
+
+// Room for the longest command made from a site description line
+#define COMMAND_LEN 80
+
+// The longest delay a timer command can give, in milliseconds
+#define MAX_DELAY 262143
+
+static const char sixbit[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz{}";
+
+// Everything used while compiling
+typedef struct compiler {
+	moas_ctx *sw;
+
+	// TRUE if the switch rejected a command since this was cleared
+	int rejected;
+
+	void (*error)(void *user, int line, const char *message);
+	void *user;
+	int errors;
+} compiler;
+
+int moas_config_read(const char *path, unsigned char *image)
+//----------------------------------------------------------------------
+// Read an image file
+//----------------------------------------------------------------------
+{
+	FILE *file;
+	size_t n;
+	int extra;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		return FALSE;
+	}
+
+	n = fread(image, 1, MOAS_CONFIG_LEN, file);
+	extra = fgetc(file);
+	fclose(file);
+
+	return (n == MOAS_CONFIG_LEN) && (extra == EOF);
+}
+
+int moas_config_write(const char *path, const unsigned char *image)
+//----------------------------------------------------------------------
+// Write an image file
+//----------------------------------------------------------------------
+{
+	FILE *file;
+	int ok;
+
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		return FALSE;
+	}
+
+	ok = (fwrite(image, 1, MOAS_CONFIG_LEN, file) == MOAS_CONFIG_LEN);
+	if (fclose(file) != 0) {
+		ok = FALSE;
+	}
+	return ok;
+}
+
+int moas_config_load(moas_ctx *ctx, const char *path)
+//----------------------------------------------------------------------
+// Read an image file and load it into a switch
+//----------------------------------------------------------------------
+{
+	unsigned char image[MOAS_CONFIG_LEN];
+
+	return moas_config_read(path, image) &&
+		   moas_load_config_ctx(ctx, image, MOAS_CONFIG_LEN);
+}
+
+static void
+compiler_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Watch the replies for rejected commands
+//----------------------------------------------------------------------
+{
+	compiler *c = (compiler *)user;
+
+	if (strchr(buffer, '?')) {
+		c->rejected = TRUE;
+	}
+}
+
+static void
+report(compiler *c, int line, const char *message)
+//----------------------------------------------------------------------
+// Count and report a line which is wrong
+//----------------------------------------------------------------------
+{
+	c->errors++;
+	if (c->error) {
+		c->error(c->user, line, message);
+	}
+}
+
+static int
+number(const char *word, int low, int high)
+//----------------------------------------------------------------------
+// Convert a word to a number.  Returns -1 if it is not a number from
+// low to high.
+//----------------------------------------------------------------------
+{
+	char *end;
+	long n;
+
+	n = strtol(word, &end, 10);
+	if ((end == word) || (*end != '\0') || (n < low) || (n > high)) {
+		return -1;
+	}
+	return (int)n;
+}
+
+static const char *
+site_line(compiler *c, char **words, int count)
+//----------------------------------------------------------------------
+// Give a site description line to the switch as commands.  Returns
+// NULL or what is wrong with the line.
+//----------------------------------------------------------------------
+{
+	char cmd[COMMAND_LEN];
+	const char *name = words[0];
+	int first;
+	int n;
+	int len;
+	int i;
+
+	if ((strcmp(name, "conflict") == 0) || (strcmp(name, "fast") == 0)) {
+		if (count < 3) {
+			return "an antenna and the antennas it goes with are needed";
+		}
+		first = number(words[1], 0, MOAS_ANTENNAS-1);
+		if (first < 0) {
+			return "bad antenna";
+		}
+		for (i=2; i<count; i++) {
+			n = number(words[i], 0, MOAS_ANTENNAS-1);
+			if (n < 0) {
+				return "bad antenna";
+			}
+			sprintf(cmd, "%s%c%c;", name[0] == 'c' ? "%C" : "&F",
+					sixbit[first], sixbit[n]);
+			moas_feed_ctx(c->sw, cmd, strlen(cmd));
+		}
+		return NULL;
+	}
+
+	if (strcmp(name, "system") == 0) {
+		if (count < 3) {
+			return "a system and its antennas are needed";
+		}
+		first = number(words[1], 1, MOAS_ANTENNAS-1);
+		if (first < 0) {
+			return "bad antenna system";
+		}
+		for (i=2; i<count; i++) {
+			n = number(words[i], 0, MOAS_ANTENNAS-1);
+			if (n < 0) {
+				return "bad antenna";
+			}
+			sprintf(cmd, "_S%c%c;", sixbit[n], sixbit[first]);
+			moas_feed_ctx(c->sw, cmd, strlen(cmd));
+		}
+		return NULL;
+	}
+
+	if (strcmp(name, "global") == 0) {
+		if (count > MOAS_RELAYS + 1) {
+			return "too many relays";
+		}
+
+		// Station 0 ignores the kind and antenna
+		strcpy(cmd, "!0B0");
+		len = 4;
+		for (i=1; i<count; i++) {
+			n = number(words[i], 0, MOAS_RELAYS-1);
+			if (n < 0) {
+				return "bad relay";
+			}
+			cmd[len++] = sixbit[n];
+		}
+		cmd[len++] = ';';
+		moas_feed_ctx(c->sw, cmd, len);
+		return NULL;
+	}
+
+	if ((strcmp(name, "inhibit_time") == 0) ||
+		(strcmp(name, "receive_delay") == 0) ||
+		(strcmp(name, "interrupt_delay") == 0)) {
+		if (count < 2) {
+			return "a delay is needed";
+		}
+		n = number(words[1], 0, MAX_DELAY);
+		if (n < 0) {
+			return "bad delay";
+		}
+
+		if (name[0] == 'r') {
+			strcpy(cmd, "\\0");
+		}
+		else {
+			strcpy(cmd, name[2] == 'h' ? "[0" : "]0");
+		}
+		cmd[2] = sixbit[n >> 12];
+		cmd[3] = sixbit[(n >> 6) & 63];
+		cmd[4] = sixbit[n & 63];
+		cmd[5] = ';';
+
+		// Station 0 is every station
+		if (count == 2) {
+			moas_feed_ctx(c->sw, cmd, 6);
+		}
+		for (i=2; i<count; i++) {
+			n = number(words[i], 1, MOAS_STATIONS);
+			if (n < 0) {
+				return "bad station";
+			}
+			cmd[1] = (char)('0' + n);
+			moas_feed_ctx(c->sw, cmd, 6);
+		}
+		return NULL;
+	}
+
+	// The rest are lists of stations
+	if (strcmp(name, "polarity") == 0) {
+		strcpy(cmd, "^E");
+	}
+	else if (strcmp(name, "inhibit_type") == 0) {
+		strcpy(cmd, "=T");
+	}
+	else if (strcmp(name, "cross_inhibit") == 0) {
+		strcpy(cmd, "~");
+	}
+	else if (strcmp(name, "alternate") == 0) {
+		strcpy(cmd, "@");
+	}
+	else if (strcmp(name, "wait") == 0) {
+		strcpy(cmd, "/W");
+	}
+	else if (strcmp(name, "inhibit_mode") == 0) {
+		strcpy(cmd, "/I");
+	}
+	else {
+		return "unknown site description line";
+	}
+
+	if ((cmd[0] == '~') || (cmd[0] == '@')) {
+		if (count < 2) {
+			return "a station is needed";
+		}
+	}
+	if (count > MOAS_STATIONS + 1) {
+		return "too many stations";
+	}
+
+	len = (int)strlen(cmd);
+	for (i=1; i<count; i++) {
+		n = number(words[i], 1, MOAS_STATIONS);
+		if (n < 0) {
+			return "bad station";
+		}
+		cmd[len++] = (char)('0' + n);
+	}
+	cmd[len++] = ';';
+	moas_feed_ctx(c->sw, cmd, len);
+	return NULL;
+}
+
+int moas_config_compile(const char *text, size_t len, unsigned char *image,
+	void (*error)(void *user, int line, const char *message), void *user)
+//----------------------------------------------------------------------
+// Compile text into an image by giving it to a switch
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+	compiler c;
+	char buffer[512];
+	char *words[MAX_WORDS];
+	const char *message;
+	const char *end = text + len;
+	const char *next;
+	size_t n;
+	int count;
+	int line;
+	char *p;
+
+	memset(&c, 0, sizeof(c));
+	c.error = error;
+	c.user = user;
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = compiler_write;
+	c.sw = moas_create(&callbacks, &c);
+	if (c.sw == NULL) {
+		report(&c, 0, "no memory");
+		return c.errors;
+	}
+
+	for (line=1; text < end; line++, text = next) {
+		next = (const char *)memchr(text, '\n', end - text);
+		n = next ? (size_t)(next - text) : (size_t)(end - text);
+		next = next ? next + 1 : end;
+
+		// Comments
+		if ((n > 0) && (text[0] == '#') && !memchr(text, ';', n)) {
+			continue;
+		}
+
+		c.rejected = FALSE;
+
+		if ((n > 0) && (text[0] >= 'a') && (text[0] <= 'z')) {
+			if (n >= sizeof(buffer)) {
+				report(&c, line, "line is too long");
+				continue;
+			}
+			memcpy(buffer, text, n);
+			buffer[n] = '\0';
+
+			// Split the line into words
+			count = 0;
+			for (p=buffer; *p; ) {
+				if ((*p == ' ') || (*p == '\t') || (*p == '\r')) {
+					*p++ = '\0';
+					continue;
+				}
+				if (count == MAX_WORDS) {
+					break;
+				}
+				words[count++] = p;
+				while (*p && (*p != ' ') && (*p != '\t') && (*p != '\r')) {
+					p++;
+				}
+			}
+			if (*p) {
+				report(&c, line, "too many words");
+				continue;
+			}
+
+			message = site_line(&c, words, count);
+			if (message) {
+				report(&c, line, message);
+				continue;
+			}
+		}
+		else {
+			moas_feed_ctx(c.sw, text, n);
+		}
+
+		if (c.rejected) {
+			report(&c, line, "the switch rejected a command");
+		}
+	}
+
+	moas_save_config_ctx(c.sw, image);
+	moas_destroy(c.sw);
+	return c.errors;
+}
@@ -0,0 +1,92 @@
+//345678901234567890123456789012345678901234567890123456789012345678901234567890
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator configuration images
+//
+// These read and write configuration image files and compile them from
+// text.  The text can be a log of the commands a controlling program
+// sent, a site description, or a mixture of the two.  A line whose
+// first character is a lower case letter is a site description line.
+// A line starting with # and holding no semicolon is a comment.  Every
+// other line is given to a switch as commands.
+//
+// Antennas and relays are numbered from 0 to 63 and stations from 1 to
+// 6, all in decimal.  The site description lines are
+//
+//    conflict A B ...      Antenna A conflicts with each antenna B
+//    fast A B ...          Antenna A can be switched fast with each B
+//    system S A ...        Antennas A are part of antenna system S,
+//                          which is 1 to 63
+//    global R ...          Relays which are always set
+//    polarity S ...        Stations whose inhibit polarity is
+//                          reversed
+//    inhibit_type S ...    Stations which are only inhibited while
+//                          transmitting
+//    cross_inhibit S O ... Station S transmitting inhibits stations O
+//    alternate S O ...     Station S transmitting moves stations O to
+//                          their alternate antennas
+//    wait S ...            Stations in wait mode
+//    inhibit_mode S ...    Stations in inhibit mode
+//    inhibit_time MS S ... Stations S are inhibited for MS milliseconds
+//                          after their relays move
+//    receive_delay MS S ...  Stations S stay on their transmit relays
+//                          for MS milliseconds after transmitting
+//    interrupt_delay MS S ...  Stations S wait MS milliseconds for
+//                          stations in inhibit mode to stop
+//                          transmitting before changing antennas
+//
+// A delay is from 0 to 262143 milliseconds.  A delay line without
+// stations sets every station.
+
+#ifndef MOAS_CONFIG_H
+#define MOAS_CONFIG_H
+
+#include "moas.h"
+
+// Read a configuration image file
+// Routine:  moas_config_read
+//
+// Inputs:
+//    path    File to read
+//    image   Filled in with MOAS_CONFIG_LEN bytes
+// Outputs:
+//    Returns TRUE if the file was read and is the size of an image.
+//    The image is only checked when it is loaded.
+int moas_config_read(const char *path, unsigned char *image);
+
+// Write a configuration image file
+// Routine:  moas_config_write
+//
+// Inputs:
+//    path    File to write
+//    image   Image of MOAS_CONFIG_LEN bytes
+// Outputs:
+//    Returns TRUE if the file was written
+int moas_config_write(const char *path, const unsigned char *image);
+
+// Read a configuration image file and load it into a switch
+// Routine:  moas_config_load
+//
+// Inputs:
+//    ctx     Switch context
+//    path    File to read
+// Outputs:
+//    Returns TRUE if the image was read and loaded
+int moas_config_load(moas_ctx *ctx, const char *path);
+
+// Compile text into a configuration image
+// Routine:  moas_config_compile
+//
+// Inputs:
+//    text    Commands and site description lines
+//    len     Length of the text
+//    image   Filled in with MOAS_CONFIG_LEN bytes
+//    error   Called for each line which is wrong or which the switch
+//            rejected, or NULL
+//    user    Value passed to error
+// Outputs:
+//    Returns the number of lines which were wrong
+int moas_config_compile(const char *text, size_t len, unsigned char *image,
+	void (*error)(void *user, int line, const char *message), void *user);
+
+#endif
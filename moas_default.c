@@ -0,0 +1,92 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - single switch interface
+//
+// These are the original routines for emulating one switch.  They
+// use a default context which reports through the moas_callback_
+// routines defined by the program.
+
+#include "moas.h"
+
+#undef NULL
+#define NULL    0
+
+static moas_ctx *default_ctx;
+
+static void
+default_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Pass a status or event string to the program
+//----------------------------------------------------------------------
+{
+	moas_callback_write(buffer);
+}
+
+static void
+default_update(void *user, const int *relays, const int *inhibits)
+//----------------------------------------------------------------------
+// Pass the relays and inhibits to the program
+//----------------------------------------------------------------------
+{
+	moas_callback_update(relays, inhibits);
+}
+
+static void
+default_antennas(void *user, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Pass the actual antennas to the program
+//----------------------------------------------------------------------
+{
+	moas_callback_antennas(tx, rx);
+}
+
+void moas_initialize()
+//----------------------------------------------------------------------
+// Set up the initial state for the default switch
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+
+	if (default_ctx != NULL) {
+		moas_initialize_ctx(default_ctx);
+		return;
+	}
+
+	callbacks.write = default_write;
+	callbacks.update = default_update;
+	callbacks.antennas = default_antennas;
+	callbacks.relays_changed = NULL;
+	callbacks.antennas_changed = NULL;
+
+	default_ctx = moas_create(&callbacks, NULL);
+}
+
+void moas_character(char c)
+//----------------------------------------------------------------------
+// Give a character to the default switch
+//----------------------------------------------------------------------
+{
+	if (default_ctx != NULL) {
+		moas_character_ctx(default_ctx, c);
+	}
+}
+
+void moas_feed(const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Give a block of characters to the default switch
+//----------------------------------------------------------------------
+{
+	if (default_ctx != NULL) {
+		moas_feed_ctx(default_ctx, buffer, len);
+	}
+}
+
+void moas_txrx(int station, int state)
+//----------------------------------------------------------------------
+// Change the transmit/receive state of the default switch
+//----------------------------------------------------------------------
+{
+	if (default_ctx != NULL) {
+		moas_txrx_ctx(default_ctx, station, state);
+	}
+}
@@ -0,0 +1,380 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - command line driver
+//
+// This runs one emulated switch without a serial port.  Commands are
+// read from a file or standard input and everything the switch
+// produces is written to standard output.
+//
+//    moas_driver [-q] [-s] [-w trace] [-c image] [file]
+//
+//    -q        Only print replies and events, not relay and antenna
+//              changes
+//    -s        Print the switch's statistics at the end.  The switch
+//              only keeps them if it was built with MOAS_STATS.
+//    -w trace  Record a trace of the session for moas_replay
+//    -c image  Load a configuration image into the switch first
+//
+// The input is what would arrive on the serial port.  A line starting
+// with a dot is for the driver instead:
+//
+//    .tN       Station N transmits
+//    .rN       Station N receives
+//    .dN       N milliseconds pass
+//
+// The switch's timers only run during a .d line, so a session gives the
+// same output however fast it is read.  A trace is recorded on the same
+// time, so moas_replay runs the timers just as they ran here.
+//
+// Each batch of replies and events is printed on a line of its own.
+// Changes are printed as
+//
+//    relays <relays in hex> inhibits <inhibited stations in hex>
+//    antennas <tx>/<rx> ... for each station
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "moas.h"
+#include "moas_config.h"
+#include "moas_timer.h"
+#include "moas_trace.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+#define READ_LEN 65536
+
+// The longest driver line kept
+#define LINE_LEN 64
+
+typedef struct driver {
+	moas_ctx *sw;
+	int quiet;
+
+	// The switch's timers.  The time only moves on a .d line.
+	moas_wheel *wheel;
+
+	// Trace being recorded, or NULL
+	moas_trace *trace;
+
+	// TRUE at the start of a line
+	int line_start;
+
+	// Driver line being collected.  line_len is -1 when there is none.
+	char line[LINE_LEN];
+	int line_len;
+} driver;
+
+static void
+usage(void)
+//----------------------------------------------------------------------
+// Describe the arguments and exit
+//----------------------------------------------------------------------
+{
+	fprintf(stderr, "usage: moas_driver [-q] [-s] [-w trace] [-c image] [file]\n");
+	exit(2);
+}
+
+static unsigned long long
+driver_clock(void *user)
+//----------------------------------------------------------------------
+// The time of the switch's timers in nanoseconds, for the trace
+//----------------------------------------------------------------------
+{
+	driver *d = (driver *)user;
+
+	return moas_wheel_now(d->wheel) * 1000;
+}
+
+static void
+driver_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Print replies and events
+//----------------------------------------------------------------------
+{
+	driver *d = (driver *)user;
+
+	if (d->trace) {
+		moas_trace_write(d->trace, buffer);
+	}
+
+	fputs(buffer, stdout);
+	fputc('\n', stdout);
+}
+
+static void
+driver_relays(void *user, uint64_t changed, uint64_t relays,
+	int changed_inhibits, int inhibits)
+//----------------------------------------------------------------------
+// Print relay and inhibit changes
+//----------------------------------------------------------------------
+{
+	driver *d = (driver *)user;
+
+	if (d->trace) {
+		moas_trace_relays(d->trace, relays, inhibits);
+	}
+
+	if (!d->quiet) {
+		printf("relays %016llx inhibits %02x\n",
+			   (unsigned long long)relays, inhibits);
+	}
+}
+
+static void
+driver_antennas(void *user, int changed, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Print antenna changes
+//----------------------------------------------------------------------
+{
+	driver *d = (driver *)user;
+	int i;
+
+	if (d->trace) {
+		moas_trace_antennas(d->trace, tx, rx);
+	}
+
+	if (!d->quiet) {
+		printf("antennas");
+		for (i=0; i<MOAS_STATIONS; i++) {
+			printf(" %d/%d", tx[i], rx[i]);
+		}
+		printf("\n");
+	}
+}
+
+static void
+driver_line(driver *d)
+//----------------------------------------------------------------------
+// Carry out a driver line
+//----------------------------------------------------------------------
+{
+	int station;
+	long delay;
+
+	d->line[d->line_len] = '\0';
+
+	switch (d->line[0]) {
+	case 't':
+	case 'r':
+		station = atoi(d->line + 1);
+		if ((station < 1) || (station > MOAS_STATIONS)) {
+			fprintf(stderr, "moas_driver: bad station in .%s\n", d->line);
+			break;
+		}
+		if (d->trace) {
+			moas_trace_txrx(d->trace, station, d->line[0] == 't');
+		}
+		moas_txrx_ctx(d->sw, station, d->line[0] == 't');
+		break;
+
+	case 'd':
+		delay = atol(d->line + 1);
+		if (delay < 0) {
+			fprintf(stderr, "moas_driver: bad delay in .%s\n", d->line);
+			break;
+		}
+		moas_wheel_advance(d->wheel,
+						   moas_wheel_now(d->wheel) + (uint64_t)delay * 1000);
+		break;
+
+	case '\0':
+		break;
+
+	default:
+		fprintf(stderr, "moas_driver: unknown line .%s\n", d->line);
+		break;
+	}
+}
+
+static void
+driver_feed(driver *d, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Give input to the switch, picking out driver lines
+//----------------------------------------------------------------------
+{
+	const char *end = buffer + len;
+	const char *p;
+	const char *nl;
+
+	while (buffer < end) {
+
+		// Finish a driver line
+		if (d->line_len >= 0) {
+			for (p=buffer; (p < end) && (*p != '\n'); p++) {
+				if (d->line_len < LINE_LEN - 1) {
+					d->line[d->line_len++] = *p;
+				}
+			}
+			if (p == end) {
+				return;
+			}
+			driver_line(d);
+			d->line_len = -1;
+			d->line_start = TRUE;
+			buffer = p + 1;
+			continue;
+		}
+
+		if (d->line_start && (*buffer == '.')) {
+			d->line_len = 0;
+			buffer++;
+			continue;
+		}
+
+		// Everything up to the next line which could be a driver line
+		// goes to the switch in one piece
+		nl = (const char *)memchr(buffer, '\n', end - buffer);
+		p = nl ? nl + 1 : end;
+		if (d->trace) {
+			moas_trace_input(d->trace, buffer, p - buffer);
+		}
+		moas_feed_ctx(d->sw, buffer, p - buffer);
+		d->line_start = (nl != NULL);
+		buffer = p;
+	}
+}
+
+static void
+print_stats(driver *d)
+//----------------------------------------------------------------------
+// Print the switch's statistics
+//----------------------------------------------------------------------
+{
+	moas_stats stats;
+	char *text;
+	size_t len;
+
+	if (!moas_stats_ctx(d->sw, &stats)) {
+		printf("statistics are not built in\n");
+		return;
+	}
+
+	len = moas_format_stats(&stats, NULL, 0);
+	text = (char *)malloc(len + 1);
+	if (text == NULL) {
+		fprintf(stderr, "moas_driver: no memory\n");
+		return;
+	}
+	moas_format_stats(&stats, text, len + 1);
+	fputs(text, stdout);
+	free(text);
+}
+
+int main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Run the switch over the input
+//----------------------------------------------------------------------
+{
+	static char buffer[READ_LEN];
+	unsigned char image[MOAS_CONFIG_LEN];
+	moas_callbacks callbacks;
+	driver d;
+	FILE *in = stdin;
+	const char *trace_path = NULL;
+	const char *config = NULL;
+	int stats = FALSE;
+	size_t n;
+	int i;
+
+	memset(&d, 0, sizeof(d));
+	d.line_start = TRUE;
+	d.line_len = -1;
+
+	for (i=1; (i < argc) && (argv[i][0] == '-') && argv[i][1]; i++) {
+		if (strcmp(argv[i], "-q") == 0) {
+			d.quiet = TRUE;
+		}
+		else if (strcmp(argv[i], "-s") == 0) {
+			stats = TRUE;
+		}
+		else if ((strcmp(argv[i], "-w") == 0) && (i+1 < argc)) {
+			trace_path = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-c") == 0) && (i+1 < argc)) {
+			config = argv[++i];
+		}
+		else {
+			usage();
+		}
+	}
+	if (i < argc - 1) {
+		usage();
+	}
+	if (i == argc - 1) {
+		in = fopen(argv[i], "rb");
+		if (in == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+	}
+
+	if (trace_path) {
+		d.trace = moas_trace_create(trace_path);
+		if (d.trace == NULL) {
+			perror(trace_path);
+			return 1;
+		}
+	}
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = driver_write;
+	callbacks.relays_changed = driver_relays;
+	callbacks.antennas_changed = driver_antennas;
+
+	d.wheel = moas_wheel_create(NULL, NULL);
+	d.sw = moas_create(&callbacks, &d);
+	if ((d.wheel == NULL) || (d.sw == NULL)) {
+		fprintf(stderr, "moas_driver: no memory\n");
+		return 1;
+	}
+	moas_timers_ctx(d.sw, d.wheel);
+	if (d.trace) {
+		moas_trace_clock(d.trace, driver_clock, &d);
+	}
+	if (config) {
+		// The trace holds the image so a replay starts the same way
+		if (!moas_config_read(config, image)) {
+			fprintf(stderr, "moas_driver: %s is not a configuration image\n",
+					config);
+			return 1;
+		}
+		if (d.trace) {
+			moas_trace_config(d.trace, image, MOAS_CONFIG_LEN);
+		}
+		if (!moas_load_config_ctx(d.sw, image, MOAS_CONFIG_LEN)) {
+			fprintf(stderr, "moas_driver: %s is not a configuration image\n",
+					config);
+			return 1;
+		}
+	}
+
+	while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+		driver_feed(&d, buffer, n);
+	}
+
+	// A driver line without a newline at the very end still counts
+	if (d.line_len >= 0) {
+		driver_line(&d);
+	}
+
+	if (stats) {
+		print_stats(&d);
+	}
+
+	moas_destroy(d.sw);
+	moas_wheel_destroy(d.wheel);
+	if (d.trace && !moas_trace_close(d.trace)) {
+		perror(trace_path);
+		return 1;
+	}
+	if (in != stdin) {
+		fclose(in);
+	}
+	return 0;
+}
@@ -0,0 +1,573 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator switch farm
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "moas_farm.h"
+#include "moas_timer.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// Each switch has a queue of fixed size slots.  A slot holds either a
+// run of characters or a transmit/receive change.
+#define FARM_SLOTS      16
+#define FARM_SLOT_DATA  62
+
+#define SLOT_CHARACTERS 0
+#define SLOT_TXRX       1
+
+// Switches are handed to the workers in groups.  A group is the unit
+// which is claimed by a worker and which can be taken by another shard.
+#define FARM_GROUP      32
+
+// A worker which finds no work several times in a row sleeps briefly
+// instead of spinning.
+#define FARM_IDLE_SPINS 64
+#define FARM_IDLE_NS    50000
+
+#define FARM_CACHE_LINE 64
+
+typedef struct farm_slot {
+	unsigned char type;
+	unsigned char len;
+	char data[FARM_SLOT_DATA];
+} farm_slot;
+
+typedef struct farm_switch {
+	moas_ctx *ctx;
+
+	// The program adds at head and the worker removes at tail.  They
+	// are on separate cache lines because different threads write them.
+	unsigned head;
+	char pad_head[FARM_CACHE_LINE - sizeof(unsigned)];
+	unsigned tail;
+	char pad_tail[FARM_CACHE_LINE - sizeof(unsigned)];
+
+	farm_slot slots[FARM_SLOTS];
+} farm_switch;
+
+typedef struct farm_group {
+	// The timers of the switches in the group.  Only the worker running
+	// the group touches the wheel.
+	moas_wheel *wheel;
+
+	// When the group next needs to run for its timers, valid while
+	// timing is TRUE.  Written by the worker running the group and read
+	// by the others.
+	unsigned long long due;
+
+	// TRUE while a worker is running the group
+	int busy;
+
+	// Set by the program after queuing input for a switch in the group
+	// and cleared by the worker before it empties the queues.
+	int pending;
+
+	int timing;
+
+	char pad[FARM_CACHE_LINE - sizeof(moas_wheel *) -
+			 sizeof(unsigned long long) - 3*sizeof(int)];
+} farm_group;
+
+typedef struct farm_shard {
+	moas_farm *farm;
+	int number;
+
+	// The groups owned by this shard
+	int first_group;
+	int last_group;
+
+	pthread_t thread;
+
+	// Only the worker for this shard writes its counters
+	moas_farm_counters counters;
+	char pad[FARM_CACHE_LINE];
+} farm_shard;
+
+struct moas_farm {
+	int switch_count;
+	int group_count;
+	int shard_count;
+
+	int running;
+	int stopping;
+
+	// Clock for the timers in microseconds
+	moas_clock clock;
+	void *clock_user;
+
+	farm_switch *switches;
+	farm_group *groups;
+	farm_shard *shards;
+};
+
+static void
+count(unsigned long long *counter, unsigned long long n)
+//----------------------------------------------------------------------
+// Add to a counter which is read by other threads
+//----------------------------------------------------------------------
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+monotonic_clock(void *user)
+//----------------------------------------------------------------------
+// The default clock for the timers
+//----------------------------------------------------------------------
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+run_switch(farm_shard *shard, farm_switch *sw)
+//----------------------------------------------------------------------
+// Give a switch everything in its queue.  Returns the number of slots.
+//----------------------------------------------------------------------
+{
+	unsigned head = __atomic_load_n(&sw->head, __ATOMIC_ACQUIRE);
+	unsigned tail = sw->tail;
+	int slots = 0;
+
+	while (tail != head) {
+		farm_slot *slot = &sw->slots[tail % FARM_SLOTS];
+
+		if (slot->type == SLOT_TXRX) {
+			moas_txrx_ctx(sw->ctx, slot->data[0], slot->data[1]);
+			count(&shard->counters.txrx, 1);
+		}
+		else {
+			moas_feed_ctx(sw->ctx, slot->data, slot->len);
+			count(&shard->counters.bytes, slot->len);
+		}
+
+		tail++;
+		slots++;
+	}
+
+	__atomic_store_n(&sw->tail, tail, __ATOMIC_RELEASE);
+	return slots;
+}
+
+static int
+run_group(farm_shard *shard, int group, uint64_t now)
+//----------------------------------------------------------------------
+// Run the switches in a group if it has input or timers which are due
+// and no other worker has it.  Returns the number of slots processed
+// and timers expired.
+//----------------------------------------------------------------------
+{
+	moas_farm *farm = shard->farm;
+	farm_group *grp = &farm->groups[group];
+	int first = group * FARM_GROUP;
+	int last = first + FARM_GROUP;
+	int slots = 0;
+	int timers;
+	uint64_t due;
+	int i;
+
+	if (!__atomic_load_n(&grp->pending, __ATOMIC_RELAXED) &&
+		!(__atomic_load_n(&grp->timing, __ATOMIC_RELAXED) &&
+		  (__atomic_load_n(&grp->due, __ATOMIC_RELAXED) <= now))) {
+		return 0;
+	}
+
+	if (__atomic_exchange_n(&grp->busy, TRUE, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	// Bring the time up to date before the input so timers the input
+	// starts are measured from now.
+	timers = moas_wheel_advance(grp->wheel, now);
+
+	// Clear the pending flag before looking at the queues so input
+	// added while the group is running is not missed.
+	if (__atomic_exchange_n(&grp->pending, FALSE, __ATOMIC_ACQ_REL)) {
+		if (last > farm->switch_count) {
+			last = farm->switch_count;
+		}
+		for (i=first; i<last; i++) {
+			slots += run_switch(shard, &farm->switches[i]);
+		}
+	}
+
+	__atomic_store_n(&grp->timing, moas_wheel_next(grp->wheel, &due),
+					 __ATOMIC_RELAXED);
+	__atomic_store_n(&grp->due, due, __ATOMIC_RELAXED);
+	__atomic_store_n(&grp->busy, FALSE, __ATOMIC_RELEASE);
+
+	if (slots) {
+		count(&shard->counters.batches, slots);
+	}
+	if (timers) {
+		count(&shard->counters.timers, timers);
+	}
+	return slots + timers;
+}
+
+static void *
+worker(void *arg)
+//----------------------------------------------------------------------
+// Worker thread for one shard
+//----------------------------------------------------------------------
+{
+	farm_shard *shard = (farm_shard *)arg;
+	moas_farm *farm = shard->farm;
+	struct timespec nap;
+	uint64_t now;
+	int stopping;
+	int idle = 0;
+	int work;
+	int other;
+	int slots;
+	int group;
+	int i;
+
+	nap.tv_sec = 0;
+	nap.tv_nsec = FARM_IDLE_NS;
+
+	while (1) {
+		// Anything queued before the stop was asked for is seen by
+		// the pass which follows.
+		stopping = __atomic_load_n(&farm->stopping, __ATOMIC_ACQUIRE);
+
+		// One look at the clock does for the whole pass
+		now = farm->clock(farm->clock_user);
+
+		// Run our own shard first
+		work = 0;
+		for (group=shard->first_group; group<shard->last_group; group++) {
+			work += run_group(shard, group, now);
+		}
+
+		// If there was nothing to do help the other shards, starting
+		// with the next one so the helpers spread out.
+		if (!work) {
+			for (i=1; i<farm->shard_count; i++) {
+				other = (shard->number + i) % farm->shard_count;
+				for (group=farm->shards[other].first_group;
+					 group<farm->shards[other].last_group; group++) {
+					slots = run_group(shard, group, now);
+					if (slots) {
+						count(&shard->counters.steals, 1);
+						work += slots;
+					}
+				}
+			}
+		}
+
+		if (work) {
+			idle = 0;
+			continue;
+		}
+
+		count(&shard->counters.idle, 1);
+
+		// Everything queued before the stop has been processed.  Timers
+		// still running wait for the next start.
+		if (stopping) {
+			break;
+		}
+
+		if (++idle < FARM_IDLE_SPINS) {
+			sched_yield();
+		}
+		else {
+			nanosleep(&nap, NULL);
+		}
+	}
+	return NULL;
+}
+
+moas_farm *moas_farm_create(int switches, int shards,
+	const moas_callbacks *callbacks, void **users)
+//----------------------------------------------------------------------
+// Create a farm of switches
+//----------------------------------------------------------------------
+{
+	moas_farm *farm;
+	int groups_per_shard;
+	int extra;
+	int group;
+	int i;
+
+	if ((switches <= 0) || (shards <= 0)) {
+		return NULL;
+	}
+
+	farm = (moas_farm *)calloc(1, sizeof(moas_farm));
+	if (farm == NULL) {
+		return NULL;
+	}
+
+	farm->switch_count = switches;
+	farm->group_count = (switches + FARM_GROUP - 1) / FARM_GROUP;
+	farm->shard_count = shards;
+
+	farm->switches = (farm_switch *)calloc(switches, sizeof(farm_switch));
+	farm->groups = (farm_group *)calloc(farm->group_count, sizeof(farm_group));
+	farm->shards = (farm_shard *)calloc(shards, sizeof(farm_shard));
+	if ((farm->switches == NULL) || (farm->groups == NULL) ||
+		(farm->shards == NULL)) {
+		moas_farm_destroy(farm);
+		return NULL;
+	}
+
+	for (i=0; i<switches; i++) {
+		farm->switches[i].ctx = moas_create(callbacks, users ? users[i] : NULL);
+		if (farm->switches[i].ctx == NULL) {
+			moas_farm_destroy(farm);
+			return NULL;
+		}
+	}
+
+	if (!moas_farm_clock(farm, monotonic_clock, NULL)) {
+		moas_farm_destroy(farm);
+		return NULL;
+	}
+
+	// Spread the groups over the shards as evenly as possible
+	groups_per_shard = farm->group_count / shards;
+	extra = farm->group_count % shards;
+	group = 0;
+	for (i=0; i<shards; i++) {
+		farm->shards[i].farm = farm;
+		farm->shards[i].number = i;
+		farm->shards[i].first_group = group;
+		group += groups_per_shard + (i < extra);
+		farm->shards[i].last_group = group;
+	}
+
+	return farm;
+}
+
+void moas_farm_destroy(moas_farm *farm)
+//----------------------------------------------------------------------
+// Stop and free a farm
+//----------------------------------------------------------------------
+{
+	int i;
+
+	if (farm == NULL) {
+		return;
+	}
+
+	moas_farm_stop(farm);
+
+	// The switches stop their timers so they go before the wheels
+	if (farm->switches) {
+		for (i=0; i<farm->switch_count; i++) {
+			moas_destroy(farm->switches[i].ctx);
+		}
+	}
+	if (farm->groups) {
+		for (i=0; i<farm->group_count; i++) {
+			moas_wheel_destroy(farm->groups[i].wheel);
+		}
+	}
+	free(farm->switches);
+	free(farm->groups);
+	free(farm->shards);
+	free(farm);
+}
+
+int moas_farm_start(moas_farm *farm)
+//----------------------------------------------------------------------
+// Start a worker for each shard
+//----------------------------------------------------------------------
+{
+	int i;
+
+	if (farm->running) {
+		return TRUE;
+	}
+
+	farm->stopping = FALSE;
+
+	for (i=0; i<farm->shard_count; i++) {
+		if (pthread_create(&farm->shards[i].thread, NULL, worker,
+						   &farm->shards[i])) {
+			// Stop the ones which did start
+			__atomic_store_n(&farm->stopping, TRUE, __ATOMIC_RELEASE);
+			while (i--) {
+				pthread_join(farm->shards[i].thread, NULL);
+			}
+			return FALSE;
+		}
+	}
+
+	farm->running = TRUE;
+	return TRUE;
+}
+
+void moas_farm_stop(moas_farm *farm)
+//----------------------------------------------------------------------
+// Stop the workers once the queues are empty
+//----------------------------------------------------------------------
+{
+	int i;
+
+	if (!farm->running) {
+		return;
+	}
+
+	__atomic_store_n(&farm->stopping, TRUE, __ATOMIC_RELEASE);
+	for (i=0; i<farm->shard_count; i++) {
+		pthread_join(farm->shards[i].thread, NULL);
+	}
+	farm->running = FALSE;
+}
+
+int moas_farm_clock(moas_farm *farm, moas_clock clock, void *user)
+//----------------------------------------------------------------------
+// Change the clock the timers are measured with
+//----------------------------------------------------------------------
+{
+	moas_wheel *wheel;
+	uint64_t now;
+	int group;
+	int i;
+
+	if (farm->running) {
+		return FALSE;
+	}
+
+	farm->clock = clock ? clock : monotonic_clock;
+	farm->clock_user = clock ? user : NULL;
+	now = farm->clock(farm->clock_user);
+
+	// Times on the old clock mean nothing on the new one, so each group
+	// gets a new wheel.  Its time is moved by the workers, which read
+	// the clock once for every group they look at.
+	for (group=0; group<farm->group_count; group++) {
+		wheel = moas_wheel_create(NULL, NULL);
+		if (wheel == NULL) {
+			return FALSE;
+		}
+		moas_wheel_advance(wheel, now);
+
+		for (i=group * FARM_GROUP;
+			 (i < (group+1) * FARM_GROUP) && (i < farm->switch_count); i++) {
+			moas_timers_ctx(farm->switches[i].ctx, NULL);
+			moas_timers_ctx(farm->switches[i].ctx, wheel);
+		}
+		moas_wheel_destroy(farm->groups[group].wheel);
+		farm->groups[group].wheel = wheel;
+		farm->groups[group].timing = FALSE;
+	}
+	return TRUE;
+}
+
+static int
+queue_slots(moas_farm *farm, int sw, int type, const char *data, int len)
+//----------------------------------------------------------------------
+// Put data into as many queue slots for a switch as it needs
+//----------------------------------------------------------------------
+{
+	farm_switch *s = &farm->switches[sw];
+	unsigned tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+	unsigned head = s->head;
+	int needed = (len + FARM_SLOT_DATA - 1) / FARM_SLOT_DATA;
+	int n;
+
+	if (needed == 0) {
+		return TRUE;
+	}
+	if ((int)(FARM_SLOTS - (head - tail)) < needed) {
+		return FALSE;
+	}
+
+	while (len) {
+		farm_slot *slot = &s->slots[head % FARM_SLOTS];
+
+		n = (len < FARM_SLOT_DATA) ? len : FARM_SLOT_DATA;
+		slot->type = (unsigned char)type;
+		slot->len = (unsigned char)n;
+		memcpy(slot->data, data, n);
+
+		data += n;
+		len -= n;
+		head++;
+	}
+
+	// Publish the slots and then tell the workers about them
+	__atomic_store_n(&s->head, head, __ATOMIC_RELEASE);
+	__atomic_store_n(&farm->groups[sw / FARM_GROUP].pending, TRUE,
+					 __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+int moas_farm_feed(moas_farm *farm, int sw, const char *buffer, int len)
+//----------------------------------------------------------------------
+// Queue characters for a switch
+//----------------------------------------------------------------------
+{
+	if ((sw < 0) || (sw >= farm->switch_count) || (len < 0)) {
+		return FALSE;
+	}
+	return queue_slots(farm, sw, SLOT_CHARACTERS, buffer, len);
+}
+
+int moas_farm_txrx(moas_farm *farm, int sw, int station, int state)
+//----------------------------------------------------------------------
+// Queue a transmit/receive change for a switch
+//----------------------------------------------------------------------
+{
+	char data[2];
+
+	if ((sw < 0) || (sw >= farm->switch_count) ||
+		(station < 1) || (station > MOAS_STATIONS)) {
+		return FALSE;
+	}
+
+	data[0] = (char)station;
+	data[1] = (char)(state != 0);
+	return queue_slots(farm, sw, SLOT_TXRX, data, sizeof(data));
+}
+
+moas_ctx *moas_farm_switch(moas_farm *farm, int sw)
+//----------------------------------------------------------------------
+// Get the context of a switch
+//----------------------------------------------------------------------
+{
+	if ((sw < 0) || (sw >= farm->switch_count)) {
+		return NULL;
+	}
+	return farm->switches[sw].ctx;
+}
+
+int moas_farm_shards(moas_farm *farm)
+//----------------------------------------------------------------------
+// Get the number of shards
+//----------------------------------------------------------------------
+{
+	return farm->shard_count;
+}
+
+void moas_farm_read_counters(moas_farm *farm, int shard,
+	moas_farm_counters *counters)
+//----------------------------------------------------------------------
+// Read the counters for a shard
+//----------------------------------------------------------------------
+{
+	moas_farm_counters *c = &farm->shards[shard].counters;
+
+	counters->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+	counters->txrx = __atomic_load_n(&c->txrx, __ATOMIC_RELAXED);
+	counters->batches = __atomic_load_n(&c->batches, __ATOMIC_RELAXED);
+	counters->steals = __atomic_load_n(&c->steals, __ATOMIC_RELAXED);
+	counters->idle = __atomic_load_n(&c->idle, __ATOMIC_RELAXED);
+	counters->timers = __atomic_load_n(&c->timers, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,155 @@
+//345678901234567890123456789012345678901234567890123456789012345678901234567890
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator switch farm
+//
+// A farm holds many independent emulated switches and runs them on a
+// pool of worker threads.  The switches are divided into shards and
+// each worker owns one shard, so a switch is only ever touched by the
+// worker currently running it and the switch state needs no locks.  A
+// worker which finds nothing to do in its own shard takes queued work
+// from the other shards.
+//
+// Input for each switch is queued by the program and the workers hand
+// it to the switch.  The queue for one switch must only be filled by
+// one thread at a time.  The switch callbacks are called on the worker
+// threads, never at the same time for the same switch.
+//
+// The switches in a group share a timing wheel which the workers run
+// along with the queues.  A group with no input waiting is run when its
+// first timer is due.
+//
+// The farm uses POSIX threads.
+
+#ifndef MOAS_FARM_H
+#define MOAS_FARM_H
+
+#include "moas.h"
+#include "moas_timer.h"
+
+typedef struct moas_farm moas_farm;
+
+// These are the throughput counters kept for each shard.  The work is
+// counted against the shard of the worker which did it.
+typedef struct moas_farm_counters {
+	unsigned long long bytes;     // Characters given to switches
+	unsigned long long txrx;      // Transmit/receive changes given to switches
+	unsigned long long batches;   // Queued inputs processed
+	unsigned long long steals;    // Groups of switches run for another shard
+	unsigned long long idle;      // Passes which found no work at all
+	unsigned long long timers;    // Switch timers which expired
+} moas_farm_counters;
+
+// Create a farm.  The switches are created and initialized but no
+// worker is running.
+// Routine:  moas_farm_create
+//
+// Inputs:
+//    switches  Number of switches
+//    shards    Number of shards and worker threads
+//    callbacks Routines used by every switch to report to the program
+//    users     Array of user values, one for each switch, or NULL to
+//              give every switch a NULL user value
+// Outputs:
+//    Returns the new farm or NULL if there is no memory
+moas_farm *moas_farm_create(int switches, int shards,
+	const moas_callbacks *callbacks, void **users);
+
+// Destroy a farm.  The workers are stopped first if they are running.
+// Routine:  moas_farm_destroy
+//
+// Inputs:
+//    farm    Farm to destroy
+void moas_farm_destroy(moas_farm *farm);
+
+// Set the clock the switch timers are measured with.  This must be done
+// while the workers are stopped.  Timers running on the old clock
+// expire at once.  A farm starts with a monotonic clock.
+// Routine:  moas_farm_clock
+//
+// Inputs:
+//    farm    Farm
+//    clock   Routine to read the time in microseconds, or NULL for the
+//            monotonic clock
+//    user    Value passed to clock
+// Outputs:
+//    Returns TRUE if the clock was changed, FALSE if the workers are
+//    running or there is no memory
+int moas_farm_clock(moas_farm *farm, moas_clock clock, void *user);
+
+// Start the worker threads
+// Routine:  moas_farm_start
+//
+// Inputs:
+//    farm    Farm to start
+// Outputs:
+//    Returns TRUE if the workers were started
+int moas_farm_start(moas_farm *farm);
+
+// Stop the worker threads.  Everything already queued is processed
+// before the workers stop.
+// Routine:  moas_farm_stop
+//
+// Inputs:
+//    farm    Farm to stop
+void moas_farm_stop(moas_farm *farm);
+
+// Queue characters for a switch
+// Routine:  moas_farm_feed
+//
+// Inputs:
+//    farm    Farm
+//    sw      Switch number
+//    buffer  Characters to give to the switch
+//    len     Number of characters
+// Outputs:
+//    Returns TRUE if queued, FALSE if the queue for the switch does
+//    not have room.  Nothing is queued unless everything fits.
+int moas_farm_feed(moas_farm *farm, int sw, const char *buffer, int len);
+
+// Queue a transmit/receive change for a switch
+// Routine:  moas_farm_txrx
+//
+// Inputs:
+//    farm    Farm
+//    sw      Switch number
+//    station Station which is transmitting or receiving, 1 to
+//            MOAS_STATIONS
+//    state   TRUE if transmitting, FALSE if receiving
+// Outputs:
+//    Returns TRUE if queued, FALSE if the switch or station is not
+//    valid or the queue for the switch is full
+int moas_farm_txrx(moas_farm *farm, int sw, int station, int state);
+
+// Get the context of a switch.  It must only be used directly while
+// the workers are stopped.
+// Routine:  moas_farm_switch
+//
+// Inputs:
+//    farm    Farm
+//    sw      Switch number
+// Outputs:
+//    Returns the switch context
+moas_ctx *moas_farm_switch(moas_farm *farm, int sw);
+
+// Get the number of shards
+// Routine:  moas_farm_shards
+//
+// Inputs:
+//    farm    Farm
+// Outputs:
+//    Returns the number of shards
+int moas_farm_shards(moas_farm *farm);
+
+// Read the throughput counters for a shard.  This may be done while the
+// workers are running.
+// Routine:  moas_farm_read_counters
+//
+// Inputs:
+//    farm    Farm
+//    shard   Shard number
+//    counters Filled in with the counters
+void moas_farm_read_counters(moas_farm *farm, int shard,
+	moas_farm_counters *counters);
+
+#endif
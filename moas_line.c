@@ -0,0 +1,264 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator serial line model
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "moas_line.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// Bits on the line for each character: start, eight data and stop
+#define LINE_CHAR_BITS 10
+
+typedef struct line_message {
+	uint64_t written;
+	int len;
+	char data[MOAS_LINE_MESSAGE_LEN];
+} line_message;
+
+struct moas_line {
+	moas_wheel *wheel;
+	moas_timer timer;
+
+	// Time for one character in microseconds
+	uint64_t char_time;
+
+	void (*send)(void *user, const char *buffer, size_t len);
+	void *user;
+
+	// The queue.  The oldest message is being sent while the timer
+	// runs.
+	line_message *messages;
+	int depth;
+	int first;
+	int count;
+
+	// A message which has not reached its semicolon yet
+	line_message partial;
+	int have_partial;
+
+	// When the statistics were cleared and last brought up to date
+	uint64_t cleared;
+	uint64_t updated;
+
+	moas_line_stats stats;
+
+	// Switch told about the queue, or NULL
+	moas_ctx *sw;
+};
+
+static void
+report_queue(moas_line *line)
+//----------------------------------------------------------------------
+// Tell the switch what the queue holds
+//----------------------------------------------------------------------
+{
+	if (line->sw) {
+		moas_output_queue_ctx(line->sw, line->count, line->stats.max_depth,
+							  line->stats.dropped);
+	}
+}
+
+static void
+update_stats(moas_line *line)
+//----------------------------------------------------------------------
+// Add the time since the last update to the timed statistics
+//----------------------------------------------------------------------
+{
+	uint64_t now = moas_wheel_now(line->wheel);
+	uint64_t elapsed = now - line->updated;
+
+	line->stats.depth_time += elapsed * line->count;
+	if (line->count) {
+		line->stats.busy_time += elapsed;
+	}
+	line->updated = now;
+}
+
+static void
+start_sending(moas_line *line)
+//----------------------------------------------------------------------
+// Start sending the oldest message
+//----------------------------------------------------------------------
+{
+	line_message *m = &line->messages[line->first];
+
+	moas_timer_start(line->wheel, &line->timer,
+					 moas_wheel_now(line->wheel) + line->char_time * m->len);
+}
+
+static void
+message_sent(moas_timer *timer, void *user)
+//----------------------------------------------------------------------
+// The last character of the oldest message has gone
+//----------------------------------------------------------------------
+{
+	moas_line *line = (moas_line *)user;
+	line_message m = line->messages[line->first];
+	uint64_t delay;
+	uint64_t ms;
+	int bucket = 0;
+
+	update_stats(line);
+
+	delay = line->updated - m.written;
+	line->stats.sent++;
+	line->stats.bytes += m.len;
+	line->stats.delay_total += delay;
+	if (delay > line->stats.delay_max) {
+		line->stats.delay_max = delay;
+	}
+	for (ms = delay / 1000; ms && (bucket < MOAS_LINE_BUCKETS-1); ms >>= 1) {
+		bucket++;
+	}
+	line->stats.delays[bucket]++;
+
+	line->first = (line->first + 1) % line->depth;
+	line->count--;
+
+	// The owner may write more while it is given this one, so its slot
+	// is free and it is sent from a copy
+	if (line->count) {
+		start_sending(line);
+	}
+	report_queue(line);
+	line->send(line->user, m.data, m.len);
+}
+
+static void
+queue_message(moas_line *line, const line_message *m)
+//----------------------------------------------------------------------
+// Put a message on the queue or drop it if the queue is full
+//----------------------------------------------------------------------
+{
+	update_stats(line);
+
+	line->stats.messages++;
+	if (line->count == line->depth) {
+		line->stats.dropped++;
+		report_queue(line);
+		return;
+	}
+
+	line->messages[(line->first + line->count) % line->depth] = *m;
+	line->count++;
+	if (line->count > line->stats.max_depth) {
+		line->stats.max_depth = line->count;
+	}
+
+	if (line->count == 1) {
+		start_sending(line);
+	}
+	report_queue(line);
+}
+
+moas_line *moas_line_create(moas_wheel *wheel, long baud, int depth,
+	void (*send)(void *user, const char *buffer, size_t len), void *user)
+//----------------------------------------------------------------------
+// Create a line model
+//----------------------------------------------------------------------
+{
+	moas_line *line;
+
+	if (baud <= 0) {
+		baud = MOAS_LINE_BAUD;
+	}
+	if (depth <= 0) {
+		depth = MOAS_LINE_DEPTH;
+	}
+
+	line = (moas_line *)calloc(1, sizeof(moas_line));
+	if (line == NULL) {
+		return NULL;
+	}
+	line->messages = (line_message *)calloc(depth, sizeof(line_message));
+	if (line->messages == NULL) {
+		free(line);
+		return NULL;
+	}
+
+	line->wheel = wheel;
+	moas_timer_init(&line->timer, message_sent, line);
+	line->char_time = (LINE_CHAR_BITS * 1000000ULL + baud - 1) / baud;
+	line->send = send;
+	line->user = user;
+	line->depth = depth;
+	line->cleared = moas_wheel_now(wheel);
+	line->updated = line->cleared;
+	return line;
+}
+
+void moas_line_destroy(moas_line *line)
+//----------------------------------------------------------------------
+// Stop and free a line model
+//----------------------------------------------------------------------
+{
+	if (line == NULL) {
+		return;
+	}
+	moas_timer_stop(&line->timer);
+	free(line->messages);
+	free(line);
+}
+
+void moas_line_write(moas_line *line, const char *buffer)
+//----------------------------------------------------------------------
+// Split what a switch wrote into messages and queue them
+//----------------------------------------------------------------------
+{
+	line_message *m = &line->partial;
+
+	for (; *buffer; buffer++) {
+		if (!line->have_partial) {
+			m->written = moas_wheel_now(line->wheel);
+			m->len = 0;
+			line->have_partial = TRUE;
+		}
+
+		m->data[m->len++] = *buffer;
+		if ((*buffer == ';') || (m->len == MOAS_LINE_MESSAGE_LEN)) {
+			line->have_partial = FALSE;
+			queue_message(line, m);
+		}
+	}
+}
+
+void moas_line_read_stats(moas_line *line, moas_line_stats *stats)
+//----------------------------------------------------------------------
+// Read the statistics
+//----------------------------------------------------------------------
+{
+	update_stats(line);
+
+	*stats = line->stats;
+	stats->depth = line->count;
+	stats->time = line->updated - line->cleared;
+}
+
+void moas_line_clear_stats(moas_line *line)
+//----------------------------------------------------------------------
+// Clear the statistics
+//----------------------------------------------------------------------
+{
+	update_stats(line);
+
+	memset(&line->stats, 0, sizeof(line->stats));
+	line->stats.max_depth = line->count;
+	line->cleared = line->updated;
+	report_queue(line);
+}
+
+void moas_line_report(moas_line *line, moas_ctx *ctx)
+//----------------------------------------------------------------------
+// Choose the switch told about the queue
+//----------------------------------------------------------------------
+{
+	line->sw = ctx;
+	report_queue(line);
+}
@@ -0,0 +1,124 @@
+//345678901234567890123456789012345678901234567890123456789012345678901234567890
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator serial line model
+//
+// The real switch sends its replies and events on a 9600 baud serial
+// line and has to queue them while the line is busy.  The emulator
+// writes them at once.  A line model goes between a switch's write
+// callback and the owner's transport so the owner sees the output when
+// the real switch would have finished sending it.
+//
+// Each string ending in a semicolon is a message.  The queue holds a
+// fixed number of messages like the switch's, and a message written
+// while it is full is dropped.  The line sends ten bits for each
+// character at the chosen speed, paced by a timer on a timing wheel, so
+// the line works on real or virtual time.
+//
+// A line and the switch and wheel it is used with must only be used by
+// one thread at a time.
+
+#ifndef MOAS_LINE_H
+#define MOAS_LINE_H
+
+#include "moas.h"
+#include "moas_timer.h"
+
+// The speed of the real switch's line
+#define MOAS_LINE_BAUD   9600
+
+// Messages queued if the owner does not choose
+#define MOAS_LINE_DEPTH  16
+
+// The longest message.  Longer ones are sent in pieces.
+#define MOAS_LINE_MESSAGE_LEN 128
+
+// Delays are counted in buckets of powers of two milliseconds.  Bucket
+// 0 is under 1 ms, bucket n is from 2^(n-1) to 2^n ms and the last
+// bucket has everything longer.
+#define MOAS_LINE_BUCKETS 16
+
+typedef struct moas_line moas_line;
+
+// What a line has done.  Times are in microseconds.
+typedef struct moas_line_stats {
+	unsigned long long messages;  // Messages written by the switch
+	unsigned long long sent;      // Messages which finished sending
+	unsigned long long dropped;   // Messages dropped as the queue was full
+	unsigned long long bytes;     // Characters which finished sending
+
+	int depth;                    // Messages queued or being sent now
+	int max_depth;                // Most messages queued at once
+
+	// Messages queued times the time they were queued, so dividing by
+	// the time gives the average depth
+	unsigned long long depth_time;
+
+	// Time the line has been sending and the time since the statistics
+	// were cleared
+	unsigned long long busy_time;
+	unsigned long long time;
+
+	// Time from each message being written to its last character
+	// being sent
+	unsigned long long delay_total;
+	unsigned long long delay_max;
+	unsigned long long delays[MOAS_LINE_BUCKETS];
+} moas_line_stats;
+
+// Create a line model
+// Routine:  moas_line_create
+//
+// Inputs:
+//    wheel   Timing wheel which paces the line
+//    baud    Line speed, or 0 for MOAS_LINE_BAUD
+//    depth   Messages the queue holds, or 0 for MOAS_LINE_DEPTH
+//    send    Called with each message when its last character has been
+//            sent.  The message is not terminated.
+//    user    Value passed to send
+// Outputs:
+//    Returns the line or NULL if there is no memory
+moas_line *moas_line_create(moas_wheel *wheel, long baud, int depth,
+	void (*send)(void *user, const char *buffer, size_t len), void *user);
+
+// Destroy a line model.  Messages still queued are thrown away.
+// Routine:  moas_line_destroy
+//
+// Inputs:
+//    line    Line to destroy.  NULL is ignored.
+void moas_line_destroy(moas_line *line);
+
+// Queue what a switch wrote.  This is meant to be called from the
+// switch's write callback.
+// Routine:  moas_line_write
+//
+// Inputs:
+//    line    Line model
+//    buffer  Replies and events from the switch
+void moas_line_write(moas_line *line, const char *buffer);
+
+// Have a line tell a switch what its queue holds whenever it changes,
+// so the switch's #Q; command reports it
+// Routine:  moas_line_report
+//
+// Inputs:
+//    line    Line model
+//    ctx     Switch to tell, or NULL to stop
+void moas_line_report(moas_line *line, moas_ctx *ctx);
+
+// Read what a line has done
+// Routine:  moas_line_read_stats
+//
+// Inputs:
+//    line    Line model
+//    stats   Filled in with the statistics up to the wheel's time
+void moas_line_read_stats(moas_line *line, moas_line_stats *stats);
+
+// Clear the statistics.  The messages queued stay.
+// Routine:  moas_line_clear_stats
+//
+// Inputs:
+//    line    Line model
+void moas_line_clear_stats(moas_line *line);
+
+#endif
@@ -0,0 +1,482 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - trace replay
+//
+// This gives the input in a trace to a new switch and checks that the
+// switch does what the recorded one did.
+//
+//    moas_replay [-p] [-n repeats] trace
+//
+//    -p        Keep the recorded pace.  Otherwise the trace is replayed
+//              as fast as possible.
+//    -n        Replay the trace this many times, default 1
+//
+// Each input record, transmit/receive record and configuration record
+// is a step.  A configuration record is loaded into the switch.  After each
+// step the replies and events written by the switch must be the same
+// characters as were recorded for that step, and the last relays and
+// antennas reported in the step must be the same.  How the replies are
+// divided between writes does not matter.
+//
+// The switch's timers run on the recorded times.  Before a step is
+// checked the time is moved up to when the next step was recorded, so
+// the timers which expired in between report in the step they did
+// when it was recorded.
+//
+// The first difference is reported and the exit status is 1.  If the
+// trace replays correctly the exit status is 0 and the speed of the
+// replay is printed.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "moas.h"
+#include "moas_timer.h"
+#include "moas_trace.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// What a switch did in one step
+typedef struct step_result {
+	char *output;
+	size_t output_len;
+	size_t output_size;
+
+	int relays_valid;
+	uint64_t relays;
+	int inhibits;
+
+	int antennas_valid;
+	int tx[MOAS_STATIONS];
+	int rx[MOAS_STATIONS];
+} step_result;
+
+static double
+now(void)
+//----------------------------------------------------------------------
+// Return a monotonic time in seconds
+//----------------------------------------------------------------------
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void
+wait_until(double when)
+//----------------------------------------------------------------------
+// Sleep until a time from now()
+//----------------------------------------------------------------------
+{
+	double delay = when - now();
+
+	if (delay <= 0) {
+		return;
+	}
+#if defined(_WIN32)
+	Sleep((DWORD)(delay * 1000));
+#else
+	{
+		struct timespec ts;
+
+		ts.tv_sec = (time_t)delay;
+		ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+static void
+usage(void)
+//----------------------------------------------------------------------
+// Describe the arguments and exit
+//----------------------------------------------------------------------
+{
+	fprintf(stderr, "usage: moas_replay [-p] [-n repeats] trace\n");
+	exit(2);
+}
+
+static void
+clear_result(step_result *result)
+//----------------------------------------------------------------------
+// Start a new step
+//----------------------------------------------------------------------
+{
+	result->output_len = 0;
+	result->relays_valid = FALSE;
+	result->antennas_valid = FALSE;
+}
+
+static void
+add_output(step_result *result, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Add replies and events to a step
+//----------------------------------------------------------------------
+{
+	size_t size;
+
+	if (result->output_len + len > result->output_size) {
+		size = (result->output_len + len) * 2;
+		result->output = (char *)realloc(result->output, size);
+		if (result->output == NULL) {
+			fprintf(stderr, "moas_replay: no memory\n");
+			exit(1);
+		}
+		result->output_size = size;
+	}
+	memcpy(result->output + result->output_len, buffer, len);
+	result->output_len += len;
+}
+
+static void
+replay_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Collect replies and events from the switch
+//----------------------------------------------------------------------
+{
+	add_output((step_result *)user, buffer, strlen(buffer));
+}
+
+static void
+replay_relays(void *user, uint64_t changed, uint64_t relays,
+	int changed_inhibits, int inhibits)
+//----------------------------------------------------------------------
+// Collect relay changes from the switch
+//----------------------------------------------------------------------
+{
+	step_result *result = (step_result *)user;
+
+	result->relays_valid = TRUE;
+	result->relays = relays;
+	result->inhibits = inhibits;
+}
+
+static void
+replay_antennas(void *user, int changed, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Collect antenna changes from the switch
+//----------------------------------------------------------------------
+{
+	step_result *result = (step_result *)user;
+
+	result->antennas_valid = TRUE;
+	memcpy(result->tx, tx, sizeof(result->tx));
+	memcpy(result->rx, rx, sizeof(result->rx));
+}
+
+static void
+print_chars(const char *label, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Print characters with control characters escaped
+//----------------------------------------------------------------------
+{
+	size_t i;
+
+	fprintf(stderr, "  %s \"", label);
+	for (i=0; i<len; i++) {
+		if ((buffer[i] < ' ') || (buffer[i] > '~') || (buffer[i] == '"')) {
+			fprintf(stderr, "\\x%02x", (unsigned char)buffer[i]);
+		}
+		else {
+			fputc(buffer[i], stderr);
+		}
+	}
+	fprintf(stderr, "\"\n");
+}
+
+static void
+print_antennas(const char *label, const step_result *result)
+//----------------------------------------------------------------------
+// Print reported antennas
+//----------------------------------------------------------------------
+{
+	int i;
+
+	fprintf(stderr, "  %s antennas", label);
+	if (!result->antennas_valid) {
+		fprintf(stderr, " unchanged\n");
+		return;
+	}
+	for (i=0; i<MOAS_STATIONS; i++) {
+		fprintf(stderr, " %d/%d", result->tx[i], result->rx[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+static int
+check_step(long step, const moas_trace_record *last,
+	const step_result *expected, const step_result *got)
+//----------------------------------------------------------------------
+// Compare what the switch did in a step with the trace.  Returns FALSE
+// and describes the difference if they are not the same.
+//----------------------------------------------------------------------
+{
+	int output_same;
+	int relays_same;
+	int antennas_same;
+
+	output_same = (expected->output_len == got->output_len) &&
+				  (memcmp(expected->output, got->output,
+						  got->output_len) == 0);
+
+	relays_same = (expected->relays_valid == got->relays_valid) &&
+				  (!got->relays_valid ||
+				   ((expected->relays == got->relays) &&
+					(expected->inhibits == got->inhibits)));
+
+	antennas_same = (expected->antennas_valid == got->antennas_valid) &&
+					(!got->antennas_valid ||
+					 ((memcmp(expected->tx, got->tx, sizeof(got->tx)) == 0) &&
+					  (memcmp(expected->rx, got->rx, sizeof(got->rx)) == 0)));
+
+	if (output_same && relays_same && antennas_same) {
+		return TRUE;
+	}
+
+	fprintf(stderr, "moas_replay: step %ld at %.6f seconds differs\n",
+			step, last ? last->time / 1e9 : 0.0);
+	if (last == NULL) {
+		fprintf(stderr, "  creating the switch\n");
+	}
+	else if (last->type == MOAS_TRACE_INPUT) {
+		print_chars("input", last->data, last->len);
+	}
+	else if (last->type == MOAS_TRACE_CONFIG) {
+		fprintf(stderr, "  loading a configuration image\n");
+	}
+	else {
+		fprintf(stderr, "  station %d %s\n", last->station,
+				last->state ? "transmits" : "receives");
+	}
+
+	if (!output_same) {
+		print_chars("recorded", expected->output, expected->output_len);
+		print_chars("replayed", got->output, got->output_len);
+	}
+	if (!relays_same) {
+		if (expected->relays_valid) {
+			fprintf(stderr, "  recorded relays %016llx inhibits %02x\n",
+					(unsigned long long)expected->relays, expected->inhibits);
+		}
+		else {
+			fprintf(stderr, "  recorded relays unchanged\n");
+		}
+		if (got->relays_valid) {
+			fprintf(stderr, "  replayed relays %016llx inhibits %02x\n",
+					(unsigned long long)got->relays, got->inhibits);
+		}
+		else {
+			fprintf(stderr, "  replayed relays unchanged\n");
+		}
+	}
+	if (!antennas_same) {
+		print_antennas("recorded", expected);
+		print_antennas("replayed", got);
+	}
+	return FALSE;
+}
+
+static int
+replay(moas_trace *trace, int paced, long *steps, unsigned long long *bytes)
+//----------------------------------------------------------------------
+// Replay a trace once.  Returns FALSE if the switch did something
+// different or the trace is damaged.
+//----------------------------------------------------------------------
+{
+	static step_result expected;
+	static step_result got;
+	moas_callbacks callbacks;
+	moas_trace_record record;
+	moas_trace_record last;
+	moas_ctx *sw;
+	moas_wheel *wheel;
+	unsigned long long time = 0;
+	double start;
+	long step = 0;
+	int have_last = FALSE;
+	int ok = TRUE;
+	int n;
+
+	clear_result(&expected);
+	clear_result(&got);
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = replay_write;
+	callbacks.relays_changed = replay_relays;
+	callbacks.antennas_changed = replay_antennas;
+
+	// The time only moves as the trace says
+	wheel = moas_wheel_create(NULL, NULL);
+	sw = moas_create(&callbacks, &got);
+	if ((wheel == NULL) || (sw == NULL)) {
+		fprintf(stderr, "moas_replay: no memory\n");
+		moas_destroy(sw);
+		moas_wheel_destroy(wheel);
+		return FALSE;
+	}
+	moas_timers_ctx(sw, wheel);
+
+	moas_trace_rewind(trace);
+	start = now();
+
+	for (;;) {
+		n = moas_trace_next(trace, &record);
+		if (n < 0) {
+			fprintf(stderr, "moas_replay: trace is damaged after step %ld\n",
+					step);
+			ok = FALSE;
+			break;
+		}
+
+		// A new step or the end finishes the last step, once the timers
+		// due by then have expired
+		if (n > 0) {
+			time = record.time;
+		}
+		if ((n == 0) || (record.type == MOAS_TRACE_INPUT) ||
+			(record.type == MOAS_TRACE_TXRX) ||
+			(record.type == MOAS_TRACE_CONFIG)) {
+			moas_wheel_advance(wheel, time / 1000);
+			if (!check_step(step, have_last ? &last : NULL,
+							&expected, &got)) {
+				ok = FALSE;
+				break;
+			}
+			if (n == 0) {
+				break;
+			}
+			clear_result(&expected);
+			clear_result(&got);
+			last = record;
+			have_last = TRUE;
+			step++;
+
+			if (paced) {
+				wait_until(start + record.time / 1e9);
+			}
+		}
+
+		switch (record.type) {
+		case MOAS_TRACE_INPUT:
+			moas_feed_ctx(sw, record.data, record.len);
+			*bytes += record.len;
+			break;
+
+		case MOAS_TRACE_TXRX:
+			moas_txrx_ctx(sw, record.station, record.state);
+			break;
+
+		case MOAS_TRACE_CONFIG:
+			if (!moas_load_config_ctx(sw, (const unsigned char *)record.data,
+									  record.len)) {
+				fprintf(stderr, "moas_replay: step %ld has a configuration "
+						"image the switch does not take\n", step);
+				ok = FALSE;
+			}
+			break;
+
+		case MOAS_TRACE_WRITE:
+			add_output(&expected, record.data, record.len);
+			break;
+
+		case MOAS_TRACE_RELAYS:
+			expected.relays_valid = TRUE;
+			expected.relays = record.relays;
+			expected.inhibits = record.inhibits;
+			break;
+
+		case MOAS_TRACE_ANTENNAS:
+			expected.antennas_valid = TRUE;
+			memcpy(expected.tx, record.tx, sizeof(expected.tx));
+			memcpy(expected.rx, record.rx, sizeof(expected.rx));
+			break;
+		}
+		if (!ok) {
+			break;
+		}
+	}
+
+	*steps += step;
+	moas_destroy(sw);
+	moas_wheel_destroy(wheel);
+	return ok;
+}
+
+int main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Replay a trace and report how fast it went
+//----------------------------------------------------------------------
+{
+	moas_trace *trace;
+	unsigned long long bytes = 0;
+	long steps = 0;
+	long repeats = 1;
+	long r;
+	int paced = FALSE;
+	double start;
+	double elapsed;
+	int i;
+
+	for (i=1; (i < argc) && (argv[i][0] == '-'); i++) {
+		if (strcmp(argv[i], "-p") == 0) {
+			paced = TRUE;
+		}
+		else if ((strcmp(argv[i], "-n") == 0) && (i+1 < argc)) {
+			repeats = atol(argv[++i]);
+		}
+		else {
+			usage();
+		}
+	}
+	if ((i != argc - 1) || (repeats < 1)) {
+		usage();
+	}
+
+	trace = moas_trace_open(argv[i]);
+	if (trace == NULL) {
+		fprintf(stderr, "moas_replay: %s is not a trace\n", argv[i]);
+		return 1;
+	}
+
+	start = now();
+	for (r=0; r<repeats; r++) {
+		if (!replay(trace, paced, &steps, &bytes)) {
+			moas_trace_close(trace);
+			return 1;
+		}
+	}
+	elapsed = now() - start;
+	moas_trace_close(trace);
+
+	printf("steps %ld bytes %llu seconds %.6f steps_per_sec %.0f "
+		   "bytes_per_sec %.0f\n",
+		   steps, bytes, elapsed,
+		   elapsed > 0 ? steps / elapsed : 0.0,
+		   elapsed > 0 ? bytes / elapsed : 0.0);
+	return 0;
+}
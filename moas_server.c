@@ -0,0 +1,786 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - Linux switch server
+//
+// This serves many emulated switches on one TCP or UNIX-domain socket.
+// Every connection is bound to its own switch and the connections are
+// shared out among a few worker threads, each with its own epoll loop.
+//
+//    moas_server [-a address] [-p port | -u path] [-t threads] [-c image]
+//
+//    -a address  TCP address to listen on, default 127.0.0.1
+//    -p port     TCP port to listen on, default 4000
+//    -u path     Listen on a UNIX-domain socket instead of TCP
+//    -t threads  Number of worker threads, default 4
+//    -c image    Configuration image loaded into every new switch
+//
+// The first command on a connection picks the switch.  A unit ID
+// command with a unit ID (":5;") picks the switch registered under that
+// unit ID, creating it if there is none, and is then given to it.  Such
+// a switch keeps its state when the connection closes so the next
+// connection asking for it carries on where the last one stopped.  Only
+// one connection may use it at a time.  Any other first command gets a
+// new switch of its own which is thrown away when the connection
+// closes.
+//
+// A switch's timers run on the wheel of the worker its connection is
+// on.  The timers of a registered switch expire at once when its
+// connection closes.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "moas.h"
+#include "moas_config.h"
+#include "moas_timer.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// Unit IDs run from 0 to 99
+#define SERVER_UNITS    100
+
+// The first command must fit in this many characters
+#define SERVER_FIRST_LEN 128
+
+#define SERVER_READ_LEN 4096
+
+// A connection which lets this much output back up is not read from
+// until it catches up
+#define SERVER_OUT_HIGH 65536
+
+#define SERVER_EVENTS   64
+
+typedef struct server_conn server_conn;
+typedef struct server_worker server_worker;
+
+// A switch and the connection it currently talks to.  The switch's user
+// value points here so a registered switch can move between connections.
+typedef struct server_switch {
+	moas_ctx *sw;
+	server_conn *conn;
+
+	// Unit ID the switch is registered under or -1
+	int unit;
+} server_switch;
+
+struct server_conn {
+	int fd;
+	server_worker *worker;
+
+	// NULL until the first command has picked one
+	server_switch *sw;
+
+	// The first command is collected here
+	char first[SERVER_FIRST_LEN];
+	int first_len;
+
+	// Output which could not be sent yet
+	char *out;
+	size_t out_len;
+	size_t out_size;
+
+	// Events currently asked of epoll
+	unsigned events;
+
+	// Set when the connection should be closed
+	int closing;
+};
+
+struct server_worker {
+	pthread_t thread;
+	int epfd;
+
+	// Timers of the switches on the worker's connections
+	moas_wheel *wheel;
+
+	// Written to stop the worker
+	int wakeup;
+};
+
+// The registered switches.  A switch in use by a connection is only
+// touched by that connection's worker.  The table itself is shared.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static server_switch *registry[SERVER_UNITS];
+
+// Configuration every new switch starts with.  It is only written
+// before the workers start.
+static unsigned char config_image[MOAS_CONFIG_LEN];
+static int have_config;
+
+static void
+usage(void)
+//----------------------------------------------------------------------
+// Describe the arguments and exit
+//----------------------------------------------------------------------
+{
+	fprintf(stderr, "usage: moas_server [-a address] [-p port | -u path] "
+			"[-t threads] [-c image]\n");
+	exit(2);
+}
+
+static void
+watch(server_conn *conn, unsigned events)
+//----------------------------------------------------------------------
+// Change the events epoll reports for a connection
+//----------------------------------------------------------------------
+{
+	struct epoll_event ev;
+
+	if (conn->events == events) {
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->events = events;
+}
+
+static void
+send_output(server_conn *conn)
+//----------------------------------------------------------------------
+// Send as much held output as the socket takes
+//----------------------------------------------------------------------
+{
+	ssize_t n;
+
+	while (conn->out_len > 0) {
+		n = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				conn->closing = TRUE;
+			}
+			break;
+		}
+		memmove(conn->out, conn->out + n, conn->out_len - n);
+		conn->out_len -= n;
+	}
+
+	// Wait for room if anything is left and stop reading while a lot
+	// is waiting
+	if (conn->out_len == 0) {
+		watch(conn, EPOLLIN);
+	}
+	else if (conn->out_len >= SERVER_OUT_HIGH) {
+		watch(conn, EPOLLOUT);
+	}
+	else {
+		watch(conn, EPOLLIN | EPOLLOUT);
+	}
+}
+
+static void
+queue_output(server_conn *conn, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Send output to a connection, holding whatever the socket will not
+// take yet
+//----------------------------------------------------------------------
+{
+	char *out;
+	size_t size;
+
+	if (conn->closing) {
+		return;
+	}
+
+	if (conn->out_len + len > conn->out_size) {
+		size = conn->out_size ? conn->out_size : 256;
+		while (size < conn->out_len + len) {
+			size *= 2;
+		}
+		out = (char *)realloc(conn->out, size);
+		if (out == NULL) {
+			conn->closing = TRUE;
+			return;
+		}
+		conn->out = out;
+		conn->out_size = size;
+	}
+
+	memcpy(conn->out + conn->out_len, buffer, len);
+	conn->out_len += len;
+	send_output(conn);
+}
+
+static void
+server_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Send replies and events from a switch to its connection
+//----------------------------------------------------------------------
+{
+	server_switch *s = (server_switch *)user;
+
+	if (s->conn != NULL) {
+		queue_output(s->conn, buffer, strlen(buffer));
+	}
+}
+
+static server_switch *
+new_switch(int unit)
+//----------------------------------------------------------------------
+// Create a switch
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+	server_switch *s;
+
+	s = (server_switch *)calloc(1, sizeof(server_switch));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = server_write;
+
+	s->sw = moas_create(&callbacks, s);
+	if (s->sw == NULL) {
+		free(s);
+		return NULL;
+	}
+	if (have_config) {
+		moas_load_config_ctx(s->sw, config_image, MOAS_CONFIG_LEN);
+	}
+	s->unit = unit;
+	return s;
+}
+
+static void
+free_switch(server_switch *s)
+//----------------------------------------------------------------------
+// Destroy a switch
+//----------------------------------------------------------------------
+{
+	moas_destroy(s->sw);
+	free(s);
+}
+
+static int
+first_unit(const char *cmd, int len)
+//----------------------------------------------------------------------
+// Return the unit ID asked for by a first command or -1 if it does not
+// ask for one
+//----------------------------------------------------------------------
+{
+	if ((len == 3) && (cmd[0] == ':') &&
+		(cmd[1] >= '0') && (cmd[1] <= '9')) {
+		return cmd[1] - '0';
+	}
+	if ((len == 4) && (cmd[0] == ':') &&
+		(cmd[1] >= '0') && (cmd[1] <= '9') &&
+		(cmd[2] >= '0') && (cmd[2] <= '9')) {
+		return ((cmd[1] - '0') * 10) + cmd[2] - '0';
+	}
+	return -1;
+}
+
+static int
+attach_switch(server_conn *conn)
+//----------------------------------------------------------------------
+// Pick the switch for a connection from its first command
+//----------------------------------------------------------------------
+{
+	server_switch *s;
+	int unit;
+
+	unit = first_unit(conn->first, conn->first_len);
+	if (unit < 0) {
+		s = new_switch(-1);
+		if (s == NULL) {
+			return FALSE;
+		}
+		s->conn = conn;
+	}
+	else {
+		pthread_mutex_lock(&registry_lock);
+		s = registry[unit];
+		if (s == NULL) {
+			s = new_switch(unit);
+			registry[unit] = s;
+		}
+		else if (s->conn != NULL) {
+			// Somebody else is using it
+			s = NULL;
+		}
+		if (s != NULL) {
+			s->conn = conn;
+		}
+		pthread_mutex_unlock(&registry_lock);
+
+		if (s == NULL) {
+			queue_output(conn, "?A;", 3);
+			return FALSE;
+		}
+	}
+
+	conn->sw = s;
+	moas_timers_ctx(s->sw, conn->worker->wheel);
+	return TRUE;
+}
+
+static void
+detach_switch(server_conn *conn)
+//----------------------------------------------------------------------
+// Let go of a connection's switch
+//----------------------------------------------------------------------
+{
+	server_switch *s = conn->sw;
+
+	if (s == NULL) {
+		return;
+	}
+	conn->sw = NULL;
+
+	if (s->unit < 0) {
+		free_switch(s);
+		return;
+	}
+
+	// The next connection may be on another worker
+	moas_timers_ctx(s->sw, NULL);
+
+	pthread_mutex_lock(&registry_lock);
+	s->conn = NULL;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void
+close_conn(server_conn *conn)
+//----------------------------------------------------------------------
+// Close a connection
+//----------------------------------------------------------------------
+{
+	detach_switch(conn);
+	epoll_ctl(conn->worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->out);
+	free(conn);
+}
+
+static void
+read_conn(server_conn *conn)
+//----------------------------------------------------------------------
+// Give what a connection sent to its switch
+//----------------------------------------------------------------------
+{
+	char buffer[SERVER_READ_LEN];
+	ssize_t n;
+	ssize_t i = 0;
+
+	n = recv(conn->fd, buffer, sizeof(buffer), 0);
+	if (n <= 0) {
+		if ((n == 0) || ((errno != EINTR) && (errno != EAGAIN))) {
+			conn->closing = TRUE;
+		}
+		return;
+	}
+
+	// Until the first command is complete it is collected here
+	if (conn->sw == NULL) {
+		for (i=0; i<n; i++) {
+			if (buffer[i] < ' ') {
+				continue;
+			}
+			if (buffer[i] == '$') {
+				conn->first_len = 0;
+				continue;
+			}
+			if (conn->first_len == SERVER_FIRST_LEN) {
+				conn->closing = TRUE;
+				return;
+			}
+			conn->first[conn->first_len++] = buffer[i];
+			if (buffer[i] == ';') {
+				break;
+			}
+		}
+		if (i == n) {
+			return;
+		}
+		i++;
+
+		if (!attach_switch(conn)) {
+			conn->closing = TRUE;
+			return;
+		}
+		moas_feed_ctx(conn->sw->sw, conn->first, conn->first_len);
+	}
+
+	moas_feed_ctx(conn->sw->sw, buffer + i, n - i);
+}
+
+static uint64_t
+monotonic_clock(void *user)
+//----------------------------------------------------------------------
+// The clock for the switches' timers in microseconds
+//----------------------------------------------------------------------
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+wait_time(moas_wheel *wheel)
+//----------------------------------------------------------------------
+// Return how many milliseconds to wait for events before the next timer
+// is due, or -1 if no timer is running
+//----------------------------------------------------------------------
+{
+	uint64_t when;
+	uint64_t now;
+	uint64_t ms;
+
+	if (!moas_wheel_next(wheel, &when)) {
+		return -1;
+	}
+	now = moas_wheel_now(wheel);
+	if (when <= now) {
+		return 0;
+	}
+	ms = (when - now + 999) / 1000;
+	return (ms > INT_MAX) ? INT_MAX : (int)ms;
+}
+
+static void *
+worker(void *arg)
+//----------------------------------------------------------------------
+// Run the connections given to one worker
+//----------------------------------------------------------------------
+{
+	server_worker *w = (server_worker *)arg;
+	struct epoll_event events[SERVER_EVENTS];
+	server_conn *conn;
+	int n;
+	int i;
+
+	for (;;) {
+		n = epoll_wait(w->epfd, events, SERVER_EVENTS,
+					   wait_time(w->wheel));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("moas_server: epoll_wait");
+			return NULL;
+		}
+
+		for (i=0; i<n; i++) {
+			conn = (server_conn *)events[i].data.ptr;
+
+			// The wakeup descriptor has no connection
+			if (conn == NULL) {
+				return NULL;
+			}
+
+			if (events[i].events & EPOLLOUT) {
+				send_output(conn);
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				read_conn(conn);
+			}
+			if (conn->closing) {
+				close_conn(conn);
+			}
+		}
+
+		moas_wheel_run(w->wheel);
+	}
+}
+
+static int
+listen_tcp(const char *address, int port)
+//----------------------------------------------------------------------
+// Open the TCP listening socket
+//----------------------------------------------------------------------
+{
+	struct sockaddr_in sin;
+	int one = 1;
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &sin.sin_addr) != 1) {
+		fprintf(stderr, "moas_server: bad address %s\n", address);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("moas_server: socket");
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if ((bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) ||
+		(listen(fd, 128) < 0)) {
+		perror("moas_server: listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+listen_unix(const char *path)
+//----------------------------------------------------------------------
+// Open the UNIX-domain listening socket
+//----------------------------------------------------------------------
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "moas_server: path too long\n");
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("moas_server: socket");
+		return -1;
+	}
+
+	if ((bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) ||
+		(listen(fd, 128) < 0)) {
+		perror("moas_server: listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+accept_conn(int lfd, server_worker *w, int tcp)
+//----------------------------------------------------------------------
+// Accept a connection and give it to a worker
+//----------------------------------------------------------------------
+{
+	struct epoll_event ev;
+	server_conn *conn;
+	int one = 1;
+	int fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	// Replies are small and already gathered into one write each
+	if (tcp) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	conn = (server_conn *)calloc(1, sizeof(server_conn));
+	if (conn == NULL) {
+		close(fd);
+		return;
+	}
+	conn->fd = fd;
+	conn->worker = w;
+	conn->events = EPOLLIN;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		free(conn);
+	}
+}
+
+int main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Serve switches until told to stop
+//----------------------------------------------------------------------
+{
+	const char *address = "127.0.0.1";
+	const char *path = NULL;
+	int port = 4000;
+	int threads = 4;
+	const char *config = NULL;
+	server_worker *workers;
+	server_switch *probe;
+	struct epoll_event ev;
+	sigset_t signals;
+	uint64_t one = 1;
+	int next = 0;
+	int running = TRUE;
+	int lfd;
+	int sigfd;
+	int epfd;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "a:p:u:t:c:")) != -1) {
+		switch (opt) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'u':
+			path = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((optind != argc) || (threads < 1)) {
+		usage();
+	}
+
+	// The image is tried on a switch so a bad one is found now
+	if (config) {
+		if (!moas_config_read(config, config_image)) {
+			fprintf(stderr, "moas_server: cannot read %s\n", config);
+			return 1;
+		}
+		probe = new_switch(-1);
+		if ((probe == NULL) ||
+			!moas_load_config_ctx(probe->sw, config_image, MOAS_CONFIG_LEN)) {
+			fprintf(stderr, "moas_server: %s is not a configuration image\n",
+					config);
+			return 1;
+		}
+		free_switch(probe);
+		have_config = TRUE;
+	}
+
+	lfd = path ? listen_unix(path) : listen_tcp(address, port);
+	if (lfd < 0) {
+		return 1;
+	}
+
+	// Signals which stop the server are read through the event loop.
+	// The workers inherit the blocked signals.
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	sigfd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if ((sigfd < 0) || (epfd < 0)) {
+		perror("moas_server: epoll");
+		return 1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = lfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.fd = sigfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+	workers = (server_worker *)calloc(threads, sizeof(server_worker));
+	if (workers == NULL) {
+		fprintf(stderr, "moas_server: no memory\n");
+		return 1;
+	}
+	for (i=0; i<threads; i++) {
+		workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+		workers[i].wakeup = eventfd(0, EFD_CLOEXEC);
+		workers[i].wheel = moas_wheel_create(monotonic_clock, NULL);
+		if ((workers[i].epfd < 0) || (workers[i].wakeup < 0) ||
+			(workers[i].wheel == NULL)) {
+			perror("moas_server: worker");
+			return 1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].wakeup, &ev);
+		if (pthread_create(&workers[i].thread, NULL, worker,
+						   &workers[i]) != 0) {
+			fprintf(stderr, "moas_server: cannot start worker\n");
+			return 1;
+		}
+	}
+
+	if (path) {
+		printf("listening on %s\n", path);
+	}
+	else {
+		printf("listening on %s:%d\n", address, port);
+	}
+	fflush(stdout);
+
+	// New connections go to the workers in turn
+	while (running) {
+		if (epoll_wait(epfd, &ev, 1, -1) <= 0) {
+			continue;
+		}
+		if (ev.data.fd == lfd) {
+			accept_conn(lfd, &workers[next], path == NULL);
+			next = (next + 1) % threads;
+		}
+		else {
+			running = FALSE;
+		}
+	}
+
+	for (i=0; i<threads; i++) {
+		if (write(workers[i].wakeup, &one, sizeof(one)) < 0) {
+			perror("moas_server: wakeup");
+		}
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].wakeup);
+		close(workers[i].epfd);
+	}
+
+	// The switches stop their timers so they go before the wheels
+	for (i=0; i<SERVER_UNITS; i++) {
+		if (registry[i] != NULL) {
+			free_switch(registry[i]);
+		}
+	}
+	for (i=0; i<threads; i++) {
+		moas_wheel_destroy(workers[i].wheel);
+	}
+	free(workers);
+
+	close(lfd);
+	if (path) {
+		unlink(path);
+	}
+	return 0;
+}
@@ -0,0 +1,824 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - virtual time simulation
+//
+// This runs one emulated switch on a virtual clock so a scenario which
+// would take days in real time runs as fast as the computer allows.
+// Everything which happens is an event on one queue in order of virtual
+// time: script lines, generated operator actions, commands arriving
+// over the serial line and the switch's own timers.  Events due at the
+// same time happen in the order they were queued, and timers due at or
+// before an event expire before it.
+//
+//    moas_sim [-v] [-c image] [-b baud] [-q depth] [-g hours] [-p]
+//             [-s seed] [scenario]
+//
+//    -v        Print every reply, event and change with its time
+//    -c image  Load a configuration image into the switch first
+//    -b baud   Speed of the serial line, default 9600.  0 makes the
+//              line take no time.
+//    -q depth  Messages the switch can queue for the line, default 16
+//    -g hours  Generate this many hours of operator traffic
+//    -p        Generate a pileup, with much shorter transmissions and
+//              pauses
+//    -s seed   Seed for the generated traffic, default 1
+//
+// A scenario file has one line for each thing the controlling program
+// or an operator does, in order of time:
+//
+//    MS INPUT  At MS milliseconds send INPUT to the switch
+//    MS .tN    At MS milliseconds station N transmits
+//    MS .rN    At MS milliseconds station N receives
+//
+// Blank lines and lines starting with # are ignored.
+//
+// Generated traffic has every station call and answer in short
+// transmissions and change band every so often, picking the antenna
+// and relay for the band with an antenna command.  A band is only
+// changed while the station is receiving.
+//
+// The serial line carries ten bits for each character each way.  A
+// command is given to the switch when its last character has arrived,
+// and a command sent while the line is busy waits for it.  Replies and
+// events go through a model of the switch's output queue (see
+// moas_line.h), which drops them when it is full, and are printed when
+// their last character has been sent.
+//
+// At the end the virtual and real time taken and counts of what
+// happened are printed on one line, followed by a line about the
+// switch's output queue:
+//
+//    messages      Replies and events written by the switch
+//    dropped       Messages dropped because the queue was full
+//    max_depth     Most messages queued at once
+//    average_depth Messages queued on average
+//    busy          Percentage of the time the line was sending
+//    delay_mean_ms Average time from a message being written to its
+//                  last character being sent
+//    delay_p99_ms  99% of the messages took no longer than this
+//    delay_max_ms  Longest time a message took
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "moas.h"
+#include "moas_config.h"
+#include "moas_line.h"
+#include "moas_timer.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// The longest scenario line
+#define LINE_LEN 512
+
+// Generated traffic uses this many bands.  Each band has an antenna and
+// a relay for each station.
+#define SIM_BANDS 6
+
+// Microseconds in the units the options and scenarios use
+#define US_PER_MS     1000ULL
+#define US_PER_SECOND 1000000ULL
+#define US_PER_HOUR   (3600ULL * US_PER_SECOND)
+
+#define EVENT_SCRIPT  0
+#define EVENT_ARRIVE  1
+#define EVENT_PTT     2
+#define EVENT_BAND    3
+
+static const char sixbit[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz{}";
+
+typedef struct sim_event {
+	uint64_t when;
+
+	// Order the event was queued in, so events at the same time keep it
+	unsigned long seq;
+
+	int type;
+	int station;
+} sim_event;
+
+// Characters on their way to the switch
+typedef struct sim_chunk {
+	struct sim_chunk *next;
+	size_t len;
+	char data[1];
+} sim_chunk;
+
+typedef struct sim_line {
+	// Time for one character in microseconds
+	uint64_t char_time;
+
+	// When the last character sent so far has arrived
+	uint64_t free;
+
+	// Commands on the line, oldest first.  Each has an arrive event.
+	sim_chunk *first;
+	sim_chunk *last;
+} sim_line;
+
+typedef struct sim {
+	moas_ctx *sw;
+	moas_wheel *wheel;
+	int verbose;
+
+	// Events waiting, as a heap with the earliest first
+	sim_event *events;
+	size_t event_count;
+	size_t event_size;
+	unsigned long seq;
+
+	// Virtual time in microseconds
+	uint64_t now;
+
+	sim_line line;
+
+	// The switch's output queue and line, or NULL if the line takes no
+	// time
+	moas_line *out;
+
+	// Scenario being read, and its next line when a script event is
+	// queued
+	FILE *script;
+	long script_line;
+	char next_line[LINE_LEN];
+
+	// Generated traffic stops at this time
+	uint64_t end;
+	int pileup;
+	unsigned long seed;
+	int transmitting[MOAS_STATIONS];
+	int band[MOAS_STATIONS];
+
+	// What happened
+	unsigned long handled;
+	unsigned long commands;
+	unsigned long long command_bytes;
+	unsigned long txrx;
+	unsigned long timers;
+	unsigned long long output_bytes;
+	unsigned long relay_changes;
+	unsigned long antenna_changes;
+	int failed;
+} sim;
+
+static double
+now(void)
+//----------------------------------------------------------------------
+// Return a monotonic time in seconds
+//----------------------------------------------------------------------
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void
+usage(void)
+//----------------------------------------------------------------------
+// Describe the arguments and exit
+//----------------------------------------------------------------------
+{
+	fprintf(stderr, "usage: moas_sim [-v] [-c image] [-b baud] [-q depth] "
+			"[-g hours] [-p] [-s seed] [scenario]\n");
+	exit(2);
+}
+
+static void
+no_memory(void)
+//----------------------------------------------------------------------
+// Give up for lack of memory
+//----------------------------------------------------------------------
+{
+	fprintf(stderr, "moas_sim: no memory\n");
+	exit(1);
+}
+
+static unsigned long
+next_random(sim *s)
+//----------------------------------------------------------------------
+// Return the next value from the generator for the traffic
+//----------------------------------------------------------------------
+{
+	s->seed = s->seed * 1103515245UL + 12345UL;
+	return (s->seed >> 16) & 0x7fff;
+}
+
+static uint64_t
+random_time(sim *s, uint64_t low, uint64_t high)
+//----------------------------------------------------------------------
+// Return a time in microseconds from low to high, to the millisecond
+//----------------------------------------------------------------------
+{
+	uint64_t ms = (high - low) / US_PER_MS;
+	uint64_t r = ((uint64_t)next_random(s) << 15) | next_random(s);
+
+	return low + (r % (ms + 1)) * US_PER_MS;
+}
+
+static int
+earlier(const sim_event *a, const sim_event *b)
+//----------------------------------------------------------------------
+// TRUE if event a comes before event b
+//----------------------------------------------------------------------
+{
+	return (a->when < b->when) || ((a->when == b->when) && (a->seq < b->seq));
+}
+
+static void
+queue_event(sim *s, uint64_t when, int type, int station)
+//----------------------------------------------------------------------
+// Add an event to the heap
+//----------------------------------------------------------------------
+{
+	sim_event *events;
+	sim_event event;
+	size_t i;
+
+	if (s->event_count == s->event_size) {
+		s->event_size = s->event_size ? s->event_size * 2 : 64;
+		events = (sim_event *)realloc(s->events,
+									  s->event_size * sizeof(sim_event));
+		if (events == NULL) {
+			no_memory();
+		}
+		s->events = events;
+	}
+
+	event.when = when;
+	event.seq = s->seq++;
+	event.type = type;
+	event.station = station;
+
+	// Move it up past the later events above it
+	i = s->event_count++;
+	while ((i > 0) && earlier(&event, &s->events[(i-1) / 2])) {
+		s->events[i] = s->events[(i-1) / 2];
+		i = (i-1) / 2;
+	}
+	s->events[i] = event;
+}
+
+static void
+take_event(sim *s, sim_event *event)
+//----------------------------------------------------------------------
+// Take the earliest event from the heap, which must not be empty
+//----------------------------------------------------------------------
+{
+	sim_event last;
+	size_t child;
+	size_t i = 0;
+
+	*event = s->events[0];
+	last = s->events[--s->event_count];
+
+	// Move the last event down from the top past the earlier ones
+	while ((child = 2*i + 1) < s->event_count) {
+		if ((child + 1 < s->event_count) &&
+			earlier(&s->events[child + 1], &s->events[child])) {
+			child++;
+		}
+		if (!earlier(&s->events[child], &last)) {
+			break;
+		}
+		s->events[i] = s->events[child];
+		i = child;
+	}
+	s->events[i] = last;
+}
+
+static void
+send_line(sim *s, const char *data, size_t len)
+//----------------------------------------------------------------------
+// Send characters to the switch over the serial line
+//----------------------------------------------------------------------
+{
+	sim_line *line = &s->line;
+	sim_chunk *chunk;
+
+	if (len == 0) {
+		return;
+	}
+
+	chunk = (sim_chunk *)malloc(sizeof(sim_chunk) + len);
+	if (chunk == NULL) {
+		no_memory();
+	}
+	chunk->next = NULL;
+	chunk->len = len;
+	memcpy(chunk->data, data, len);
+
+	if (line->last) {
+		line->last->next = chunk;
+	}
+	else {
+		line->first = chunk;
+	}
+	line->last = chunk;
+
+	// Characters follow the ones already on the line
+	if (line->free < s->now) {
+		line->free = s->now;
+	}
+	line->free += line->char_time * len;
+	queue_event(s, line->free, EVENT_ARRIVE, 0);
+}
+
+static void
+arrive(sim *s)
+//----------------------------------------------------------------------
+// Give the oldest characters on the line to the switch
+//----------------------------------------------------------------------
+{
+	sim_line *line = &s->line;
+	sim_chunk *chunk = line->first;
+
+	line->first = chunk->next;
+	if (line->first == NULL) {
+		line->last = NULL;
+	}
+
+	s->commands++;
+	s->command_bytes += chunk->len;
+	moas_feed_ctx(s->sw, chunk->data, chunk->len);
+	free(chunk);
+}
+
+static void
+txrx(sim *s, int station, int state)
+//----------------------------------------------------------------------
+// Change the transmit/receive state of a station
+//----------------------------------------------------------------------
+{
+	s->txrx++;
+	moas_txrx_ctx(s->sw, station, state);
+}
+
+static void
+print_time(sim *s)
+//----------------------------------------------------------------------
+// Start a verbose line with the virtual time
+//----------------------------------------------------------------------
+{
+	printf("%llu.%06llu ", (unsigned long long)(s->now / US_PER_SECOND),
+		   (unsigned long long)(s->now % US_PER_SECOND));
+}
+
+static void
+sim_send(void *user, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Count replies and events as they finish on the line
+//----------------------------------------------------------------------
+{
+	sim *s = (sim *)user;
+
+	s->output_bytes += len;
+	if (s->verbose) {
+		print_time(s);
+		printf("%.*s\n", (int)len, buffer);
+	}
+}
+
+static void
+sim_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Queue replies and events for the line
+//----------------------------------------------------------------------
+{
+	sim *s = (sim *)user;
+
+	if (s->out) {
+		moas_line_write(s->out, buffer);
+	}
+	else {
+		sim_send(s, buffer, strlen(buffer));
+	}
+}
+
+static void
+sim_relays(void *user, uint64_t changed, uint64_t relays,
+	int changed_inhibits, int inhibits)
+//----------------------------------------------------------------------
+// Count relay and inhibit changes
+//----------------------------------------------------------------------
+{
+	sim *s = (sim *)user;
+
+	s->relay_changes++;
+	if (s->verbose) {
+		print_time(s);
+		printf("relays %016llx inhibits %02x\n",
+			   (unsigned long long)relays, inhibits);
+	}
+}
+
+static void
+sim_antennas(void *user, int changed, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Count antenna changes
+//----------------------------------------------------------------------
+{
+	sim *s = (sim *)user;
+	int i;
+
+	s->antenna_changes++;
+	if (s->verbose) {
+		print_time(s);
+		printf("antennas");
+		for (i=0; i<MOAS_STATIONS; i++) {
+			printf(" %d/%d", tx[i], rx[i]);
+		}
+		printf("\n");
+	}
+}
+
+static int
+read_script(sim *s)
+//----------------------------------------------------------------------
+// Read the next scenario line and queue an event for it.  Returns
+// FALSE at the end or if the line is wrong.
+//----------------------------------------------------------------------
+{
+	unsigned long long ms;
+	uint64_t when;
+	char *end;
+
+	while (fgets(s->next_line, sizeof(s->next_line), s->script)) {
+		s->script_line++;
+
+		end = s->next_line + strcspn(s->next_line, "\r\n");
+		*end = '\0';
+		if ((s->next_line[0] == '\0') || (s->next_line[0] == '#')) {
+			continue;
+		}
+
+		ms = strtoull(s->next_line, &end, 10);
+		when = ms * US_PER_MS;
+		if ((end == s->next_line) || (*end != ' ') || (when < s->now)) {
+			fprintf(stderr, "moas_sim: bad time on scenario line %ld\n",
+					s->script_line);
+			s->failed = TRUE;
+			return FALSE;
+		}
+
+		// Keep the input after the time
+		memmove(s->next_line, end + 1, strlen(end + 1) + 1);
+		queue_event(s, when, EVENT_SCRIPT, 0);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+script_line(sim *s)
+//----------------------------------------------------------------------
+// Carry out a scenario line and queue the next one
+//----------------------------------------------------------------------
+{
+	const char *line = s->next_line;
+	int station;
+
+	if (line[0] == '.') {
+		station = atoi(line + 2);
+		if (((line[1] != 't') && (line[1] != 'r')) ||
+			(station < 1) || (station > MOAS_STATIONS)) {
+			fprintf(stderr, "moas_sim: bad driver line on scenario line %ld\n",
+					s->script_line);
+			s->failed = TRUE;
+		}
+		else {
+			txrx(s, station, line[1] == 't');
+		}
+	}
+	else {
+		send_line(s, line, strlen(line));
+	}
+
+	read_script(s);
+}
+
+static void
+send_band(sim *s, int station)
+//----------------------------------------------------------------------
+// Send the antenna command for a station's band and queue the next
+// band change.  The antennas start at 1 and the relays at 0.
+//----------------------------------------------------------------------
+{
+	char cmd[8];
+	int n = s->band[station] * MOAS_STATIONS + station;
+
+	sprintf(cmd, "!%cB%c%c;", '1' + station, sixbit[n + 1], sixbit[n]);
+	send_line(s, cmd, strlen(cmd));
+
+	queue_event(s, s->now + random_time(s, 5 * 60 * US_PER_SECOND,
+										60 * 60 * US_PER_SECOND),
+				EVENT_BAND, station);
+}
+
+static void
+change_band(sim *s, int station)
+//----------------------------------------------------------------------
+// Move a station to another band
+//----------------------------------------------------------------------
+{
+	// An operator does not change band in the middle of a transmission
+	if (s->transmitting[station]) {
+		queue_event(s, s->now + US_PER_SECOND, EVENT_BAND, station);
+		return;
+	}
+
+	s->band[station] = (s->band[station] + 1 +
+						(int)(next_random(s) % (SIM_BANDS-1))) % SIM_BANDS;
+	send_band(s, station);
+}
+
+static void
+push_to_talk(sim *s, int station)
+//----------------------------------------------------------------------
+// Start or end a station's transmission and queue the next change
+//----------------------------------------------------------------------
+{
+	uint64_t next;
+
+	s->transmitting[station] = !s->transmitting[station];
+	txrx(s, station + 1, s->transmitting[station]);
+
+	// Short calls and exchanges with longer pauses to listen between
+	if (s->pileup) {
+		next = random_time(s, US_PER_SECOND / 5, s->transmitting[station] ?
+						   2 * US_PER_SECOND : 3 * US_PER_SECOND);
+	}
+	else if (s->transmitting[station]) {
+		next = random_time(s, US_PER_SECOND / 2, 10 * US_PER_SECOND);
+	}
+	else {
+		next = random_time(s, US_PER_SECOND, 30 * US_PER_SECOND);
+	}
+	queue_event(s, s->now + next, EVENT_PTT, station);
+}
+
+static void
+generate(sim *s)
+//----------------------------------------------------------------------
+// Start the generated traffic
+//----------------------------------------------------------------------
+{
+	int i;
+
+	send_line(s, "*1;*A;*T;*I;", 12);
+	for (i=0; i<MOAS_STATIONS; i++) {
+		s->band[i] = (int)(next_random(s) % SIM_BANDS);
+		send_band(s, i);
+		queue_event(s, random_time(s, US_PER_SECOND, 30 * US_PER_SECOND),
+					EVENT_PTT, i);
+	}
+}
+
+static void
+advance(sim *s, uint64_t when)
+//----------------------------------------------------------------------
+// Expire the switch's timers due by a time, one time at a time so the
+// virtual time is right while they run
+//----------------------------------------------------------------------
+{
+	uint64_t due;
+
+	while (moas_wheel_next(s->wheel, &due) && (due <= when)) {
+		if (due > s->now) {
+			s->now = due;
+		}
+		s->timers += moas_wheel_advance(s->wheel, due);
+	}
+	moas_wheel_advance(s->wheel, when);
+	s->now = when;
+}
+
+static void
+run(sim *s)
+//----------------------------------------------------------------------
+// Handle events in order until there are none
+//----------------------------------------------------------------------
+{
+	sim_event event;
+	uint64_t due;
+
+	while (s->event_count) {
+		take_event(s, &event);
+
+		// Generated traffic ends, but what is already on the line and
+		// the script still run
+		if ((event.when > s->end) &&
+			((event.type == EVENT_PTT) || (event.type == EVENT_BAND))) {
+			continue;
+		}
+
+		// Timers due by now go first
+		advance(s, event.when);
+		s->handled++;
+
+		switch (event.type) {
+		case EVENT_SCRIPT:
+			script_line(s);
+			break;
+
+		case EVENT_ARRIVE:
+			arrive(s);
+			break;
+
+		case EVENT_PTT:
+			push_to_talk(s, event.station);
+			break;
+
+		case EVENT_BAND:
+			change_band(s, event.station);
+			break;
+		}
+	}
+
+	// Let the switch finish with its timers
+	while (moas_wheel_next(s->wheel, &due)) {
+		advance(s, due);
+	}
+}
+
+static void
+print_line_stats(sim *s)
+//----------------------------------------------------------------------
+// Print what happened on the switch's output queue
+//----------------------------------------------------------------------
+{
+	moas_line_stats stats;
+	unsigned long long total = 0;
+	double p99;
+	int i;
+
+	moas_line_read_stats(s->out, &stats);
+
+	// The bucket which takes the count past 99% has the upper bound
+	for (i=0; i<MOAS_LINE_BUCKETS-1; i++) {
+		total += stats.delays[i];
+		if (total * 100 >= stats.sent * 99) {
+			break;
+		}
+	}
+	p99 = (i < MOAS_LINE_BUCKETS-1) ? (double)(1 << i) :
+		  stats.delay_max / 1000.0;
+	if (p99 > stats.delay_max / 1000.0) {
+		p99 = stats.delay_max / 1000.0;
+	}
+
+	printf("messages %llu dropped %llu max_depth %d average_depth %.3f "
+		   "busy %.1f delay_mean_ms %.3f delay_p99_ms %.3f "
+		   "delay_max_ms %.3f\n",
+		   stats.messages, stats.dropped, stats.max_depth,
+		   stats.time ? (double)stats.depth_time / stats.time : 0.0,
+		   stats.time ? 100.0 * stats.busy_time / stats.time : 0.0,
+		   stats.sent ? stats.delay_total / 1000.0 / stats.sent : 0.0,
+		   p99, stats.delay_max / 1000.0);
+}
+
+int main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Run a scenario on virtual time and report what happened
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+	static sim s;
+	const char *config = NULL;
+	double hours = 0;
+	double start;
+	double elapsed;
+	double virtual_seconds;
+	long baud = 9600;
+	int depth = MOAS_LINE_DEPTH;
+	int i;
+
+	s.seed = 1;
+
+	for (i=1; (i < argc) && (argv[i][0] == '-') && argv[i][1]; i++) {
+		if (strcmp(argv[i], "-v") == 0) {
+			s.verbose = TRUE;
+		}
+		else if ((strcmp(argv[i], "-c") == 0) && (i+1 < argc)) {
+			config = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-b") == 0) && (i+1 < argc)) {
+			baud = atol(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-q") == 0) && (i+1 < argc)) {
+			depth = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			s.pileup = TRUE;
+		}
+		else if ((strcmp(argv[i], "-g") == 0) && (i+1 < argc)) {
+			hours = atof(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-s") == 0) && (i+1 < argc)) {
+			s.seed = strtoul(argv[++i], NULL, 10);
+		}
+		else {
+			usage();
+		}
+	}
+	if ((i < argc - 1) || (baud < 0) || (depth < 1) || (hours < 0)) {
+		usage();
+	}
+	if ((i == argc) && (hours == 0)) {
+		usage();
+	}
+
+	if (i == argc - 1) {
+		s.script = fopen(argv[i], "r");
+		if (s.script == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+	}
+
+	s.line.char_time = baud ? (10 * US_PER_SECOND) / baud : 0;
+	s.end = (uint64_t)(hours * US_PER_HOUR);
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = sim_write;
+	callbacks.relays_changed = sim_relays;
+	callbacks.antennas_changed = sim_antennas;
+
+	// The wheel has no clock so time only moves with the events
+	s.wheel = moas_wheel_create(NULL, NULL);
+	s.sw = moas_create(&callbacks, &s);
+	if ((s.wheel == NULL) || (s.sw == NULL)) {
+		no_memory();
+	}
+	moas_timers_ctx(s.sw, s.wheel);
+	if (baud) {
+		s.out = moas_line_create(s.wheel, baud, depth, sim_send, &s);
+		if (s.out == NULL) {
+			no_memory();
+		}
+		moas_line_report(s.out, s.sw);
+	}
+	if (config && !moas_config_load(s.sw, config)) {
+		fprintf(stderr, "moas_sim: %s is not a configuration image\n",
+				config);
+		return 1;
+	}
+
+	start = now();
+
+	if (s.script) {
+		read_script(&s);
+	}
+	if (hours > 0) {
+		generate(&s);
+	}
+	run(&s);
+
+	elapsed = now() - start;
+	virtual_seconds = (double)s.now / US_PER_SECOND;
+
+	printf("virtual_seconds %.3f seconds %.6f speedup %.0f events %lu "
+		   "commands %lu command_bytes %llu txrx %lu timers %lu "
+		   "output_bytes %llu relay_changes %lu antenna_changes %lu\n",
+		   virtual_seconds, elapsed,
+		   elapsed > 0 ? virtual_seconds / elapsed : 0.0,
+		   s.handled, s.commands, s.command_bytes, s.txrx, s.timers,
+		   s.output_bytes, s.relay_changes, s.antenna_changes);
+	if (s.out) {
+		print_line_stats(&s);
+	}
+
+	moas_destroy(s.sw);
+	moas_line_destroy(s.out);
+	moas_wheel_destroy(s.wheel);
+	free(s.events);
+	if (s.script) {
+		fclose(s.script);
+	}
+	return s.failed ? 1 : 0;
+}
@@ -0,0 +1,376 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator relay list kernels
+
+#include <string.h>
+
+#include "moas_simd.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// The vector versions are only built by x86 compilers which can build
+// them for a processor other than the one being compiled for.  GCC and
+// Clang need to be told which instructions a routine may use.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#define TARGET(t) __attribute__((target(t)))
+#elif defined(_MSC_VER) && (_MSC_VER >= 1700) && \
+	(defined(_M_X64) || defined(_M_IX86))
+#define SIMD_X86
+#define TARGET(t)
+#endif
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// These are the instruction sets the routines are written for
+#define LEVEL_SCALAR  0
+#define LEVEL_SSE42   1
+#define LEVEL_AVX2    2
+
+static int
+cpu_level(void)
+//----------------------------------------------------------------------
+// Work out the best instruction set this processor has
+//----------------------------------------------------------------------
+{
+#if defined(SIMD_X86) && defined(__GNUC__)
+	// The compiler's run time has already asked the processor
+	if (__builtin_cpu_supports("avx2")) {
+		return LEVEL_AVX2;
+	}
+	if (__builtin_cpu_supports("sse4.2")) {
+		return LEVEL_SSE42;
+	}
+	return LEVEL_SCALAR;
+#elif defined(SIMD_X86)
+	// Asking the processor is slow, so it is only done once.  Every
+	// thread works out the same answer so it does not matter which
+	// one stores it.
+	static volatile int level = -1;
+	int info[4];
+	int l;
+
+	if (level < 0) {
+		l = LEVEL_SCALAR;
+		__cpuid(info, 1);
+		if (info[2] & (1<<20)) {
+			l = LEVEL_SSE42;
+		}
+
+		// AVX2 also needs the system to save the YMM registers
+		if ((info[2] & (1<<27)) && (info[2] & (1<<28)) &&
+			((_xgetbv(0) & 6) == 6)) {
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1<<5)) {
+				l = LEVEL_AVX2;
+			}
+		}
+		level = l;
+	}
+	return level;
+#else
+	return LEVEL_SCALAR;
+#endif
+}
+
+static uint64_t
+decode_scalar(const char *digits, size_t len, int *invalid)
+//----------------------------------------------------------------------
+// Decode relay digits one at a time, without branches
+//----------------------------------------------------------------------
+{
+	uint64_t relays = 0;
+	int bad = 0;
+	int ok;
+	int c;
+	int v;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		c = (unsigned char)digits[i];
+		ok = ((c >= '0') & (c <= '9')) |
+			 ((c >= 'A') & (c <= 'Z')) |
+			 ((c >= 'a') & (c <= 'z')) |
+			 (c == '{') | (c == '}');
+		v = c - '0' - (7 * (c >= 'A')) - (6 * (c >= 'a')) - (c == '}');
+		bad |= !ok;
+		relays |= (uint64_t)ok << (v & 63);
+	}
+
+	*invalid = bad;
+	return relays;
+}
+
+static void
+encode_scalar(uint64_t relays, char *digits)
+//----------------------------------------------------------------------
+// Encode relay digits one at a time
+//----------------------------------------------------------------------
+{
+	int v;
+	int i;
+
+	for (i=0; i<MOAS_RELAY_DIGITS; i++) {
+		v = (int)(relays >> (6 * (MOAS_RELAY_DIGITS-1-i))) & 0x3f;
+		digits[i] = (char)(v + '0' + (7 * (v > 9)) + (6 * (v > 35)) +
+						   (v > 62));
+	}
+}
+
+#ifdef SIMD_X86
+
+static TARGET("avx2") __m256i
+values_avx2(__m256i c, __m256i *ok)
+//----------------------------------------------------------------------
+// Convert 32 sixbit characters to their values.  ok is set to all ones
+// in each byte holding a sixbit character.
+//----------------------------------------------------------------------
+{
+	__m256i digit;
+	__m256i upper;
+	__m256i lower;
+	__m256i close;
+	__m256i v;
+
+	// The characters are compared as signed so anything past 127 is
+	// below every range
+	digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0'-1)),
+							 _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), c));
+	upper = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A'-1)),
+							 _mm256_cmpgt_epi8(_mm256_set1_epi8('Z'+1), c));
+	lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a'-1)),
+							 _mm256_cmpgt_epi8(_mm256_set1_epi8('z'+1), c));
+	close = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('}'));
+	*ok = _mm256_or_si256(_mm256_or_si256(digit, upper),
+						  _mm256_or_si256(lower, close));
+	*ok = _mm256_or_si256(*ok, _mm256_cmpeq_epi8(c, _mm256_set1_epi8('{')));
+
+	v = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	v = _mm256_sub_epi8(v, _mm256_and_si256(_mm256_set1_epi8(7),
+				_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A'-1))));
+	v = _mm256_sub_epi8(v, _mm256_and_si256(_mm256_set1_epi8(6),
+				_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a'-1))));
+	v = _mm256_sub_epi8(v, _mm256_and_si256(_mm256_set1_epi8(1), close));
+	return v;
+}
+
+static TARGET("avx2") __m256i
+relays_avx2(__m128i v)
+//----------------------------------------------------------------------
+// Turn 16 relay numbers into relay bits.  Numbers of 64 and up give
+// no relay.
+//----------------------------------------------------------------------
+{
+	const __m256i one = _mm256_set1_epi64x(1);
+	__m256i r;
+
+	// Each group of four is widened to 64 bit lanes and used as the
+	// shift count for a one in each lane
+	r = _mm256_sllv_epi64(one, _mm256_cvtepu8_epi64(v));
+	r = _mm256_or_si256(r, _mm256_sllv_epi64(one,
+				_mm256_cvtepu8_epi64(_mm_srli_si128(v, 4))));
+	r = _mm256_or_si256(r, _mm256_sllv_epi64(one,
+				_mm256_cvtepu8_epi64(_mm_srli_si128(v, 8))));
+	r = _mm256_or_si256(r, _mm256_sllv_epi64(one,
+				_mm256_cvtepu8_epi64(_mm_srli_si128(v, 12))));
+	return r;
+}
+
+static TARGET("avx2") uint64_t
+decode_avx2(const char *digits, size_t len, int *invalid)
+//----------------------------------------------------------------------
+// Decode relay digits 32 at a time
+//----------------------------------------------------------------------
+{
+	const __m256i lane = _mm256_setr_epi8(
+		 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+		16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+	__m256i relays = _mm256_setzero_si256();
+	__m256i bad = _mm256_setzero_si256();
+	__m256i c;
+	__m256i v;
+	__m256i ok;
+	__m256i in;
+	__m128i r;
+	char chunk[32];
+	uint64_t result;
+	size_t n;
+
+	while (len > 0) {
+		n = (len < 32) ? len : 32;
+
+		// A short piece is copied so nothing past the end is read
+		if (n < 32) {
+			memset(chunk, 0, sizeof(chunk));
+			memcpy(chunk, digits, n);
+			c = _mm256_loadu_si256((const __m256i *)chunk);
+		}
+		else {
+			c = _mm256_loadu_si256((const __m256i *)digits);
+		}
+		in = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)n), lane);
+
+		v = values_avx2(c, &ok);
+		bad = _mm256_or_si256(bad, _mm256_andnot_si256(ok, in));
+
+		// Anything which is not a digit gets a value too big to shift
+		ok = _mm256_and_si256(ok, in);
+		v = _mm256_or_si256(v, _mm256_andnot_si256(ok,
+											_mm256_set1_epi8(-1)));
+
+		relays = _mm256_or_si256(relays,
+					relays_avx2(_mm256_castsi256_si128(v)));
+		relays = _mm256_or_si256(relays,
+					relays_avx2(_mm256_extracti128_si256(v, 1)));
+
+		digits += n;
+		len -= n;
+	}
+
+	*invalid = !_mm256_testz_si256(bad, bad);
+
+	r = _mm_or_si128(_mm256_castsi256_si128(relays),
+					 _mm256_extracti128_si256(relays, 1));
+	r = _mm_or_si128(r, _mm_unpackhi_epi64(r, r));
+	_mm_storel_epi64((__m128i *)&result, r);
+	return result;
+}
+
+static TARGET("sse4.2") uint64_t
+decode_sse42(const char *digits, size_t len, int *invalid)
+//----------------------------------------------------------------------
+// Decode relay digits 16 at a time
+//----------------------------------------------------------------------
+{
+	const __m128i ranges = _mm_setr_epi8('0', '9', 'A', 'Z', 'a', 'z',
+		'{', '{', '}', '}', 0, 0, 0, 0, 0, 0);
+	uint64_t relays = 0;
+	unsigned char values[16];
+	char chunk[16];
+	__m128i c;
+	__m128i v;
+	size_t n;
+	size_t i;
+
+	while (len > 0) {
+		n = (len < 16) ? len : 16;
+
+		// A short piece is copied so nothing past the end is read
+		if (n < 16) {
+			memset(chunk, 0, sizeof(chunk));
+			memcpy(chunk, digits, n);
+			c = _mm_loadu_si128((const __m128i *)chunk);
+		}
+		else {
+			c = _mm_loadu_si128((const __m128i *)digits);
+		}
+
+		// Look for a character outside the sixbit ranges
+		if (_mm_cmpestri(ranges, 10, c, (int)n,
+						 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+						 _SIDD_MASKED_NEGATIVE_POLARITY) < (int)n) {
+			*invalid = TRUE;
+			return 0;
+		}
+
+		v = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+		v = _mm_sub_epi8(v, _mm_and_si128(_mm_set1_epi8(7),
+					_mm_cmpgt_epi8(c, _mm_set1_epi8('A'-1))));
+		v = _mm_sub_epi8(v, _mm_and_si128(_mm_set1_epi8(6),
+					_mm_cmpgt_epi8(c, _mm_set1_epi8('a'-1))));
+		v = _mm_sub_epi8(v, _mm_and_si128(_mm_set1_epi8(1),
+					_mm_cmpeq_epi8(c, _mm_set1_epi8('}'))));
+		_mm_storeu_si128((__m128i *)values, v);
+
+		for (i=0; i<n; i++) {
+			relays |= (uint64_t)1 << values[i];
+		}
+
+		digits += n;
+		len -= n;
+	}
+
+	*invalid = FALSE;
+	return relays;
+}
+
+static TARGET("sse4.2") void
+encode_sse42(uint64_t relays, char *digits)
+//----------------------------------------------------------------------
+// Encode all the relay digits at once
+//----------------------------------------------------------------------
+{
+	uint64_t low = relays & 0xffffffffffffULL;
+	uint64_t high = relays >> 48;
+	char buffer[16];
+	__m128i v;
+	__m128i c;
+
+	// Move each six relays into a byte of their own by splitting the
+	// fields in half three times.  PDEP would do this in one
+	// instruction but it is very slow on some processors.
+	low = (low & 0xffffffULL) | ((low & 0xffffff000000ULL) << 8);
+	low = (low & 0x00000fff00000fffULL) | ((low & 0x00fff00000fff000ULL) << 4);
+	low = (low & 0x003f003f003f003fULL) | ((low & 0x0fc00fc00fc00fc0ULL) << 2);
+	high = (high & 0x3f) | ((high & 0xfc0) << 2) | ((high & 0xf000) << 4);
+
+	// Byte n now holds the digit for relays 6n and up
+	v = _mm_set_epi64x((long long)high, (long long)low);
+
+	// Convert the values to sixbit characters
+	c = _mm_add_epi8(v, _mm_set1_epi8('0'));
+	c = _mm_add_epi8(c, _mm_and_si128(_mm_set1_epi8(7),
+			_mm_cmpgt_epi8(v, _mm_set1_epi8(9))));
+	c = _mm_add_epi8(c, _mm_and_si128(_mm_set1_epi8(6),
+			_mm_cmpgt_epi8(v, _mm_set1_epi8(35))));
+	c = _mm_add_epi8(c, _mm_and_si128(_mm_set1_epi8(1),
+			_mm_cmpgt_epi8(v, _mm_set1_epi8(62))));
+
+	// The highest digit goes first
+	c = _mm_shuffle_epi8(c, _mm_setr_epi8(10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+										  -1, -1, -1, -1, -1));
+	_mm_storeu_si128((__m128i *)buffer, c);
+	memcpy(digits, buffer, MOAS_RELAY_DIGITS);
+}
+
+#endif
+
+uint64_t moas_simd_decode_relays(const char *digits, size_t len, int *invalid)
+//----------------------------------------------------------------------
+// Decode a list of sixbit relay digits into a relay mask
+//----------------------------------------------------------------------
+{
+#ifdef SIMD_X86
+	switch (cpu_level()) {
+	case LEVEL_AVX2:
+		return decode_avx2(digits, len, invalid);
+
+	case LEVEL_SSE42:
+		return decode_sse42(digits, len, invalid);
+	}
+#endif
+	return decode_scalar(digits, len, invalid);
+}
+
+void moas_simd_encode_relays(uint64_t relays, char *digits)
+//----------------------------------------------------------------------
+// Encode a relay mask as sixbit digits
+//----------------------------------------------------------------------
+{
+#ifdef SIMD_X86
+	if (cpu_level() != LEVEL_SCALAR) {
+		encode_sse42(relays, digits);
+		return;
+	}
+#endif
+	encode_scalar(relays, digits);
+}
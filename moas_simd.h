@@ -0,0 +1,43 @@
+//345678901234567890123456789012345678901234567890123456789012345678901234567890
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator relay list kernels
+//
+// These convert between relay masks and the sixbit digits used for them
+// on the serial line.  Where the processor has them, AVX2 or SSE4.2
+// versions are used, chosen when the routine is called.  Otherwise
+// plain C versions are used.
+
+#ifndef MOAS_SIMD_H
+#define MOAS_SIMD_H
+
+#include "moas.h"
+
+// Number of sixbit digits in an encoded relay mask
+#define MOAS_RELAY_DIGITS  ((MOAS_RELAYS+5)/6)
+
+// Decode a list of sixbit relay digits into a relay mask
+// Routine:  moas_simd_decode_relays
+//
+// Inputs:
+//    digits  Relay digits, one sixbit character for each relay
+//    len     Number of digits
+//    invalid Set to TRUE if any digit is not a sixbit character,
+//            otherwise FALSE
+// Outputs:
+//    Returns the relays, relay n in bit n.  The value is meaningless
+//    if any digit was invalid.
+uint64_t moas_simd_decode_relays(const char *digits, size_t len,
+	int *invalid);
+
+// Encode a relay mask as sixbit digits.  The first digit holds the four
+// highest relays and each following digit holds the next six.
+// Routine:  moas_simd_encode_relays
+//
+// Inputs:
+//    relays  Relays, relay n in bit n
+//    digits  Filled in with MOAS_RELAY_DIGITS characters.  It is not
+//            null terminated.
+void moas_simd_encode_relays(uint64_t relays, char *digits);
+
+#endif
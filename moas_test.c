@@ -0,0 +1,177 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - tests
+//
+// This checks behaviour of the engine which a trace replay cannot show
+// because the recorded and the replayed switch would both have it.
+//
+//    moas_test [name ...]
+//
+//    name      Only run tests whose names start with one of these
+//
+// Each test reports PASS or FAIL with the reason.  The exit status is 1
+// if any test failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "moas.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// Everything one test works with
+typedef struct test_state {
+	moas_ctx *sw;
+
+	// Relay updates reported by the switch, and the relays which were
+	// selected in any of them
+	int updates;
+	uint64_t relays_seen;
+
+	// The relays selected now
+	uint64_t relays;
+
+	// Why the test failed, or NULL
+	const char *failure;
+} test_state;
+
+typedef struct test {
+	const char *name;
+	void (*run)(test_state *t);
+} test;
+
+static void
+test_relays(void *user, uint64_t changed, uint64_t relays,
+	int changed_inhibits, int inhibits)
+//----------------------------------------------------------------------
+// Record relay updates
+//----------------------------------------------------------------------
+{
+	test_state *t = (test_state *)user;
+
+	if (changed) {
+		t->updates++;
+		t->relays_seen |= relays;
+	}
+	t->relays = relays;
+}
+
+static void
+send_commands(test_state *t, const char *commands)
+//----------------------------------------------------------------------
+// Give commands to the switch
+//----------------------------------------------------------------------
+{
+	moas_feed_ctx(t->sw, commands, strlen(commands));
+}
+
+static void
+check(test_state *t, int ok, const char *failure)
+//----------------------------------------------------------------------
+// Record the first check which failed
+//----------------------------------------------------------------------
+{
+	if (!ok && !t->failure) {
+		t->failure = failure;
+	}
+}
+
+static void
+test_batch_txrx(test_state *t)
+//----------------------------------------------------------------------
+// Station 1 is on antenna 1 using relay 1.  A batch moves its transmit
+// antenna to 2 with relay 2 and it keys before its receive antenna is
+// moved too.  Keying must only use the changes from before the batch,
+// so relay 2 is not selected until the batch is committed.
+//----------------------------------------------------------------------
+{
+	send_commands(t, "*1;*A;!1B11;");
+	check(t, t->relays == (1ULL<<1), "relay 1 not selected before batch");
+
+	send_commands(t, "#B;!1T22;");
+	t->updates = 0;
+	t->relays_seen = 0;
+
+	moas_txrx_ctx(t->sw, 1, TRUE);
+	check(t, !(t->relays_seen & (1ULL<<2)),
+		  "relays updated from the half staged batch");
+	moas_txrx_ctx(t->sw, 1, FALSE);
+	check(t, !(t->relays_seen & (1ULL<<2)),
+		  "relays updated from the half staged batch after unkeying");
+
+	send_commands(t, "!1R22;#E;");
+	check(t, t->relays == (1ULL<<2), "relay 2 not selected after batch");
+
+	moas_txrx_ctx(t->sw, 1, TRUE);
+	check(t, t->relays == (1ULL<<2), "relay 2 not used to transmit");
+}
+
+static const test tests[] = {
+	{ "batch_txrx", test_batch_txrx },
+};
+
+#define TESTS ((int)(sizeof(tests)/sizeof(tests[0])))
+
+static int
+selected(const char *name, int argc, char **argv)
+//----------------------------------------------------------------------
+// Return TRUE if a test was asked for
+//----------------------------------------------------------------------
+{
+	int i;
+
+	if (argc <= 1) {
+		return TRUE;
+	}
+	for (i=1; i<argc; i++) {
+		if (strncmp(name, argv[i], strlen(argv[i])) == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+int
+main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Run the tests
+//----------------------------------------------------------------------
+{
+	moas_callbacks callbacks;
+	test_state t;
+	int failed = 0;
+	int i;
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.relays_changed = test_relays;
+
+	for (i=0; i<TESTS; i++) {
+		if (!selected(tests[i].name, argc, argv)) {
+			continue;
+		}
+
+		memset(&t, 0, sizeof(t));
+		t.sw = moas_create(&callbacks, &t);
+		if (!t.sw) {
+			fprintf(stderr, "moas_test: no memory\n");
+			return 1;
+		}
+
+		tests[i].run(&t);
+		moas_destroy(t.sw);
+
+		if (t.failure) {
+			printf("FAIL %s: %s\n", tests[i].name, t.failure);
+			failed++;
+		}
+		else {
+			printf("PASS %s\n", tests[i].name);
+		}
+	}
+	return failed ? 1 : 0;
+}
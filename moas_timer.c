@@ -0,0 +1,332 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator timers
+
+#include <stdlib.h>
+
+#include "moas_timer.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+// The wheel has levels of 64 slots.  Level n holds the timers which
+// expire in the same block of 64^(n+1) microseconds as the wheel's time
+// but not the same block of 64^n, in the slot for their digit n.  So
+// every timer in a level 0 slot expires at the same time, and when the
+// wheel's time reaches a slot of a higher level its timers move down.
+// Eleven levels cover every 64 bit time.
+//
+// Each level has a bit for every slot which may hold timers so the
+// earliest one is found without looking at the empty ones.  Stopping a
+// timer does not clear the bit.  It is cleared when the slot is found
+// to be empty.
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1<<WHEEL_BITS)
+#define WHEEL_LEVELS  11
+
+struct moas_wheel {
+	moas_clock clock;
+	void *user;
+
+	// Time the wheel has reached.  Every running timer expires at
+	// this time or later.
+	uint64_t now;
+
+	uint64_t occupied[WHEEL_LEVELS];
+	moas_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static int
+lowest_bit(uint64_t bits)
+//----------------------------------------------------------------------
+// Return the number of the lowest bit set in a non-zero value
+//----------------------------------------------------------------------
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(bits);
+#else
+	int n = 0;
+
+	while (!(bits & 1)) {
+		bits >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static int
+highest_bit(uint64_t bits)
+//----------------------------------------------------------------------
+// Return the number of the highest bit set in a non-zero value
+//----------------------------------------------------------------------
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(bits);
+#else
+	int n = 0;
+
+	while (bits >>= 1) {
+		n++;
+	}
+	return n;
+#endif
+}
+
+static void
+link_timer(moas_timer **head, moas_timer *timer)
+//----------------------------------------------------------------------
+// Put a timer at the front of a list
+//----------------------------------------------------------------------
+{
+	timer->next = *head;
+	if (timer->next) {
+		timer->next->prev = &timer->next;
+	}
+	timer->prev = head;
+	*head = timer;
+}
+
+static void
+unlink_timer(moas_timer *timer)
+//----------------------------------------------------------------------
+// Take a running timer out of its list
+//----------------------------------------------------------------------
+{
+	*timer->prev = timer->next;
+	if (timer->next) {
+		timer->next->prev = timer->prev;
+	}
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+static void
+place_timer(moas_wheel *wheel, moas_timer *timer)
+//----------------------------------------------------------------------
+// Put a timer in the slot for its time
+//----------------------------------------------------------------------
+{
+	uint64_t when = timer->when;
+	int level = 0;
+	int slot;
+
+	if (when < wheel->now) {
+		when = wheel->now;
+	}
+	if (when != wheel->now) {
+		level = highest_bit(when ^ wheel->now) / WHEEL_BITS;
+	}
+	slot = (int)(when >> (level*WHEEL_BITS)) & (WHEEL_SLOTS-1);
+
+	link_timer(&wheel->slots[level][slot], timer);
+	wheel->occupied[level] |= ((uint64_t)1) << slot;
+}
+
+static int
+first_slot(moas_wheel *wheel, int *slot, uint64_t *start)
+//----------------------------------------------------------------------
+// Find the slot with the earliest timers and the earliest time it
+// covers.  Returns its level, or -1 if there are no timers.
+//----------------------------------------------------------------------
+{
+	uint64_t block;
+	int level;
+	int shift;
+
+	for (level=0; level<WHEEL_LEVELS; level++) {
+		while (wheel->occupied[level]) {
+			*slot = lowest_bit(wheel->occupied[level]);
+			if (wheel->slots[level][*slot]) {
+				shift = (level+1) * WHEEL_BITS;
+				block = (shift < 64) ? (wheel->now >> shift) << shift : 0;
+				*start = block | ((uint64_t)*slot << (level*WHEEL_BITS));
+				return level;
+			}
+			wheel->occupied[level] &= ~(((uint64_t)1) << *slot);
+		}
+	}
+	return -1;
+}
+
+static void
+take_slot(moas_wheel *wheel, int level, int slot, moas_timer **list)
+//----------------------------------------------------------------------
+// Move the timers in a slot to a list with the oldest first
+//----------------------------------------------------------------------
+{
+	moas_timer *timer = wheel->slots[level][slot];
+	moas_timer *next;
+
+	wheel->slots[level][slot] = NULL;
+	wheel->occupied[level] &= ~(((uint64_t)1) << slot);
+
+	// The slot has the newest first
+	*list = NULL;
+	while (timer) {
+		next = timer->next;
+		link_timer(list, timer);
+		timer = next;
+	}
+}
+
+moas_wheel *moas_wheel_create(moas_clock clock, void *user)
+//----------------------------------------------------------------------
+// Create a timing wheel
+//----------------------------------------------------------------------
+{
+	moas_wheel *wheel = (moas_wheel *)calloc(1, sizeof(moas_wheel));
+
+	if (wheel == NULL) {
+		return NULL;
+	}
+
+	wheel->clock = clock;
+	wheel->user = user;
+	wheel->now = clock ? clock(user) : 0;
+	return wheel;
+}
+
+void moas_wheel_destroy(moas_wheel *wheel)
+//----------------------------------------------------------------------
+// Stop every timer and free a wheel
+//----------------------------------------------------------------------
+{
+	int level;
+	int slot;
+
+	if (wheel == NULL) {
+		return;
+	}
+
+	for (level=0; level<WHEEL_LEVELS; level++) {
+		for (slot=0; slot<WHEEL_SLOTS; slot++) {
+			while (wheel->slots[level][slot]) {
+				unlink_timer(wheel->slots[level][slot]);
+			}
+		}
+	}
+	free(wheel);
+}
+
+uint64_t moas_wheel_now(moas_wheel *wheel)
+//----------------------------------------------------------------------
+// Get the time
+//----------------------------------------------------------------------
+{
+	uint64_t now;
+
+	if (wheel->clock) {
+		now = wheel->clock(wheel->user);
+		if (now > wheel->now) {
+			return now;
+		}
+	}
+	return wheel->now;
+}
+
+int moas_wheel_advance(moas_wheel *wheel, uint64_t now)
+//----------------------------------------------------------------------
+// Expire the timers due by a time
+//----------------------------------------------------------------------
+{
+	moas_timer *list;
+	moas_timer *timer;
+	uint64_t start;
+	int expired = 0;
+	int level;
+	int slot;
+
+	while ((level = first_slot(wheel, &slot, &start)) >= 0) {
+		if (start > now) {
+			break;
+		}
+
+		// Every timer is due at or after the start of this slot, so
+		// the wheel can move there and the slot's timers either
+		// expire or move to a lower level.  The list is on the stack
+		// but an expire routine may still stop the timers in it.
+		wheel->now = start;
+		take_slot(wheel, level, slot, &list);
+		while (list) {
+			timer = list;
+			unlink_timer(timer);
+			if (level == 0) {
+				expired++;
+				timer->expire(timer, timer->user);
+			}
+			else {
+				place_timer(wheel, timer);
+			}
+		}
+	}
+
+	if (now > wheel->now) {
+		wheel->now = now;
+	}
+	return expired;
+}
+
+int moas_wheel_run(moas_wheel *wheel)
+//----------------------------------------------------------------------
+// Expire the timers due by the clock's time
+//----------------------------------------------------------------------
+{
+	return moas_wheel_advance(wheel, moas_wheel_now(wheel));
+}
+
+int moas_wheel_next(moas_wheel *wheel, uint64_t *when)
+//----------------------------------------------------------------------
+// Find the earliest time a timer can expire
+//----------------------------------------------------------------------
+{
+	int slot;
+
+	return first_slot(wheel, &slot, when) >= 0;
+}
+
+void moas_timer_init(moas_timer *timer,
+	void (*expire)(moas_timer *timer, void *user), void *user)
+//----------------------------------------------------------------------
+// Set up a timer
+//----------------------------------------------------------------------
+{
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->when = 0;
+	timer->expire = expire;
+	timer->user = user;
+}
+
+void moas_timer_start(moas_wheel *wheel, moas_timer *timer, uint64_t when)
+//----------------------------------------------------------------------
+// Start or restart a timer
+//----------------------------------------------------------------------
+{
+	if (timer->prev) {
+		unlink_timer(timer);
+	}
+	timer->when = when;
+	place_timer(wheel, timer);
+}
+
+void moas_timer_stop(moas_timer *timer)
+//----------------------------------------------------------------------
+// Stop a timer
+//----------------------------------------------------------------------
+{
+	if (timer->prev) {
+		unlink_timer(timer);
+	}
+}
+
+int moas_timer_running(const moas_timer *timer)
+//----------------------------------------------------------------------
+// TRUE if a timer is running
+//----------------------------------------------------------------------
+{
+	return timer->prev != NULL;
+}
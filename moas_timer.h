@@ -0,0 +1,147 @@
+//345678901234567890123456789012345678901234567890123456789012345678901234567890
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator timers
+//
+// The switch times its inhibit time, receive delay and interrupt mode
+// delay with timers kept on a timing wheel.  One wheel can hold the
+// timers of any number of switches.  Starting or stopping a timer takes
+// the same time no matter how many timers there are.
+//
+// Times are in microseconds on a clock chosen by the owner of the wheel.
+// The clock is either a routine the wheel calls to read the time, or
+// nothing, in which case the time only moves when the owner advances
+// it.  Either way timers only expire while the owner runs or advances
+// the wheel, so a test which drives the time itself gets the same
+// result every time.
+//
+// A wheel and every switch with timers on it must only be used by one
+// thread at a time.
+
+#ifndef MOAS_TIMER_H
+#define MOAS_TIMER_H
+
+#include "moas.h"
+
+// Read the time in microseconds.  It must never go back.
+typedef uint64_t (*moas_clock)(void *user);
+
+// One timer.  The owner gives it the routine to call when it expires
+// and must not change the other fields.
+typedef struct moas_timer moas_timer;
+
+struct moas_timer {
+	// The next timer in the same slot and the pointer which points at
+	// this one.  prev is NULL when the timer is not running.
+	moas_timer *next;
+	moas_timer **prev;
+
+	// Time the timer expires
+	uint64_t when;
+
+	// Called when the timer expires.  The timer is no longer running
+	// and may be started again.
+	void (*expire)(moas_timer *timer, void *user);
+	void *user;
+};
+
+// Create a timing wheel
+// Routine:  moas_wheel_create
+//
+// Inputs:
+//    clock   Routine to read the time, or NULL if the time is only
+//            changed by moas_wheel_advance
+//    user    Value passed to clock
+// Outputs:
+//    Returns the wheel or NULL if there is no memory.  Its time starts
+//    at the clock's time, or 0 if there is no clock.
+moas_wheel *moas_wheel_create(moas_clock clock, void *user);
+
+// Destroy a timing wheel.  Timers still on it are stopped.
+// Routine:  moas_wheel_destroy
+//
+// Inputs:
+//    wheel   Wheel to destroy.  NULL is ignored.
+void moas_wheel_destroy(moas_wheel *wheel);
+
+// Get the time of a wheel
+// Routine:  moas_wheel_now
+//
+// Inputs:
+//    wheel   Timing wheel
+// Outputs:
+//    Returns the clock's time, or the time the wheel was last advanced
+//    to if that is later or there is no clock
+uint64_t moas_wheel_now(moas_wheel *wheel);
+
+// Expire every timer due by a time, earliest first.  The order of
+// timers due at the same time only depends on the order they were
+// started in.  Timers started by the expire routines are expired too if
+// they are due.
+// Routine:  moas_wheel_advance
+//
+// Inputs:
+//    wheel   Timing wheel
+//    now     Time to advance to.  An earlier time than the last one
+//            is ignored.
+// Outputs:
+//    Returns the number of timers which expired
+int moas_wheel_advance(moas_wheel *wheel, uint64_t now);
+
+// Expire every timer due by the clock's time
+// Routine:  moas_wheel_run
+//
+// Inputs:
+//    wheel   Timing wheel
+// Outputs:
+//    Returns the number of timers which expired
+int moas_wheel_run(moas_wheel *wheel);
+
+// Find when the wheel next needs to be run
+// Routine:  moas_wheel_next
+//
+// Inputs:
+//    wheel   Timing wheel
+//    when    Set to a time no later than the first timer expires
+// Outputs:
+//    Returns TRUE if a timer is running, FALSE if none are and when is
+//    not set
+int moas_wheel_next(moas_wheel *wheel, uint64_t *when);
+
+// Set up a timer before it is first used
+// Routine:  moas_timer_init
+//
+// Inputs:
+//    timer   Timer
+//    expire  Routine called when the timer expires
+//    user    Value passed to expire
+void moas_timer_init(moas_timer *timer,
+	void (*expire)(moas_timer *timer, void *user), void *user);
+
+// Start a timer.  A timer which is running is started again.
+// Routine:  moas_timer_start
+//
+// Inputs:
+//    wheel   Timing wheel
+//    timer   Timer
+//    when    Time the timer expires.  A time which has passed expires
+//            the next time the wheel is run.
+void moas_timer_start(moas_wheel *wheel, moas_timer *timer, uint64_t when);
+
+// Stop a timer.  A timer which is not running is ignored.
+// Routine:  moas_timer_stop
+//
+// Inputs:
+//    timer   Timer
+void moas_timer_stop(moas_timer *timer);
+
+// Find out if a timer is running
+// Routine:  moas_timer_running
+//
+// Inputs:
+//    timer   Timer
+// Outputs:
+//    Returns TRUE if the timer is running
+int moas_timer_running(const moas_timer *timer);
+
+#endif
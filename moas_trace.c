@@ -0,0 +1,440 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator session traces
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "moas_trace.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+#define TRACE_MAGIC "MOASTRC1"
+#define TRACE_MAGIC_LEN 8
+
+// The longest a length or time can be when written
+#define NUMBER_LEN 10
+
+struct moas_trace {
+	// File being recorded, or NULL if the trace was opened
+	FILE *file;
+
+	// The host's clock, or NULL for the computer's
+	unsigned long long (*clock)(void *user);
+	void *clock_user;
+
+	// Time the recording started and time of the last record
+	unsigned long long start;
+	unsigned long long last;
+
+	// TRUE once a write to the file failed
+	int failed;
+
+	// Trace which was opened
+	unsigned char *data;
+	size_t len;
+	size_t pos;
+	unsigned long long time;
+};
+
+static unsigned long long
+now(void)
+//----------------------------------------------------------------------
+// Return a monotonic time in nanoseconds
+//----------------------------------------------------------------------
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)((double)count.QuadPart * 1e9 /
+								(double)freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static unsigned long long
+trace_now(moas_trace *trace)
+//----------------------------------------------------------------------
+// Return the time on the clock the trace is recorded with
+//----------------------------------------------------------------------
+{
+	return trace->clock ? trace->clock(trace->clock_user) : now();
+}
+
+static void
+put(moas_trace *trace, const void *data, size_t len)
+//----------------------------------------------------------------------
+// Write to the file, remembering a failure
+//----------------------------------------------------------------------
+{
+	if (fwrite(data, 1, len, trace->file) != len) {
+		trace->failed = TRUE;
+	}
+}
+
+static void
+put_number(moas_trace *trace, unsigned long long n)
+//----------------------------------------------------------------------
+// Write a length or time seven bits at a time
+//----------------------------------------------------------------------
+{
+	unsigned char buffer[NUMBER_LEN];
+	int len = 0;
+
+	while (n >= 0x80) {
+		buffer[len++] = (unsigned char)(n | 0x80);
+		n >>= 7;
+	}
+	buffer[len++] = (unsigned char)n;
+	put(trace, buffer, len);
+}
+
+static void
+put_header(moas_trace *trace, int type)
+//----------------------------------------------------------------------
+// Start a record with its type and time
+//----------------------------------------------------------------------
+{
+	unsigned long long time = trace_now(trace) - trace->start;
+	unsigned char c = (unsigned char)type;
+
+	// The clock never goes back but a time from another thread can be
+	// taken just before the last one
+	if (time < trace->last) {
+		time = trace->last;
+	}
+
+	put(trace, &c, 1);
+	put_number(trace, time - trace->last);
+	trace->last = time;
+}
+
+moas_trace *moas_trace_create(const char *path)
+//----------------------------------------------------------------------
+// Create a trace file and start recording
+//----------------------------------------------------------------------
+{
+	moas_trace *trace = (moas_trace *)calloc(1, sizeof(moas_trace));
+
+	if (trace == NULL) {
+		return NULL;
+	}
+
+	trace->file = fopen(path, "wb");
+	if (trace->file == NULL) {
+		free(trace);
+		return NULL;
+	}
+
+	trace->start = now();
+	trace->last = 0;
+	put(trace, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	return trace;
+}
+
+void moas_trace_clock(moas_trace *trace,
+	unsigned long long (*clock)(void *user), void *user)
+//----------------------------------------------------------------------
+// Take record times from the host's clock
+//----------------------------------------------------------------------
+{
+	trace->clock = clock;
+	trace->clock_user = user;
+	trace->start = trace_now(trace);
+	trace->last = 0;
+}
+
+void moas_trace_input(moas_trace *trace, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Record characters given to the switch
+//----------------------------------------------------------------------
+{
+	put_header(trace, MOAS_TRACE_INPUT);
+	put_number(trace, len);
+	put(trace, buffer, len);
+}
+
+void moas_trace_txrx(moas_trace *trace, int station, int state)
+//----------------------------------------------------------------------
+// Record a transmit/receive change
+//----------------------------------------------------------------------
+{
+	unsigned char buffer[2];
+
+	buffer[0] = (unsigned char)station;
+	buffer[1] = (unsigned char)(state != 0);
+
+	put_header(trace, MOAS_TRACE_TXRX);
+	put(trace, buffer, 2);
+}
+
+void moas_trace_config(moas_trace *trace, const unsigned char *image,
+	size_t len)
+//----------------------------------------------------------------------
+// Record a configuration image
+//----------------------------------------------------------------------
+{
+	put_header(trace, MOAS_TRACE_CONFIG);
+	put_number(trace, len);
+	put(trace, image, len);
+}
+
+void moas_trace_write(moas_trace *trace, const char *buffer)
+//----------------------------------------------------------------------
+// Record replies and events
+//----------------------------------------------------------------------
+{
+	size_t len = strlen(buffer);
+
+	put_header(trace, MOAS_TRACE_WRITE);
+	put_number(trace, len);
+	put(trace, buffer, len);
+}
+
+void moas_trace_relays(moas_trace *trace, uint64_t relays, int inhibits)
+//----------------------------------------------------------------------
+// Record relay changes
+//----------------------------------------------------------------------
+{
+	unsigned char buffer[9];
+	int i;
+
+	for (i=0; i<8; i++) {
+		buffer[i] = (unsigned char)(relays >> (8*i));
+	}
+	buffer[8] = (unsigned char)inhibits;
+
+	put_header(trace, MOAS_TRACE_RELAYS);
+	put(trace, buffer, 9);
+}
+
+void moas_trace_antennas(moas_trace *trace, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Record antenna changes
+//----------------------------------------------------------------------
+{
+	unsigned char buffer[2*MOAS_STATIONS];
+	int i;
+
+	for (i=0; i<MOAS_STATIONS; i++) {
+		buffer[i] = (unsigned char)tx[i];
+		buffer[MOAS_STATIONS+i] = (unsigned char)rx[i];
+	}
+
+	put_header(trace, MOAS_TRACE_ANTENNAS);
+	put(trace, buffer, 2*MOAS_STATIONS);
+}
+
+int moas_trace_flush(moas_trace *trace)
+//----------------------------------------------------------------------
+// Write out what is recorded
+//----------------------------------------------------------------------
+{
+	if (fflush(trace->file) != 0) {
+		trace->failed = TRUE;
+	}
+	return !trace->failed;
+}
+
+moas_trace *moas_trace_open(const char *path)
+//----------------------------------------------------------------------
+// Read a trace file
+//----------------------------------------------------------------------
+{
+	moas_trace *trace;
+	FILE *file;
+	long len;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+
+	trace = (moas_trace *)calloc(1, sizeof(moas_trace));
+	if ((trace == NULL) || (fseek(file, 0, SEEK_END) != 0) ||
+		((len = ftell(file)) < TRACE_MAGIC_LEN) ||
+		(fseek(file, 0, SEEK_SET) != 0)) {
+		free(trace);
+		fclose(file);
+		return NULL;
+	}
+
+	trace->len = (size_t)len;
+	trace->data = (unsigned char *)malloc(trace->len);
+	if ((trace->data == NULL) ||
+		(fread(trace->data, 1, trace->len, file) != trace->len) ||
+		(memcmp(trace->data, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0)) {
+		free(trace->data);
+		free(trace);
+		fclose(file);
+		return NULL;
+	}
+
+	fclose(file);
+	moas_trace_rewind(trace);
+	return trace;
+}
+
+static int
+get_number(moas_trace *trace, unsigned long long *n)
+//----------------------------------------------------------------------
+// Read a length or time.  Returns FALSE if the trace ends first.
+//----------------------------------------------------------------------
+{
+	unsigned long long value = 0;
+	unsigned char c;
+	int shift;
+
+	for (shift=0; shift<7*NUMBER_LEN; shift+=7) {
+		if (trace->pos >= trace->len) {
+			return FALSE;
+		}
+		c = trace->data[trace->pos++];
+		value |= (unsigned long long)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*n = value;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static const unsigned char *
+get(moas_trace *trace, size_t len)
+//----------------------------------------------------------------------
+// Take the next characters.  Returns NULL if the trace ends first.
+//----------------------------------------------------------------------
+{
+	const unsigned char *p;
+
+	if (trace->len - trace->pos < len) {
+		return NULL;
+	}
+	p = trace->data + trace->pos;
+	trace->pos += len;
+	return p;
+}
+
+int moas_trace_next(moas_trace *trace, moas_trace_record *record)
+//----------------------------------------------------------------------
+// Read the next record
+//----------------------------------------------------------------------
+{
+	const unsigned char *p;
+	unsigned long long n;
+	int i;
+
+	if (trace->pos >= trace->len) {
+		return 0;
+	}
+
+	record->type = trace->data[trace->pos++];
+	if (!get_number(trace, &n)) {
+		return -1;
+	}
+	trace->time += n;
+	record->time = trace->time;
+
+	switch (record->type) {
+	case MOAS_TRACE_INPUT:
+	case MOAS_TRACE_WRITE:
+	case MOAS_TRACE_CONFIG:
+		if (!get_number(trace, &n) || ((p = get(trace, (size_t)n)) == NULL)) {
+			return -1;
+		}
+		record->data = (const char *)p;
+		record->len = (size_t)n;
+		break;
+
+	case MOAS_TRACE_TXRX:
+		if ((p = get(trace, 2)) == NULL) {
+			return -1;
+		}
+		record->station = p[0];
+		record->state = p[1];
+		if ((record->station < 1) || (record->station > MOAS_STATIONS)) {
+			return -1;
+		}
+		break;
+
+	case MOAS_TRACE_RELAYS:
+		if ((p = get(trace, 9)) == NULL) {
+			return -1;
+		}
+		record->relays = 0;
+		for (i=0; i<8; i++) {
+			record->relays |= (uint64_t)p[i] << (8*i);
+		}
+		record->inhibits = p[8];
+		break;
+
+	case MOAS_TRACE_ANTENNAS:
+		if ((p = get(trace, 2*MOAS_STATIONS)) == NULL) {
+			return -1;
+		}
+		for (i=0; i<MOAS_STATIONS; i++) {
+			record->tx[i] = p[i];
+			record->rx[i] = p[MOAS_STATIONS+i];
+		}
+		break;
+
+	default:
+		return -1;
+	}
+	return 1;
+}
+
+void moas_trace_rewind(moas_trace *trace)
+//----------------------------------------------------------------------
+// Start reading from the first record again
+//----------------------------------------------------------------------
+{
+	trace->pos = TRACE_MAGIC_LEN;
+	trace->time = 0;
+}
+
+int moas_trace_close(moas_trace *trace)
+//----------------------------------------------------------------------
+// Finish with a trace
+//----------------------------------------------------------------------
+{
+	int ok = TRUE;
+
+	if (trace == NULL) {
+		return TRUE;
+	}
+
+	if (trace->file) {
+		moas_trace_flush(trace);
+		if (fclose(trace->file) != 0) {
+			trace->failed = TRUE;
+		}
+		ok = !trace->failed;
+	}
+
+	free(trace->data);
+	free(trace);
+	return ok;
+}
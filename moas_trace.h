@@ -0,0 +1,194 @@
+//345678901234567890123456789012345678901234567890123456789012345678901234567890
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator session traces
+//
+// A trace holds everything given to one switch, the characters from the
+// serial port and the transmit/receive changes, and everything the
+// switch reported, each with the time it happened.  A host records a
+// trace while it runs and moas_replay gives it to a switch again later
+// to check the switch does the same thing.
+//
+// Times are taken from the computer's clock unless the host gives the
+// trace its own, as a host which moves the time of the switch's timers
+// itself does.  moas_replay runs the switch's timers on the recorded
+// times.
+//
+// A trace starts with the eight characters "MOASTRC1".  Each record
+// after that is a type character, the time since the previous record
+// in nanoseconds and the contents of the record.  Lengths and times are
+// written seven bits to a byte, low bits first, with the top bit set in
+// every byte but the last.
+//
+//    I time len chars     Characters given to the switch
+//    T time station state Transmit/receive change, one byte each
+//    W time len chars     Replies and events written by the switch
+//    R time relays inhibits  Relays changed, eight bytes low byte
+//                         first, then one byte of inhibits
+//    A time tx rx         Antennas changed, six bytes of each
+//    C time len image     Configuration image loaded into the switch
+
+#ifndef MOAS_TRACE_H
+#define MOAS_TRACE_H
+
+#include "moas.h"
+
+// Record types
+#define MOAS_TRACE_INPUT    'I'
+#define MOAS_TRACE_TXRX     'T'
+#define MOAS_TRACE_WRITE    'W'
+#define MOAS_TRACE_RELAYS   'R'
+#define MOAS_TRACE_ANTENNAS 'A'
+#define MOAS_TRACE_CONFIG   'C'
+
+typedef struct moas_trace moas_trace;
+
+// One record read from a trace
+typedef struct moas_trace_record {
+	int type;
+
+	// Nanoseconds since the trace was started
+	unsigned long long time;
+
+	// Characters for input and write records and the image for
+	// configuration records.  They point into the trace and are not
+	// null terminated.
+	const char *data;
+	size_t len;
+
+	// Transmit/receive records
+	int station;
+	int state;
+
+	// Relay records
+	uint64_t relays;
+	int inhibits;
+
+	// Antenna records
+	int tx[MOAS_STATIONS];
+	int rx[MOAS_STATIONS];
+} moas_trace_record;
+
+// Start recording a trace
+// Routine:  moas_trace_create
+//
+// Inputs:
+//    path    File to write.  It is replaced if it exists.
+// Outputs:
+//    Returns the trace or NULL if the file cannot be written
+moas_trace *moas_trace_create(const char *path);
+
+// Take the times of the records from the host's clock instead of the
+// computer's.  Call this before anything is recorded.
+// Routine:  moas_trace_clock
+//
+// Inputs:
+//    trace   Trace being recorded
+//    clock   Routine to read the time in nanoseconds.  It must never go
+//            back.
+//    user    Value passed to clock
+void moas_trace_clock(moas_trace *trace,
+	unsigned long long (*clock)(void *user), void *user);
+
+// Record characters given to the switch.  Call this before giving them
+// to the switch.
+// Routine:  moas_trace_input
+//
+// Inputs:
+//    trace   Trace being recorded
+//    buffer  Characters
+//    len     Number of characters
+void moas_trace_input(moas_trace *trace, const char *buffer, size_t len);
+
+// Record a transmit/receive change.  Call this before giving it to the
+// switch.
+// Routine:  moas_trace_txrx
+//
+// Inputs:
+//    trace   Trace being recorded
+//    station Station which is transmitting or receiving
+//    state   TRUE if transmitting, FALSE if receiving
+void moas_trace_txrx(moas_trace *trace, int station, int state);
+
+// Record a configuration image.  Call this before loading it into the
+// switch.
+// Routine:  moas_trace_config
+//
+// Inputs:
+//    trace   Trace being recorded
+//    image   Configuration image
+//    len     Length of the image
+void moas_trace_config(moas_trace *trace, const unsigned char *image,
+	size_t len);
+
+// Record replies and events.  Call this from the write callback.
+// Routine:  moas_trace_write
+//
+// Inputs:
+//    trace   Trace being recorded
+//    buffer  Null terminated string given to the write callback
+void moas_trace_write(moas_trace *trace, const char *buffer);
+
+// Record relay changes.  Call this from the relays_changed callback.
+// Routine:  moas_trace_relays
+//
+// Inputs:
+//    trace   Trace being recorded
+//    relays  All relays which are selected
+//    inhibits All stations which are inhibited
+void moas_trace_relays(moas_trace *trace, uint64_t relays, int inhibits);
+
+// Record antenna changes.  Call this from the antennas_changed callback.
+// Routine:  moas_trace_antennas
+//
+// Inputs:
+//    trace   Trace being recorded
+//    tx, rx  Antennas given to the callback
+void moas_trace_antennas(moas_trace *trace, const int *tx, const int *rx);
+
+// Write everything recorded so far to the file
+// Routine:  moas_trace_flush
+//
+// Inputs:
+//    trace   Trace being recorded
+// Outputs:
+//    Returns FALSE if the file could not be written
+int moas_trace_flush(moas_trace *trace);
+
+// Read a whole trace into memory
+// Routine:  moas_trace_open
+//
+// Inputs:
+//    path    File to read
+// Outputs:
+//    Returns the trace or NULL if it cannot be read or is not a trace
+moas_trace *moas_trace_open(const char *path);
+
+// Get the next record of a trace which was opened
+// Routine:  moas_trace_next
+//
+// Inputs:
+//    trace   Trace being read
+//    record  Filled in with the record
+// Outputs:
+//    Returns 1 for a record, 0 at the end of the trace and -1 if the
+//    trace is damaged
+int moas_trace_next(moas_trace *trace, moas_trace_record *record);
+
+// Go back to the first record of a trace which was opened
+// Routine:  moas_trace_rewind
+//
+// Inputs:
+//    trace   Trace being read
+void moas_trace_rewind(moas_trace *trace);
+
+// Finish with a trace.  A trace being recorded is written out.
+// Routine:  moas_trace_close
+//
+// Inputs:
+//    trace   Trace.  NULL is ignored.
+// Outputs:
+//    Returns FALSE if a recorded trace could not be written
+int moas_trace_close(moas_trace *trace);
+
+#endif
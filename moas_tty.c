@@ -0,0 +1,654 @@
+// Copyright 2013, 2014 Paul Young.  All Rights Reserved
+//
+// MOAS II emulator - Linux serial port host
+//
+// This runs one emulated switch on a serial device or, if no device is
+// given, on a new pseudo-terminal.  The name of the pseudo-terminal is
+// printed so logging software can be pointed at it.
+//
+//    moas_tty [-b baud] [-q] [-l depth] [-w trace] [-c image] [device]
+//
+//    -b baud   Line speed, default 9600
+//    -q        Do not print relay and antenna changes
+//    -l depth  Pace replies and events like the switch's output queue
+//              of depth messages on a line of the chosen speed, and
+//              print what the queue did when the host stops.  This
+//              is for a pseudo-terminal, which has no speed of its own.
+//    -w trace  Record a trace of the session for moas_replay
+//    -c image  Load a configuration image into the switch at startup
+//
+// Lines typed on standard input control the transmit/receive state:
+//
+//    tN        Station N transmits
+//    rN        Station N receives
+//    q         Quit
+//
+// Relay and antenna changes are printed on standard output.
+//
+// The line is read without blocking, so the switch's timers, standard
+// input and signals are handled however the characters arrive.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "moas.h"
+#include "moas_config.h"
+#include "moas_line.h"
+#include "moas_timer.h"
+#include "moas_trace.h"
+
+#undef FALSE
+#undef TRUE
+
+#define FALSE   0
+#define TRUE    1
+
+#define READ_LEN 4096
+
+// Everything the host needs while it runs
+typedef struct tty_host {
+	moas_ctx *sw;
+
+	// The switch's timers, run between events
+	moas_wheel *wheel;
+
+	// Model of the switch's output queue, or NULL to send at once
+	moas_line *output;
+
+	// The device or pseudo-terminal master the switch talks on
+	int fd;
+
+	// The pseudo-terminal slave is held open so the master does not
+	// see a hangup while no program has it open
+	int slave;
+
+	int quiet;
+
+	// Trace being recorded, or NULL
+	moas_trace *trace;
+
+	int epfd;
+
+	// Standard input line being collected
+	char line[64];
+	int line_len;
+} tty_host;
+
+static const struct {
+	int baud;
+	speed_t speed;
+} speeds[] = {
+	{ 1200, B1200 },
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+};
+
+static void
+usage(void)
+//----------------------------------------------------------------------
+// Describe the arguments and exit
+//----------------------------------------------------------------------
+{
+	fprintf(stderr,
+		"usage: moas_tty [-b baud] [-q] [-l depth] [-w trace] [-c image] "
+		"[device]\n");
+	exit(2);
+}
+
+static void
+tty_send(void *user, const char *buffer, size_t len)
+//----------------------------------------------------------------------
+// Send replies and events on the device
+//----------------------------------------------------------------------
+{
+	tty_host *host = (tty_host *)user;
+	struct pollfd pfd;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(host->fd, buffer, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			// The line is full, so wait for it to take more
+			if (errno == EAGAIN) {
+				pfd.fd = host->fd;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			perror("moas_tty: write");
+			return;
+		}
+		buffer += n;
+		len -= n;
+	}
+}
+
+static void
+tty_write(void *user, const char *buffer)
+//----------------------------------------------------------------------
+// Send or queue replies and events from the switch
+//----------------------------------------------------------------------
+{
+	tty_host *host = (tty_host *)user;
+
+	if (host->trace) {
+		moas_trace_write(host->trace, buffer);
+	}
+
+	if (host->output) {
+		moas_line_write(host->output, buffer);
+	}
+	else {
+		tty_send(host, buffer, strlen(buffer));
+	}
+}
+
+static void
+tty_relays(void *user, uint64_t changed, uint64_t relays,
+	int changed_inhibits, int inhibits)
+//----------------------------------------------------------------------
+// Print relay and inhibit changes
+//----------------------------------------------------------------------
+{
+	tty_host *host = (tty_host *)user;
+
+	if (host->trace) {
+		moas_trace_relays(host->trace, relays, inhibits);
+	}
+
+	if (!host->quiet) {
+		printf("relays %016llx inhibits %02x\n",
+			   (unsigned long long)relays, inhibits);
+		fflush(stdout);
+	}
+}
+
+static void
+tty_antennas(void *user, int changed, const int *tx, const int *rx)
+//----------------------------------------------------------------------
+// Print antenna changes
+//----------------------------------------------------------------------
+{
+	tty_host *host = (tty_host *)user;
+	int i;
+
+	if (host->trace) {
+		moas_trace_antennas(host->trace, tx, rx);
+	}
+
+	if (!host->quiet) {
+		printf("antennas");
+		for (i=0; i<MOAS_STATIONS; i++) {
+			printf(" %d/%d", tx[i], rx[i]);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+static int
+set_raw(int fd, speed_t speed)
+//----------------------------------------------------------------------
+// Put a terminal in raw mode at a speed
+//----------------------------------------------------------------------
+{
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio) < 0) {
+		return FALSE;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+static int
+open_pty(tty_host *host, speed_t speed)
+//----------------------------------------------------------------------
+// Create a pseudo-terminal and print the name of its slave
+//----------------------------------------------------------------------
+{
+	const char *name;
+
+	host->fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+	if (host->fd < 0) {
+		perror("moas_tty: posix_openpt");
+		return FALSE;
+	}
+
+	if ((grantpt(host->fd) < 0) || (unlockpt(host->fd) < 0) ||
+		((name = ptsname(host->fd)) == NULL)) {
+		perror("moas_tty: pseudo-terminal");
+		return FALSE;
+	}
+
+	host->slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (host->slave < 0) {
+		perror("moas_tty: open slave");
+		return FALSE;
+	}
+
+	// Programs opening the slave get a raw line
+	if (!set_raw(host->slave, speed)) {
+		perror("moas_tty: tcsetattr");
+		return FALSE;
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+	return TRUE;
+}
+
+static int
+open_device(tty_host *host, const char *device, speed_t speed)
+//----------------------------------------------------------------------
+// Open and set up a serial device
+//----------------------------------------------------------------------
+{
+	host->fd = open(device, O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+	if (host->fd < 0) {
+		perror(device);
+		return FALSE;
+	}
+
+	if (!set_raw(host->fd, speed)) {
+		perror("moas_tty: tcsetattr");
+		return FALSE;
+	}
+
+	tcflush(host->fd, TCIOFLUSH);
+	return TRUE;
+}
+
+static int
+read_switch(tty_host *host)
+//----------------------------------------------------------------------
+// Give everything waiting on the line to the switch.  The descriptor
+// does not block, so this reads until the line is empty.
+//----------------------------------------------------------------------
+{
+	char buffer[READ_LEN];
+	ssize_t n;
+
+	for (;;) {
+		n = read(host->fd, buffer, sizeof(buffer));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return TRUE;
+			}
+			perror("moas_tty: read");
+			return FALSE;
+		}
+
+		// Nothing was waiting after all
+		if (n == 0) {
+			return TRUE;
+		}
+
+		if (host->trace) {
+			moas_trace_input(host->trace, buffer, (size_t)n);
+		}
+		moas_feed_ctx(host->sw, buffer, (size_t)n);
+	}
+}
+
+static int
+read_control(tty_host *host)
+//----------------------------------------------------------------------
+// Handle lines from standard input.  Returns FALSE to quit.
+//----------------------------------------------------------------------
+{
+	char buffer[256];
+	ssize_t n;
+	ssize_t i;
+	char c;
+	int station;
+
+	n = read(STDIN_FILENO, buffer, sizeof(buffer));
+	if (n < 0) {
+		return errno == EINTR;
+	}
+
+	// At the end of standard input the switch keeps running
+	if (n == 0) {
+		epoll_ctl(host->epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+		return TRUE;
+	}
+
+	for (i=0; i<n; i++) {
+		c = buffer[i];
+		if (c != '\n') {
+			if (host->line_len < (int)sizeof(host->line) - 1) {
+				host->line[host->line_len++] = c;
+			}
+			continue;
+		}
+
+		host->line[host->line_len] = '\0';
+		host->line_len = 0;
+
+		switch (host->line[0]) {
+		case 't':
+		case 'r':
+			station = atoi(host->line + 1);
+			if ((station < 1) || (station > MOAS_STATIONS)) {
+				fprintf(stderr, "moas_tty: bad station\n");
+				break;
+			}
+			if (host->trace) {
+				moas_trace_txrx(host->trace, station, host->line[0] == 't');
+			}
+			moas_txrx_ctx(host->sw, station, host->line[0] == 't');
+			break;
+
+		case 'q':
+			return FALSE;
+
+		case '\0':
+			break;
+
+		default:
+			fprintf(stderr, "moas_tty: commands are tN, rN and q\n");
+			break;
+		}
+	}
+	return TRUE;
+}
+
+static int
+add_fd(int epfd, int fd)
+//----------------------------------------------------------------------
+// Watch a descriptor for input
+//----------------------------------------------------------------------
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static uint64_t
+monotonic_clock(void *user)
+//----------------------------------------------------------------------
+// The clock for the switch's timers in microseconds
+//----------------------------------------------------------------------
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+wait_time(moas_wheel *wheel)
+//----------------------------------------------------------------------
+// Return how many milliseconds to wait for events before the next timer
+// is due, or -1 if no timer is running
+//----------------------------------------------------------------------
+{
+	uint64_t when;
+	uint64_t now;
+	uint64_t ms;
+
+	if (!moas_wheel_next(wheel, &when)) {
+		return -1;
+	}
+	now = moas_wheel_now(wheel);
+	if (when <= now) {
+		return 0;
+	}
+	ms = (when - now + 999) / 1000;
+	return (ms > INT_MAX) ? INT_MAX : (int)ms;
+}
+
+static void
+print_line_stats(moas_line *line)
+//----------------------------------------------------------------------
+// Report what the output queue did
+//----------------------------------------------------------------------
+{
+	moas_line_stats stats;
+
+	moas_line_read_stats(line, &stats);
+	fprintf(stderr, "moas_tty: messages %llu dropped %llu max_depth %d "
+			"delay_mean_ms %.3f delay_max_ms %.3f\n",
+			stats.messages, stats.dropped, stats.max_depth,
+			stats.sent ? stats.delay_total / 1000.0 / stats.sent : 0.0,
+			stats.delay_max / 1000.0);
+}
+
+int main(int argc, char **argv)
+//----------------------------------------------------------------------
+// Run a switch until told to quit
+//----------------------------------------------------------------------
+{
+	tty_host host;
+	unsigned char image[MOAS_CONFIG_LEN];
+	moas_callbacks callbacks;
+	struct epoll_event events[4];
+	sigset_t signals;
+	speed_t speed = 0;
+	int baud = 9600;
+	const char *trace_path = NULL;
+	const char *config = NULL;
+	int epfd;
+	int sigfd;
+	int running = TRUE;
+	int depth = 0;
+	int opt;
+	int n;
+	int i;
+
+	memset(&host, 0, sizeof(host));
+	host.fd = -1;
+	host.slave = -1;
+
+	while ((opt = getopt(argc, argv, "b:ql:w:c:")) != -1) {
+		switch (opt) {
+		case 'b':
+			baud = atoi(optarg);
+			break;
+		case 'q':
+			host.quiet = TRUE;
+			break;
+		case 'l':
+			depth = atoi(optarg);
+			if (depth < 1) {
+				usage();
+			}
+			break;
+		case 'w':
+			trace_path = optarg;
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc - 1) {
+		usage();
+	}
+
+	for (i=0; i<(int)(sizeof(speeds)/sizeof(speeds[0])); i++) {
+		if (speeds[i].baud == baud) {
+			speed = speeds[i].speed;
+		}
+	}
+	if (speed == 0) {
+		fprintf(stderr, "moas_tty: unsupported baud rate %d\n", baud);
+		return 2;
+	}
+
+	if (optind < argc) {
+		if (!open_device(&host, argv[optind], speed)) {
+			return 1;
+		}
+	}
+	else {
+		if (!open_pty(&host, speed)) {
+			return 1;
+		}
+	}
+
+	// Signals which stop the host are read through the event loop
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+	sigfd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if ((sigfd < 0) || (epfd < 0) || !add_fd(epfd, host.fd) ||
+		!add_fd(epfd, sigfd)) {
+		perror("moas_tty: epoll");
+		return 1;
+	}
+	host.epfd = epfd;
+
+	// Standard input may be a file which cannot be watched, in which
+	// case there is no control
+	add_fd(epfd, STDIN_FILENO);
+
+	// The trace starts before the switch so it sees everything
+	if (trace_path) {
+		host.trace = moas_trace_create(trace_path);
+		if (host.trace == NULL) {
+			perror(trace_path);
+			return 1;
+		}
+	}
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.write = tty_write;
+	callbacks.relays_changed = tty_relays;
+	callbacks.antennas_changed = tty_antennas;
+
+	host.wheel = moas_wheel_create(monotonic_clock, NULL);
+	host.sw = moas_create(&callbacks, &host);
+	if ((host.wheel == NULL) || (host.sw == NULL)) {
+		fprintf(stderr, "moas_tty: no memory\n");
+		return 1;
+	}
+	moas_timers_ctx(host.sw, host.wheel);
+	if (depth) {
+		host.output = moas_line_create(host.wheel, baud, depth, tty_send,
+									   &host);
+		if (host.output == NULL) {
+			fprintf(stderr, "moas_tty: no memory\n");
+			return 1;
+		}
+		moas_line_report(host.output, host.sw);
+	}
+	if (config) {
+		// The trace holds the image so a replay starts the same way
+		if (!moas_config_read(config, image)) {
+			fprintf(stderr, "moas_tty: %s is not a configuration image\n",
+					config);
+			return 1;
+		}
+		if (host.trace) {
+			moas_trace_config(host.trace, image, MOAS_CONFIG_LEN);
+		}
+		if (!moas_load_config_ctx(host.sw, image, MOAS_CONFIG_LEN)) {
+			fprintf(stderr, "moas_tty: %s is not a configuration image\n",
+					config);
+			return 1;
+		}
+	}
+
+	while (running) {
+		n = epoll_wait(epfd, events, 4, wait_time(host.wheel));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("moas_tty: epoll_wait");
+			break;
+		}
+
+		// Timers which are due go first, so a trace shows them before
+		// the input which woke the host
+		moas_wheel_run(host.wheel);
+
+		for (i=0; i<n; i++) {
+			if (events[i].data.fd == host.fd) {
+				running = read_switch(&host);
+			}
+			else if (events[i].data.fd == STDIN_FILENO) {
+				if (!read_control(&host)) {
+					running = FALSE;
+				}
+			}
+			else {
+				running = FALSE;
+			}
+			if (!running) {
+				break;
+			}
+		}
+
+		moas_wheel_run(host.wheel);
+
+		// The trace is kept up to date in case the host is killed
+		if (host.trace && !moas_trace_flush(host.trace)) {
+			perror("moas_tty: trace");
+			moas_trace_close(host.trace);
+			host.trace = NULL;
+		}
+	}
+
+	moas_destroy(host.sw);
+	if (host.output) {
+		print_line_stats(host.output);
+		moas_line_destroy(host.output);
+	}
+	moas_wheel_destroy(host.wheel);
+	if (host.trace && !moas_trace_close(host.trace)) {
+		perror("moas_tty: trace");
+	}
+	close(epfd);
+	close(sigfd);
+	if (host.slave >= 0) {
+		close(host.slave);
+	}
+	close(host.fd);
+	return 0;
+}